@@ -0,0 +1,259 @@
+#ifndef MATRIXTEMPLATE_AUTOTUNER_H
+#define MATRIXTEMPLATE_AUTOTUNER_H
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <typeinfo>
+#include <vector>
+#include "Gemm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+/**
+ * Sizes in bytes of the data caches of the machine
+ */
+struct CacheSizes {
+    size_t l1, l2, l3;
+
+    /**
+     * Reads the sizes from sysfs, then from cpuid, and falls back to common values when neither is available
+     */
+    static CacheSizes detect() {
+        CacheSizes sizes = {0, 0, 0};
+        for (unsigned index = 0; index < 8; index++) {
+            std::string base = "/sys/devices/system/cpu/cpu0/cache/index" + std::to_string(index) + "/";
+            std::ifstream levelFile(base + "level"), typeFile(base + "type"), sizeFile(base + "size");
+            unsigned level;
+            std::string type, size;
+            if (!(levelFile >> level) || !(typeFile >> type) || !(sizeFile >> size) || type == "Instruction") {
+                continue;
+            }
+            sizes.set(level, parseSize(size));
+        }
+#if defined(__x86_64__) || defined(__i386__)
+        if (sizes.l1 == 0) {
+            //Deterministic cache parameters leaf
+            for (unsigned index = 0; index < 8; index++) {
+                unsigned eax, ebx, ecx, edx;
+                if (!__get_cpuid_count(4, index, &eax, &ebx, &ecx, &edx) || (eax & 0x1f) == 0) {
+                    break;
+                }
+                if ((eax & 0x1f) == 2) {
+                    continue;
+                }
+                size_t ways = ((ebx >> 22) & 0x3ff) + 1, partitions = ((ebx >> 12) & 0x3ff) + 1;
+                size_t lineSize = (ebx & 0xfff) + 1, sets = (size_t) ecx + 1;
+                sizes.set((eax >> 5) & 0x7, ways * partitions * lineSize * sets);
+            }
+        }
+#endif
+        if (sizes.l1 == 0) {
+            sizes.l1 = 32 * 1024;
+        }
+        if (sizes.l2 == 0) {
+            sizes.l2 = 256 * 1024;
+        }
+        if (sizes.l3 == 0) {
+            sizes.l3 = sizes.l2;
+        }
+        return sizes;
+    }
+
+private:
+    void set(unsigned level, size_t size) {
+        if (level == 1) {
+            this->l1 = size;
+        } else if (level == 2) {
+            this->l2 = size;
+        } else if (level == 3) {
+            this->l3 = size;
+        }
+    }
+
+    static size_t parseSize(const std::string &size) {
+        size_t value = std::strtoul(size.c_str(), nullptr, 10);
+        char unit = size.empty() ? ' ' : size.back();
+        if (unit == 'K') {
+            value *= 1024;
+        } else if (unit == 'M') {
+            value *= 1024 * 1024;
+        }
+        return value;
+    }
+};
+
+/**
+ * Chooses the blocking (mc, kc, nc) used by the multiplication, for each type of data.
+ *
+ * The first time a type is used, the blocking is read from the cache file (MATRIX_TUNING_CACHE, or
+ * matrixtemplate-tuning.txt inside XDG_CACHE_HOME or ~/.cache). If it is not there, it is derived from the cache sizes
+ * and refined by timing a few candidates around it, then saved in the cache file.
+ * Setting MATRIX_AUTOTUNE=0 skips the timing, and uses the blocking derived from the cache sizes.
+ */
+class Autotuner {
+public:
+
+    /**
+     * @return the blocking to use for the given type. Computed once per process.
+     */
+    template<typename T>
+    static const GemmBlocking &blocking() {
+        static const GemmBlocking tuned = tune<T>();
+        return tuned;
+    }
+
+    static const CacheSizes &cacheSizes() {
+        static const CacheSizes sizes = CacheSizes::detect();
+        return sizes;
+    }
+
+    /**
+     * @return the blocking derived only from the cache sizes of this machine
+     */
+    template<typename T>
+    static GemmBlocking heuristicBlocking() {
+        return heuristicBlocking<T>(cacheSizes());
+    }
+
+    /**
+     * @return the blocking derived only from the given cache sizes: a kc x NR sliver of B fills half of L1,
+     * a mc x kc panel of A half of L2, and a kc x nc panel of B a quarter of L3
+     */
+    template<typename T>
+    static GemmBlocking heuristicBlocking(const CacheSizes &caches) {
+        const unsigned MR = Gemm<T>::MR, NR = Gemm<T>::NR;
+        unsigned kc = clamp(caches.l1 / 2 / (NR * sizeof(T)), 64, 512);
+        unsigned mc = clamp(caches.l2 / 2 / (kc * sizeof(T)) / MR * MR, MR * 4, MR * 64);
+        unsigned nc = clamp(caches.l3 / 4 / (kc * sizeof(T)) / NR * NR, NR * 8, 2048);
+        return {mc, kc, nc};
+    }
+
+    /**
+     * Looks for the given key in the contents of a cache file, made of lines "key mc kc nc".
+     * Malformed lines, and the ones with a size equal to 0, are skipped.
+     * @return whether the key was found, in which case its blocking is stored in blocking
+     */
+    static bool readCached(std::istream &input, const std::string &key, GemmBlocking &blocking) {
+        std::string line;
+        while (std::getline(input, line)) {
+            std::istringstream fields(line);
+            std::string lineKey;
+            GemmBlocking stored;
+            if (fields >> lineKey >> stored.mc >> stored.kc >> stored.nc && lineKey == key &&
+                stored.mc > 0 && stored.kc > 0 && stored.nc > 0) {
+                blocking = stored;
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+
+    static unsigned clamp(size_t value, size_t min, size_t max) {
+        return (unsigned) std::max(min, std::min(max, value));
+    }
+
+    static std::string cacheFile() {
+        const char *env = std::getenv("MATRIX_TUNING_CACHE");
+        if (env != nullptr) {
+            return env;
+        }
+        env = std::getenv("XDG_CACHE_HOME");
+        if (env != nullptr) {
+            return std::string(env) + "/matrixtemplate-tuning.txt";
+        }
+        env = std::getenv("HOME");
+        return env == nullptr ? "" : std::string(env) + "/.cache/matrixtemplate-tuning.txt";
+    }
+
+    /**
+     * @return the key of the type on this machine. Results are not shared between machines with different caches.
+     */
+    template<typename T>
+    static std::string key() {
+        const CacheSizes &caches = cacheSizes();
+        std::ostringstream key;
+        key << typeid(T).name() << ":" << sizeof(T) << ":" << Gemm<T>::MR << "x" << Gemm<T>::NR << ":"
+            << caches.l1 << "/" << caches.l2 << "/" << caches.l3;
+        return key.str();
+    }
+
+    template<typename T>
+    static GemmBlocking tune() {
+        std::string file = cacheFile();
+        std::string typeKey = key<T>();
+        std::ifstream input(file);
+        GemmBlocking stored;
+        if (readCached(input, typeKey, stored)) {
+            return stored;
+        }
+
+        GemmBlocking best = heuristicBlocking<T>();
+        const char *enabled = std::getenv("MATRIX_AUTOTUNE");
+        if (enabled != nullptr && std::string(enabled) == "0") {
+            return best;
+        }
+        best = benchmarkAround<T>(best);
+        if (!file.empty()) {
+            std::ofstream output(file, std::ios::app);
+            output << typeKey << " " << best.mc << " " << best.kc << " " << best.nc << "\n";
+        }
+        return best;
+    }
+
+    /**
+     * Tunes one parameter at a time (kc, then mc, then nc), trying half and double of the current value
+     */
+    template<typename T>
+    static GemmBlocking benchmarkAround(GemmBlocking start) {
+        GemmBlocking best = start;
+        double bestTime = measure<T>(best);
+        unsigned GemmBlocking::*parameters[] = {&GemmBlocking::kc, &GemmBlocking::mc, &GemmBlocking::nc};
+        for (auto parameter : parameters) {
+            unsigned current = best.*parameter;
+            for (unsigned candidate : {current / 2, current * 2}) {
+                GemmBlocking tried = best;
+                tried.*parameter = candidate;
+                if (candidate < 16 || tried.nc > 4096) {
+                    continue;
+                }
+                double time = measure<T>(tried);
+                if (time < bestTime) {
+                    bestTime = time;
+                    best = tried;
+                }
+            }
+        }
+        return best;
+    }
+
+    /**
+     * @return the time per operation of the multiplication of a single mc x kc block by a kc x nc one, as done by
+     * each block of OptimizedMultiplyMD. Short runs are repeated, to reduce the noise.
+     */
+    template<typename T>
+    static double measure(const GemmBlocking &blocking) {
+        unsigned m = blocking.mc, k = blocking.kc, n = blocking.nc;
+        std::vector<T> a((size_t) m * k, T(1)), b((size_t) k * n, T(1)), c((size_t) m * n, T(0));
+        double best = 0;
+        double total = 0;
+        for (unsigned repetition = 0; repetition < 5 && total < 0.01; repetition++) {
+            auto start = std::chrono::steady_clock::now();
+            Gemm<T>::multiplyAdd(m, n, k, a.data(), k, b.data(), n, c.data(), n, blocking);
+            double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            if (repetition == 0 || time < best) {
+                best = time;
+            }
+            total += time;
+        }
+        return best / ((double) m * n * k);
+    }
+};
+
+#endif //MATRIXTEMPLATE_AUTOTUNER_H
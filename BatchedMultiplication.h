@@ -0,0 +1,194 @@
+#ifndef MATRIXTEMPLATE_BATCHEDMULTIPLICATION_H
+#define MATRIXTEMPLATE_BATCHEDMULTIPLICATION_H
+
+#include <vector>
+#include "StaticMatricSize.h"
+
+/**
+ * Many matrices of the same size, stored interleaved: the same cell of LANES consecutive matrices is contiguous, so
+ * that a vector register holds that cell for LANES matrices at once.
+ * The cell (r, c) of the matrix i is at <code>((i / LANES) * rows * columns + r * columns + c) * LANES + i % LANES</code>;
+ * the last group is padded with zero matrices.
+ * @tparam T type of the data
+ */
+template<typename T>
+class BatchedMatrices {
+public:
+    static const unsigned LANES = Simd<T>::WIDTH;
+
+private:
+    unsigned _count, _rows, _columns;
+    std::shared_ptr<T> values;
+
+public:
+    BatchedMatrices(unsigned count, unsigned rows, unsigned columns) :
+            _count(count), _rows(rows), _columns(columns),
+            values(MatrixAllocator::allocateArray<T>((size_t) groups() * groupSize())) {
+    }
+
+    /**
+     * @return the number of matrices
+     */
+    unsigned count() const {
+        return this->_count;
+    }
+
+    unsigned rows() const {
+        return this->_rows;
+    }
+
+    unsigned columns() const {
+        return this->_columns;
+    }
+
+    T get(unsigned index, unsigned row, unsigned col) const {
+        return this->values.get()[this->position(index, row, col)];
+    }
+
+    void set(unsigned index, unsigned row, unsigned col, T t) {
+        this->values.get()[this->position(index, row, col)] = t;
+    }
+
+    /**
+     * Copies the given matrix in the given position
+     */
+    template<class MD>
+    void set(unsigned index, const Matrix<T, MD> &matrix) {
+        if (matrix.rows() != this->_rows || matrix.columns() != this->_columns) {
+            Utils::error("All the matrices of a batch must be of the same size");
+        }
+        std::vector<T> buffer((size_t) this->_rows * this->_columns);
+        matrix.getData().virtualMaterializeInto(buffer.data(), this->_columns, 0, 0, this->_rows, this->_columns);
+        T *destination = this->values.get() + this->position(index, 0, 0);
+        for (size_t cell = 0; cell < buffer.size(); cell++) {
+            destination[cell * LANES] = buffer[cell];
+        }
+    }
+
+    /**
+     * @return a copy of the matrix in the given position
+     */
+    Matrix<T> get(unsigned index) const {
+        Matrix<T> ret(this->_rows, this->_columns);
+        this->copyTo(index, ret.getData().rawData());
+        return ret;
+    }
+
+    /**
+     * Multiplies each matrix by the matrix in the same position of another batch
+     */
+    BatchedMatrices<T> multiply(const BatchedMatrices<T> &right) const {
+        if (this->_count != right._count) {
+            Utils::error("The batches must contain the same number of matrices");
+        } else if (this->_columns != right._rows) {
+            Utils::error("Multiplication should be performed on compatible matrices");
+        }
+        BatchedMatrices<T> ret(this->_count, this->_rows, right._columns);
+        multiplyGroups(RuntimeShape{this->_rows, this->_columns, right._columns}, *this, right, ret);
+        return ret;
+    }
+
+    /**
+     * Multiplies each matrix of left by the matrix in the same position of right, in a single parallel pass
+     */
+    template<class MD1, class MD2>
+    static std::vector<Matrix<T>> multiply(const std::vector<Matrix<T, MD1>> &left, const std::vector<Matrix<T, MD2>> &right) {
+        if (left.empty() || left.size() != right.size()) {
+            Utils::error("The batches must contain the same number of matrices");
+        }
+        auto product = pack(left).multiply(pack(right));
+        std::vector<Matrix<T>> ret;
+        ret.reserve(product.count());
+        for (unsigned i = 0; i < product.count(); i++) {
+            ret.push_back(product.get(i));
+        }
+        return ret;
+    }
+
+    /**
+     * Same as above, with the sizes known at compile time: the loops of the kernel have constant bounds
+     */
+    template<unsigned ROWS, unsigned INNER, unsigned COLUMNS, class MD1, class MD2>
+    static std::vector<StaticSizeMatrix<ROWS, COLUMNS, T>> multiply(const std::vector<StaticSizeMatrix<ROWS, INNER, T, MD1>> &left,
+                                                                    const std::vector<StaticSizeMatrix<INNER, COLUMNS, T, MD2>> &right) {
+        if (left.empty() || left.size() != right.size()) {
+            Utils::error("The batches must contain the same number of matrices");
+        }
+        BatchedMatrices<T> product(left.size(), ROWS, COLUMNS);
+        multiplyGroups(StaticShape<ROWS, INNER, COLUMNS>(), pack(left), pack(right), product);
+        std::vector<StaticSizeMatrix<ROWS, COLUMNS, T>> ret(product.count());
+        for (unsigned i = 0; i < product.count(); i++) {
+            product.copyTo(i, ret[i].getData().rawData());
+        }
+        return ret;
+    }
+
+private:
+
+    struct RuntimeShape {
+        unsigned rows, inner, columns;
+    };
+
+    template<unsigned ROWS, unsigned INNER, unsigned COLUMNS>
+    struct StaticShape {
+        static const unsigned rows = ROWS, inner = INNER, columns = COLUMNS;
+    };
+
+    unsigned groups() const {
+        return Utils::ceilDiv(this->_count, LANES);
+    }
+
+    size_t groupSize() const {
+        return (size_t) this->_rows * this->_columns * LANES;
+    }
+
+    size_t position(unsigned index, unsigned row, unsigned col) const {
+        return (index / LANES) * this->groupSize() + ((size_t) row * this->_columns + col) * LANES + index % LANES;
+    }
+
+    void copyTo(unsigned index, T *destination) const {
+        const T *source = this->values.get() + this->position(index, 0, 0);
+        for (size_t cell = 0; cell < (size_t) this->_rows * this->_columns; cell++) {
+            destination[cell] = source[cell * LANES];
+        }
+    }
+
+    template<class M>
+    static BatchedMatrices<T> pack(const std::vector<M> &matrices) {
+        BatchedMatrices<T> ret(matrices.size(), matrices[0].rows(), matrices[0].columns());
+        for (unsigned i = 0; i < matrices.size(); i++) {
+            ret.set(i, matrices[i]);
+        }
+        return ret;
+    }
+
+    /**
+     * Computes the products of all the groups, each one with a register holding a cell of LANES products
+     */
+    template<class Shape>
+    static void multiplyGroups(Shape shape, const BatchedMatrices<T> &left, const BatchedMatrices<T> &right,
+                               BatchedMatrices<T> &result) {
+        typedef Simd<T> S;
+        const T *a = left.values.get(), *b = right.values.get();
+        T *c = result.values.get();
+        size_t aSize = left.groupSize(), bSize = right.groupSize(), cSize = result.groupSize();
+        ThreadPool::shared().parallelFor(0, result.groups(), cSize * shape.inner, [&](unsigned first, unsigned last) {
+            for (unsigned g = first; g < last; g++) {
+                const T *ga = a + g * aSize, *gb = b + g * bSize;
+                T *gc = c + g * cSize;
+                for (unsigned r = 0; r < shape.rows; r++) {
+                    for (unsigned col = 0; col < shape.columns; col++) {
+                        typename S::Vector sum = S::zero();
+                        for (unsigned k = 0; k < shape.inner; k++) {
+                            sum = S::multiplyAdd(S::load(ga + ((size_t) r * shape.inner + k) * LANES),
+                                                 S::load(gb + ((size_t) k * shape.columns + col) * LANES), sum);
+                        }
+                        S::store(gc + ((size_t) r * shape.columns + col) * LANES, sum);
+                    }
+                }
+            }
+        });
+    }
+};
+
+#endif //MATRIXTEMPLATE_BATCHEDMULTIPLICATION_H
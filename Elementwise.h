@@ -0,0 +1,372 @@
+#ifndef MATRIXTEMPLATE_ELEMENTWISE_H
+#define MATRIXTEMPLATE_ELEMENTWISE_H
+
+#include <type_traits>
+#include <vector>
+#include "MultipleMethod.h"
+
+/*
+ * Lazy element-wise operations: each cell of the result is computed from the cells in the same position of the
+ * operands. An operation is a functor on the values; the ones with VECTORIZED set also have a method vector() working
+ * on a register of <code>Simd</code>, and are evaluated a register at a time.
+ *
+ * Like <code>Sum</code>, a tree of these operations is evaluated in a single pass: each strip of rows is written by
+ * the first operand and then combined with the others while it is still in cache, so no temporary matrix is created.
+ */
+
+/**
+ * a * factor
+ */
+template<typename T>
+struct ScaleOp {
+    static const bool VECTORIZED = true;
+    T factor;
+
+    T operator()(T a) const { return a * this->factor; }
+
+    typename Simd<T>::Vector vector(typename Simd<T>::Vector a) const {
+        return Simd<T>::multiply(a, Simd<T>::broadcast(this->factor));
+    }
+};
+
+/**
+ * -a
+ */
+template<typename T>
+struct NegateOp {
+    static const bool VECTORIZED = true;
+
+    T operator()(T a) const { return -a; }
+
+    typename Simd<T>::Vector vector(typename Simd<T>::Vector a) const { return Simd<T>::subtract(Simd<T>::zero(), a); }
+};
+
+/**
+ * a - b
+ */
+template<typename T>
+struct SubtractOp {
+    static const bool VECTORIZED = true;
+
+    T operator()(T a, T b) const { return a - b; }
+
+    typename Simd<T>::Vector vector(typename Simd<T>::Vector a, typename Simd<T>::Vector b) const {
+        return Simd<T>::subtract(a, b);
+    }
+};
+
+/**
+ * a * b, i.e. the Hadamard product
+ */
+template<typename T>
+struct HadamardOp {
+    static const bool VECTORIZED = true;
+
+    T operator()(T a, T b) const { return a * b; }
+
+    typename Simd<T>::Vector vector(typename Simd<T>::Vector a, typename Simd<T>::Vector b) const {
+        return Simd<T>::multiply(a, b);
+    }
+};
+
+/**
+ * 1 if a < b, otherwise 0
+ */
+template<typename T>
+struct LessOp {
+    static const bool VECTORIZED = false;
+
+    T operator()(T a, T b) const { return a < b ? T(1) : T(0); }
+};
+
+/**
+ * 1 if a > b, otherwise 0
+ */
+template<typename T>
+struct GreaterOp {
+    static const bool VECTORIZED = false;
+
+    T operator()(T a, T b) const { return a > b ? T(1) : T(0); }
+};
+
+/**
+ * 1 if a == b, otherwise 0
+ */
+template<typename T>
+struct EqualOp {
+    static const bool VECTORIZED = false;
+
+    T operator()(T a, T b) const { return a == b ? T(1) : T(0); }
+};
+
+/**
+ * Any function of one or two values, e.g. a lambda
+ */
+template<typename T, class F>
+struct FunctionOp {
+    static const bool VECTORIZED = false;
+    F function;
+
+    T operator()(T a) const { return this->function(a); }
+
+    T operator()(T a, T b) const { return this->function(a, b); }
+};
+
+/**
+ * The operation applying F: F itself if it is one of the operations above (i.e. it declares VECTORIZED), otherwise
+ * a <code>FunctionOp</code> calling it
+ */
+template<typename T, class F, class = void>
+struct ElementwiseOperation {
+    typedef FunctionOp<T, F> Type;
+
+    static Type wrap(F function) {
+        return Type{function};
+    }
+};
+
+template<typename T, class F>
+struct ElementwiseOperation<T, F, typename std::enable_if<F::VECTORIZED || !F::VECTORIZED>::type> {
+    typedef F Type;
+
+    static Type wrap(F op) {
+        return op;
+    }
+};
+
+/**
+ * Loops applying an operation to arrays of values, with <code>Simd</code> when the operation supports it
+ * @tparam T type of the data
+ */
+template<typename T>
+struct ElementwiseLoop {
+    typedef Simd<T> S;
+
+    /**
+     * values[i] = op(values[i])
+     */
+    template<class Op>
+    static void map(T *values, size_t n, const Op &op) {
+        map(values, n, op, std::integral_constant<bool, Op::VECTORIZED>());
+    }
+
+    /**
+     * left[i] = op(left[i], right[i])
+     */
+    template<class Op>
+    static void zip(T *left, const T *right, size_t n, const Op &op) {
+        zip(left, right, n, op, std::integral_constant<bool, Op::VECTORIZED>());
+    }
+
+private:
+    template<class Op>
+    static void map(T *values, size_t n, const Op &op, std::true_type) {
+        size_t i = 0;
+        for (; i + S::WIDTH <= n; i += S::WIDTH) {
+            S::store(values + i, op.vector(S::load(values + i)));
+        }
+        map(values + i, n - i, op, std::false_type());
+    }
+
+    template<class Op>
+    static void map(T *values, size_t n, const Op &op, std::false_type) {
+        for (size_t i = 0; i < n; i++) {
+            values[i] = op(values[i]);
+        }
+    }
+
+    template<class Op>
+    static void zip(T *left, const T *right, size_t n, const Op &op, std::true_type) {
+        size_t i = 0;
+        for (; i + S::WIDTH <= n; i += S::WIDTH) {
+            S::store(left + i, op.vector(S::load(left + i), S::load(right + i)));
+        }
+        zip(left + i, right + i, n - i, op, std::false_type());
+    }
+
+    template<class Op>
+    static void zip(T *left, const T *right, size_t n, const Op &op, std::false_type) {
+        for (size_t i = 0; i < n; i++) {
+            left[i] = op(left[i], right[i]);
+        }
+    }
+};
+
+/**
+ * Implementation of <code>MatrixData</code> that applies an operation to each value of the given matrix
+ * @tparam T type of the data
+ */
+template<typename T, class MD, class Op>
+class MapMD : public SingleMatrixWrapper<T, MD> {
+private:
+    Op op;
+
+public:
+    MapMD(MD wrapped, Op op) : SingleMatrixWrapper<T, MD>(wrapped, wrapped.rows(), wrapped.columns()), op(op) {
+    }
+
+    const Op &getOperation() const {
+        return this->op;
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    /**
+     * The values are written by the wrapped matrix, and transformed in place
+     */
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        this->wrapped.virtualMaterializeInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+        for (unsigned r = 0; r < rows; r++) {
+            ElementwiseLoop<T>::map(destination + (size_t) r * destinationStride, columns, this->op);
+        }
+    }
+
+    MapMD<T, MD, Op> copy() const {
+        return MapMD<T, MD, Op>(this->wrapped.copy(), this->op);
+    }
+
+private:
+    T doGet(unsigned row, unsigned col) const {
+        return this->op(this->wrapped.get(row, col));
+    }
+};
+
+/**
+ * Implementation of <code>MatrixData</code> that combines with an operation the values in the same position of the
+ * two given matrices
+ * @tparam T type of the data
+ */
+template<typename T, class MD1, class MD2, class Op>
+class ZipMD : public BiMatrixWrapper<T, MD1, MD2> {
+private:
+    Op op;
+
+public:
+    ZipMD(MD1 left, MD2 right, Op op) : BiMatrixWrapper<T, MD1, MD2>(left, right, left.rows(), left.columns()), op(op) {
+        if (left.rows() != right.rows() || left.columns() != right.columns()) {
+            Utils::error("Element-wise operation between incompatible sizes");
+        }
+    }
+
+    const Op &getOperation() const {
+        return this->op;
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    /**
+     * Fused evaluation: each strip of rows is written by the left operand, and combined with the same strip of the
+     * right one while it is still in cache. The right operand is read in place when its rows are contiguous.
+     */
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        std::unique_ptr<const VectorMatrixData<T>> view = this->right.virtualGetStridedView();
+        bool inPlace = view != nullptr && view->getColStride() == 1;
+        unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+        std::vector<T> other(inPlace ? 0 : (size_t) std::min(stripRows, rows) * columns);
+        for (unsigned s = 0; s < rows; s += stripRows) {
+            unsigned height = std::min(stripRows, rows - s);
+            T *strip = destination + (size_t) s * destinationStride;
+            this->left.virtualMaterializeInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+            const T *source;
+            size_t sourceStride;
+            if (inPlace) {
+                sourceStride = view->getRowStride();
+                source = view->rawData() + (rowOffset + s) * sourceStride + colOffset;
+            } else {
+                this->right.virtualMaterializeInto(other.data(), columns, rowOffset + s, colOffset, height, columns);
+                sourceStride = columns;
+                source = other.data();
+            }
+            for (unsigned r = 0; r < height; r++) {
+                ElementwiseLoop<T>::zip(strip + (size_t) r * destinationStride, source + r * sourceStride, columns, this->op);
+            }
+        }
+    }
+
+    ZipMD<T, MD1, MD2, Op> copy() const {
+        return ZipMD<T, MD1, MD2, Op>(this->left.copy(), this->right.copy(), this->op);
+    }
+
+private:
+    T doGet(unsigned row, unsigned col) const {
+        return this->op(this->left.get(row, col), this->right.get(row, col));
+    }
+};
+
+/**
+ * Implementation of <code>MatrixData</code> that takes each value from one of two matrices: from ifTrue where the
+ * condition is not zero (e.g. the result of a comparison), otherwise from ifFalse
+ * @tparam T type of the data
+ */
+template<typename T, class MD1, class MD2, class MD3>
+class SelectMD : public MatrixData<T> {
+private:
+    MD1 condition;
+    MD2 ifTrue;
+    MD3 ifFalse;
+
+public:
+    SelectMD(MD1 condition, MD2 ifTrue, MD3 ifFalse) : MatrixData<T>(condition.rows(), condition.columns()),
+                                                       condition(condition), ifTrue(ifTrue), ifFalse(ifFalse) {
+        if (ifTrue.rows() != this->rows() || ifTrue.columns() != this->columns() ||
+            ifFalse.rows() != this->rows() || ifFalse.columns() != this->columns()) {
+            Utils::error("Element-wise operation between incompatible sizes");
+        }
+    }
+
+    const MD1 &getCondition() const {
+        return this->condition;
+    }
+
+    const MD2 &getIfTrue() const {
+        return this->ifTrue;
+    }
+
+    const MD3 &getIfFalse() const {
+        return this->ifFalse;
+    }
+
+    std::vector<const MatrixData<T> *> virtualGetChildren() const override {
+        const MatrixData<T> *condition = &this->condition;
+        const MatrixData<T> *ifTrue = &this->ifTrue;
+        const MatrixData<T> *ifFalse = &this->ifFalse;
+        return {condition, ifTrue, ifFalse};
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+        size_t stripSize = (size_t) std::min(stripRows, rows) * columns;
+        std::vector<T> conditions(stripSize), values(stripSize);
+        for (unsigned s = 0; s < rows; s += stripRows) {
+            unsigned height = std::min(stripRows, rows - s);
+            T *strip = destination + (size_t) s * destinationStride;
+            this->ifFalse.virtualMaterializeInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+            this->condition.virtualMaterializeInto(conditions.data(), columns, rowOffset + s, colOffset, height, columns);
+            this->ifTrue.virtualMaterializeInto(values.data(), columns, rowOffset + s, colOffset, height, columns);
+            for (unsigned r = 0; r < height; r++) {
+                T *row = strip + (size_t) r * destinationStride;
+                const T *c = conditions.data() + (size_t) r * columns;
+                const T *v = values.data() + (size_t) r * columns;
+                for (unsigned col = 0; col < columns; col++) {
+                    row[col] = c[col] != T(0) ? v[col] : row[col];
+                }
+            }
+        }
+    }
+
+    SelectMD<T, MD1, MD2, MD3> copy() const {
+        return SelectMD<T, MD1, MD2, MD3>(this->condition.copy(), this->ifTrue.copy(), this->ifFalse.copy());
+    }
+
+private:
+    T doGet(unsigned row, unsigned col) const {
+        return this->condition.get(row, col) != T(0) ? this->ifTrue.get(row, col) : this->ifFalse.get(row, col);
+    }
+};
+
+#endif //MATRIXTEMPLATE_ELEMENTWISE_H
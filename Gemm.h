@@ -0,0 +1,277 @@
+#ifndef MATRIXTEMPLATE_GEMM_H
+#define MATRIXTEMPLATE_GEMM_H
+
+#include <vector>
+#include <algorithm>
+#include "Simd.h"
+#include "Utils.h"
+
+/**
+ * Cache blocking used by <code>Gemm</code>: A is split in panels of mc x kc, B in panels of kc x nc
+ */
+struct GemmBlocking {
+    unsigned mc, kc, nc;
+};
+
+/**
+ * Packed, register-tiled matrix multiplication kernel working on raw row-major buffers.
+ *
+ * The operands are copied in contiguous panels (A in slivers of MR rows, B in slivers of NR columns) so that the
+ * micro-kernel reads both of them sequentially, and each MR x NR tile of C is kept in registers for the whole panel.
+ * @tparam T type of the data
+ */
+template<typename T>
+class Gemm {
+private:
+    typedef Simd<T> S;
+    typedef typename S::Vector V;
+
+    //Using scalars, the tile is 4x4; using vectors it is 6 rows of 2 registers
+    static const unsigned VECTORS = S::WIDTH == 1 ? 4 : 2;
+
+public:
+    static const unsigned MR = S::WIDTH == 1 ? 4 : 6;
+    static const unsigned NR = S::WIDTH * VECTORS;
+
+    /**
+     * @return the blocking used when no other one is given
+     */
+    static GemmBlocking defaultBlocking() {
+        return {MR * 16, 256, NR * 64};
+    }
+
+    /**
+     * Computes C += A * B, where A is m x k, B is k x n and C is m x n.
+     * All the matrices are row-major, and each row starts <code>ld*</code> elements after the previous one.
+     */
+    static void multiplyAdd(unsigned m, unsigned n, unsigned k,
+                            const T *a, unsigned lda, const T *b, unsigned ldb, T *c, unsigned ldc) {
+        multiplyAdd(m, n, k, a, lda, b, ldb, c, ldc, defaultBlocking());
+    }
+
+    static void multiplyAdd(unsigned m, unsigned n, unsigned k,
+                            const T *a, unsigned lda, const T *b, unsigned ldb, T *c, unsigned ldc,
+                            const GemmBlocking &blocking) {
+        multiplyAdd(m, n, k, a, lda, 1, b, ldb, 1, c, ldc, blocking);
+    }
+
+    /**
+     * Same as above, but A and B can have any layout: the cell (i, j) of A is at <code>a[i * aRowStride + j * aColStride]</code>,
+     * e.g. a column-major or transposed operand is read in place while it is packed.
+     */
+    static void multiplyAdd(unsigned m, unsigned n, unsigned k,
+                            const T *a, size_t aRowStride, size_t aColStride, const T *b, size_t bRowStride, size_t bColStride,
+                            T *c, unsigned ldc, const GemmBlocking &blocking) {
+        if (m == 0 || n == 0 || k == 0) {
+            return;
+        }
+        //The panels must contain whole slivers
+        unsigned mcMax = std::max(MR, blocking.mc / MR * MR);
+        unsigned ncMax = std::max(NR, blocking.nc / NR * NR);
+        unsigned kcMax = std::max(1u, blocking.kc);
+
+        //The packing buffers are reused by all the multiplications performed by the same thread
+        static thread_local std::vector<T> packedA, packedB;
+        packedA.resize((size_t) std::min(mcMax, Utils::ceilDiv(m, MR) * MR) * std::min(kcMax, k));
+        packedB.resize((size_t) std::min(ncMax, Utils::ceilDiv(n, NR) * NR) * std::min(kcMax, k));
+
+        for (unsigned jc = 0; jc < n; jc += ncMax) {
+            unsigned nc = std::min(ncMax, n - jc);
+            for (unsigned pc = 0; pc < k; pc += kcMax) {
+                unsigned kc = std::min(kcMax, k - pc);
+                packB(kc, nc, b + pc * bRowStride + jc * bColStride, bRowStride, bColStride, packedB.data());
+                for (unsigned ic = 0; ic < m; ic += mcMax) {
+                    unsigned mc = std::min(mcMax, m - ic);
+                    packA(mc, kc, a + ic * aRowStride + pc * aColStride, aRowStride, aColStride, packedA.data());
+                    for (unsigned jr = 0; jr < nc; jr += NR) {
+                        for (unsigned ir = 0; ir < mc; ir += MR) {
+                            microKernel(kc, packedA.data() + (size_t) ir * kc, packedB.data() + (size_t) jr * kc,
+                                        c + (size_t) (ic + ir) * ldc + jc + jr, ldc,
+                                        std::min(MR, mc - ir), std::min(NR, nc - jr));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+private:
+
+    /**
+     * Copies a mc x kc panel of A in slivers of MR rows: each sliver stores the MR values of column 0, then of column 1...
+     * Rows outside the panel are filled with zeros.
+     */
+    static void packA(unsigned mc, unsigned kc, const T *a, size_t rowStride, size_t colStride, T *packed) {
+        for (unsigned i0 = 0; i0 < mc; i0 += MR) {
+            unsigned rows = std::min(MR, mc - i0);
+            for (unsigned p = 0; p < kc; p++) {
+                const T *column = a + i0 * rowStride + p * colStride;
+                for (unsigned i = 0; i < rows; i++) {
+                    packed[i] = column[i * rowStride];
+                }
+                for (unsigned i = rows; i < MR; i++) {
+                    packed[i] = T(0);
+                }
+                packed += MR;
+            }
+        }
+    }
+
+    /**
+     * Copies a kc x nc panel of B in slivers of NR columns: each sliver stores the NR values of row 0, then of row 1...
+     * Columns outside the panel are filled with zeros.
+     */
+    static void packB(unsigned kc, unsigned nc, const T *b, size_t rowStride, size_t colStride, T *packed) {
+        for (unsigned j0 = 0; j0 < nc; j0 += NR) {
+            unsigned cols = std::min(NR, nc - j0);
+            for (unsigned p = 0; p < kc; p++) {
+                const T *row = b + p * rowStride + j0 * colStride;
+                if (colStride == 1) {
+                    std::copy_n(row, cols, packed);
+                } else {
+                    for (unsigned j = 0; j < cols; j++) {
+                        packed[j] = row[j * colStride];
+                    }
+                }
+                for (unsigned j = cols; j < NR; j++) {
+                    packed[j] = T(0);
+                }
+                packed += NR;
+            }
+        }
+    }
+
+    /**
+     * Computes a MR x NR tile of C from a sliver of A and a sliver of B.
+     * Only the first <code>rows</code> x <code>cols</code> cells are written back.
+     */
+    static void microKernel(unsigned kc, const T *a, const T *b, T *c, unsigned ldc, unsigned rows, unsigned cols) {
+        V acc[MR][VECTORS];
+        for (unsigned i = 0; i < MR; i++) {
+            for (unsigned v = 0; v < VECTORS; v++) {
+                acc[i][v] = S::zero();
+            }
+        }
+        for (unsigned p = 0; p < kc; p++) {
+            V bv[VECTORS];
+            for (unsigned v = 0; v < VECTORS; v++) {
+                bv[v] = S::load(b + v * S::WIDTH);
+            }
+            for (unsigned i = 0; i < MR; i++) {
+                V av = S::broadcast(a[i]);
+                for (unsigned v = 0; v < VECTORS; v++) {
+                    acc[i][v] = S::multiplyAdd(av, bv[v], acc[i][v]);
+                }
+            }
+            a += MR;
+            b += NR;
+        }
+
+        if (rows == MR && cols == NR) {
+            for (unsigned i = 0; i < MR; i++) {
+                for (unsigned v = 0; v < VECTORS; v++) {
+                    T *cell = c + (size_t) i * ldc + v * S::WIDTH;
+                    S::store(cell, S::add(S::load(cell), acc[i][v]));
+                }
+            }
+        } else {
+            //Border tile: going through a temporary, to avoid writing outside of C
+            T tile[MR * NR];
+            for (unsigned i = 0; i < MR; i++) {
+                for (unsigned v = 0; v < VECTORS; v++) {
+                    S::store(tile + i * NR + v * S::WIDTH, acc[i][v]);
+                }
+            }
+            for (unsigned i = 0; i < rows; i++) {
+                for (unsigned j = 0; j < cols; j++) {
+                    c[(size_t) i * ldc + j] += tile[i * NR + j];
+                }
+            }
+        }
+    }
+};
+
+template<typename T>
+const unsigned Gemm<T>::VECTORS;
+
+template<typename T>
+const unsigned Gemm<T>::MR;
+
+template<typename T>
+const unsigned Gemm<T>::NR;
+
+/**
+ * Matrix-vector product y = A * x on raw buffers, reading each value of A exactly once.
+ * A row-major A is read one row at a time, ROWS rows together so that they share the loads of x; a column-major A
+ * is read one column at a time, accumulating it into y.
+ * @tparam T type of the data
+ */
+template<typename T>
+class Gemv {
+private:
+    typedef Simd<T> S;
+    typedef typename S::Vector V;
+
+    static const unsigned ROWS = 4;
+
+public:
+
+    /**
+     * Computes y = A * x, where A is m x k and the cell (i, j) of A is at <code>a[i * rowStride + j * colStride]</code>
+     */
+    static void multiply(unsigned m, unsigned k, const T *a, size_t rowStride, size_t colStride, const T *x, T *y) {
+        if (colStride == 1) {
+            unsigned i = 0;
+            for (; i + ROWS <= m; i += ROWS) {
+                dotProducts(k, a + i * rowStride, rowStride, x, y + i);
+            }
+            for (; i < m; i++) {
+                y[i] = SimdOps<T>::dot(a + i * rowStride, x, k);
+            }
+        } else if (rowStride == 1) {
+            std::fill_n(y, m, T(0));
+            for (unsigned j = 0; j < k; j++) {
+                SimdOps<T>::multiplyAdd(y, a + j * colStride, x[j], m);
+            }
+        } else {
+            for (unsigned i = 0; i < m; i++) {
+                T sum = T(0);
+                for (unsigned j = 0; j < k; j++) {
+                    sum += a[i * rowStride + j * colStride] * x[j];
+                }
+                y[i] = sum;
+            }
+        }
+    }
+
+private:
+
+    /**
+     * Computes ROWS consecutive values of y, from rows of A that are contiguous
+     */
+    static void dotProducts(unsigned k, const T *a, size_t rowStride, const T *x, T *y) {
+        V acc[ROWS];
+        for (unsigned r = 0; r < ROWS; r++) {
+            acc[r] = S::zero();
+        }
+        unsigned j = 0;
+        for (; j + S::WIDTH <= k; j += S::WIDTH) {
+            V xv = S::load(x + j);
+            for (unsigned r = 0; r < ROWS; r++) {
+                acc[r] = S::multiplyAdd(S::load(a + r * rowStride + j), xv, acc[r]);
+            }
+        }
+        for (unsigned r = 0; r < ROWS; r++) {
+            T sum = SimdOps<T>::horizontalSum(acc[r]);
+            for (unsigned t = j; t < k; t++) {
+                sum += a[r * rowStride + t] * x[t];
+            }
+            y[r] = sum;
+        }
+    }
+};
+
+template<typename T>
+const unsigned Gemv<T>::ROWS;
+
+#endif //MATRIXTEMPLATE_GEMM_H
@@ -0,0 +1,186 @@
+#ifndef MATRIXTEMPLATE_MAPPEDMATRIXDATA_H
+#define MATRIXTEMPLATE_MAPPEDMATRIXDATA_H
+
+#include <memory>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "MultipleMethod.h"
+
+/**
+ * Implementation of <code>MatrixData</code> whose values are read directly from a file mapped in memory.
+ * The file contains the matrix in row-major order, starting at the given byte offset, so opening it costs nothing
+ * and only the pages that are actually read are loaded by the operating system.
+ *
+ * Copies share the mapping (nothing is copied) until someone writes: in <code>READ_ONLY</code> mode writing is an
+ * error, while in <code>COPY_ON_WRITE</code> mode the file is mapped privately and the written pages are copied by
+ * the kernel, without ever modifying the file. Copying a <code>COPY_ON_WRITE</code> matrix copies its values in
+ * anonymous memory, like <code>VectorMatrixData::copy()</code> does.
+ * @tparam T type of the data
+ */
+template<typename T>
+class MappedMatrixData : public MatrixData<T> {
+
+public:
+    enum Mode {
+        READ_ONLY,
+        COPY_ON_WRITE
+    };
+
+private:
+
+    /**
+     * Owns a region obtained with mmap, and unmaps it when destroyed
+     */
+    class Mapping {
+    private:
+        void *address = nullptr;
+        size_t length = 0;
+
+    public:
+        Mapping(void *address, size_t length) : address(address), length(length) {
+        }
+
+        Mapping(const Mapping &) = delete;
+
+        ~Mapping() {
+            if (this->address != nullptr) {
+                munmap(this->address, this->length);
+            }
+        }
+    };
+
+    std::shared_ptr<Mapping> mapping;
+    T *values;
+    Mode mode;
+
+    MappedMatrixData(unsigned rows, unsigned columns, std::shared_ptr<Mapping> mapping, T *values, Mode mode) :
+            MatrixData<T>(rows, columns), mapping(mapping), values(values), mode(mode) {
+    }
+
+public:
+
+    /**
+     * Maps the given file
+     * @param path the file containing the values, in row-major order
+     * @param offset position in bytes of the first value inside the file. It must be a multiple of the alignment
+     * of <code>T</code>, but it does not need to be aligned to a page.
+     */
+    MappedMatrixData(const std::string &path, unsigned rows, unsigned columns, Mode mode = READ_ONLY, size_t offset = 0) :
+            MatrixData<T>(rows, columns), values(nullptr), mode(mode) {
+        if (offset % alignof(T) != 0) {
+            Utils::error("The offset " + std::to_string(offset) + " is not aligned to " + std::to_string(alignof(T)) + " bytes");
+        }
+        size_t bytes = (size_t) rows * columns * sizeof(T);
+        int descriptor = open(path.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            Utils::error("Cannot open " + path + ": " + std::strerror(errno));
+        }
+        struct stat status;
+        if (fstat(descriptor, &status) != 0 || (size_t) status.st_size < offset + bytes) {
+            close(descriptor);
+            Utils::error("The file " + path + " is too small for a " + std::to_string(rows) + "x" + std::to_string(columns) + " matrix");
+        }
+        if (bytes == 0) {
+            close(descriptor);
+            return;
+        }
+        //mmap wants an offset aligned to the page size
+        size_t pageOffset = offset % (size_t) sysconf(_SC_PAGESIZE);
+        int protection = mode == READ_ONLY ? PROT_READ : PROT_READ | PROT_WRITE;
+        void *address = mmap(nullptr, bytes + pageOffset, protection, MAP_PRIVATE, descriptor, (off_t) (offset - pageOffset));
+        //The mapping keeps the file alive
+        close(descriptor);
+        if (address == MAP_FAILED) {
+            Utils::error("Cannot map " + path + ": " + std::strerror(errno));
+        }
+        this->mapping = std::make_shared<Mapping>(address, bytes + pageOffset);
+        this->values = reinterpret_cast<T *>(static_cast<char *>(address) + pageOffset);
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        const T *source = this->rawData() + (size_t) rowOffset * this->columns() + colOffset;
+        for (unsigned r = 0; r < rows; r++) {
+            std::copy_n(source + (size_t) r * this->columns(), columns, destination + (size_t) r * destinationStride);
+        }
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        const T *source = this->rawData() + (size_t) rowOffset * this->columns() + colOffset;
+        for (unsigned r = 0; r < rows; r++) {
+            SimdOps<T>::add(destination + (size_t) r * destinationStride, source + (size_t) r * this->columns(), columns);
+        }
+    }
+
+    void set(unsigned row, unsigned col, T t) {
+        if (this->mode == READ_ONLY) {
+            Utils::error("Cannot write into a matrix mapped as read-only");
+        }
+        this->values[(size_t) row * this->columns() + col] = t;
+    }
+
+    Mode getMode() const {
+        return this->mode;
+    }
+
+    /**
+     * @return the mapped row-major buffer
+     */
+    const T *rawData() const {
+        return this->values;
+    }
+
+    /**
+     * The view shares the mapping: as for <code>set()</code>, writing it is an error in <code>READ_ONLY</code> mode
+     */
+    std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const override {
+        if (this->mode == READ_ONLY) {
+            return std::make_unique<VectorMatrixData<T>>(
+                    VectorMatrixData<T>::readOnlyView(this->rows(), this->columns(), this->mapping, this->values, this->columns(), 1));
+        }
+        return std::make_unique<VectorMatrixData<T>>(this->rows(), this->columns(), this->mapping, this->values, this->columns(), 1);
+    }
+
+    /**
+     * Tells the operating system that the whole matrix will be read soon, so that it can start loading it
+     */
+    void prefetch() const {
+        if (this->mapping != nullptr) {
+            size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+            auto start = reinterpret_cast<uintptr_t>(this->values) / pageSize * pageSize;
+            size_t length = reinterpret_cast<uintptr_t>(this->values) - start + (size_t) this->rows() * this->columns() * sizeof(T);
+            madvise(reinterpret_cast<void *>(start), length, MADV_WILLNEED);
+        }
+    }
+
+    MappedMatrixData<T> copy() const {
+        if (this->mode == READ_ONLY || this->mapping == nullptr) {
+            //Nobody can modify the values, so sharing them is the same as copying them
+            return *this;
+        }
+        size_t bytes = (size_t) this->rows() * this->columns() * sizeof(T);
+        void *address = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (address == MAP_FAILED) {
+            Utils::error(std::string("Cannot allocate the copy: ") + std::strerror(errno));
+        }
+        std::memcpy(address, this->values, bytes);
+        return MappedMatrixData<T>(this->rows(), this->columns(), std::make_shared<Mapping>(address, bytes),
+                                   static_cast<T *>(address), this->mode);
+    }
+
+private:
+    T doGet(unsigned row, unsigned col) const {
+        return this->values[(size_t) row * this->columns() + col];
+    }
+};
+
+#endif //MATRIXTEMPLATE_MAPPEDMATRIXDATA_H
@@ -5,7 +5,12 @@
 #include <string>
 #include <iostream>
 #include "MultipleMethod.h"
+#include "MappedMatrixData.h"
+#include "MatrixIO.h"
+#include "StaticEval.h"
 #include "Sum.h"
+#include "Elementwise.h"
+#include "Reduction.h"
 #include "Multiplication.h"
 #include "Iterator.h"
 #include "MatrixCell.h"
@@ -46,6 +51,12 @@ class Matrix {
 		explicit Matrix(unsigned rows, unsigned columns) : data(VectorMatrixData<T>(rows, columns)) {
 		}
 
+		/**
+		 * Creates a new matrix of the given size, storing its values in the given order
+		 */
+		explicit Matrix(unsigned rows, unsigned columns, MatrixLayout layout) : data(VectorMatrixData<T>(rows, columns, layout)) {
+		}
+
 		Matrix(const Matrix<T, MD> &other) : data(other.data.copy()) {}
 
 		/**
@@ -54,10 +65,22 @@ class Matrix {
 		 */
 		Matrix(Matrix<T, MD> &&other) noexcept = default;
 
+		/**
+		 * Wraps the given data, without copying it.
+		 * E.g. <code>Matrix<float, MappedMatrixData<float>>::fromData(MappedMatrixData<float>("weights.bin", rows, columns))</code>
+		 */
+		static Matrix<T, MD> fromData(MD data) {
+			return Matrix<T, MD>(data);
+		}
+
 		MD &getData() {
 			return this->data;
 		}
 
+		const MD &getData() const {
+			return this->data;
+		}
+
 		const T operator()(unsigned row, unsigned col) const {
 			if (row < 0 || row >= this->rows()) {
 				Utils::error("Row out of bounds");
@@ -120,6 +143,14 @@ class Matrix {
 			return Matrix<T, TransposedMD<T, MD>>(TransposedMD<T, MD>(this->data));
 		}
 
+		/**
+		 * Transposes this square matrix without allocating a new one.
+		 * Available only when the data supports it, e.g. <code>VectorMatrixData</code>.
+		 */
+		void transposeInPlace() {
+			this->data.transposeInPlace();
+		}
+
 		Matrix<T, DiagonalMD<T, MD>> diagonal() {
 			return Matrix<T, DiagonalMD<T, MD>>(DiagonalMD<T, MD>(this->data));
 		}
@@ -160,6 +191,242 @@ class Matrix {
 			return another + (*this);
 		}
 
+		/**
+		 * Subtracts the given matrix from this one
+		 */
+		template<class MD2>
+		const Matrix<T, ZipMD<T, MD, MD2, SubtractOp<T>>> operator-(const Matrix<T, MD2> &another) const {
+			return this->combine(another, SubtractOp<T>());
+		}
+
+		/**
+		 * @return this matrix with every value negated
+		 */
+		const Matrix<T, MapMD<T, MD, NegateOp<T>>> operator-() const {
+			return this->apply(NegateOp<T>());
+		}
+
+		/**
+		 * Multiplies every value of this matrix by the given factor
+		 */
+		const Matrix<T, MapMD<T, MD, ScaleOp<T>>> operator*(T factor) const {
+			return this->apply(ScaleOp<T>{factor});
+		}
+
+		friend const Matrix<T, MapMD<T, MD, ScaleOp<T>>> operator*(T factor, const Matrix<T, MD> &matrix) {
+			return matrix * factor;
+		}
+
+		/**
+		 * @return the Hadamard product, i.e. the product of the values in the same position of the two matrices
+		 */
+		template<class MD2>
+		const Matrix<T, ZipMD<T, MD, MD2, HadamardOp<T>>> hadamard(const Matrix<T, MD2> &another) const {
+			return this->combine(another, HadamardOp<T>());
+		}
+
+		/**
+		 * @return a matrix with 1 where this matrix is less than the given one, 0 elsewhere
+		 */
+		template<class MD2>
+		const Matrix<T, ZipMD<T, MD, MD2, LessOp<T>>> lessThan(const Matrix<T, MD2> &another) const {
+			return this->combine(another, LessOp<T>());
+		}
+
+		/**
+		 * @return a matrix with 1 where this matrix is greater than the given one, 0 elsewhere
+		 */
+		template<class MD2>
+		const Matrix<T, ZipMD<T, MD, MD2, GreaterOp<T>>> greaterThan(const Matrix<T, MD2> &another) const {
+			return this->combine(another, GreaterOp<T>());
+		}
+
+		/**
+		 * @return a matrix with 1 where this matrix is equal to the given one, 0 elsewhere
+		 */
+		template<class MD2>
+		const Matrix<T, ZipMD<T, MD, MD2, EqualOp<T>>> equalTo(const Matrix<T, MD2> &another) const {
+			return this->combine(another, EqualOp<T>());
+		}
+
+		/**
+		 * Uses this matrix as a condition, e.g. the result of a comparison
+		 * @return a matrix with the values of ifTrue where this matrix is not 0, and those of ifFalse elsewhere
+		 */
+		template<class MD2, class MD3>
+		const Matrix<T, SelectMD<T, MD, MD2, MD3>> select(const Matrix<T, MD2> &ifTrue, const Matrix<T, MD3> &ifFalse) const {
+			return Matrix<T, SelectMD<T, MD, MD2, MD3>>(SelectMD<T, MD, MD2, MD3>(this->data, ifTrue.data, ifFalse.data));
+		}
+
+		/**
+		 * Applies the given function to every value of this matrix. The function is called lazily, when the values are read.
+		 * @param function either a function <code>T -> T</code> or an operation of Elementwise.h
+		 */
+		template<class F>
+		const Matrix<T, MapMD<T, MD, typename ElementwiseOperation<T, F>::Type>> apply(F function) const {
+			typedef typename ElementwiseOperation<T, F>::Type Op;
+			return Matrix<T, MapMD<T, MD, Op>>(MapMD<T, MD, Op>(this->data, ElementwiseOperation<T, F>::wrap(function)));
+		}
+
+		/**
+		 * Combines with the given function the values in the same position of this matrix and the given one
+		 * @param function either a function <code>(T, T) -> T</code> or an operation of Elementwise.h
+		 */
+		template<class MD2, class F>
+		const Matrix<T, ZipMD<T, MD, MD2, typename ElementwiseOperation<T, F>::Type>>
+		combine(const Matrix<T, MD2> &another, F function) const {
+			typedef typename ElementwiseOperation<T, F>::Type Op;
+			return Matrix<T, ZipMD<T, MD, MD2, Op>>(ZipMD<T, MD, MD2, Op>(this->data, another.data, ElementwiseOperation<T, F>::wrap(function)));
+		}
+
+		/**
+		 * @return the sum of all the values. Like all the reductions below, it is computed in parallel, reading the
+		 * values in place or a strip of rows at a time (see Reduction.h).
+		 */
+		T sum() const {
+			return Reduction<T>::all(this->data, SumReduction<T>());
+		}
+
+		/**
+		 * @return the mean of all the values
+		 */
+		auto mean() const {
+			typedef typename Reduction<T>::Real Real;
+			//Summing in Real, so that the sum of an integer matrix does not overflow
+			return Reduction<T>::all(this->data, SumReduction<T, Real>()) / ((Real) this->rows() * this->columns());
+		}
+
+		T min() const {
+			return Reduction<T>::all(this->data, MinReduction<T>());
+		}
+
+		T max() const {
+			return Reduction<T>::all(this->data, MaxReduction<T>());
+		}
+
+		/**
+		 * @return the first position of the minimum value, reading the matrix by rows
+		 */
+		MatrixPosition<T> argMin() const {
+			return Reduction<T>::argMin(this->data);
+		}
+
+		/**
+		 * @return the first position of the maximum value, reading the matrix by rows
+		 */
+		MatrixPosition<T> argMax() const {
+			return Reduction<T>::argMax(this->data);
+		}
+
+		/**
+		 * @return the sum of the absolute values, i.e. the L1 norm of a vector
+		 */
+		T normL1() const {
+			return Reduction<T>::all(this->data, AbsSumReduction<T>());
+		}
+
+		/**
+		 * @return the square root of the sum of the squares, i.e. the L2 norm of a vector
+		 */
+		auto normL2() const {
+			typedef typename Reduction<T>::Real Real;
+			return std::sqrt(Reduction<T>::all(this->data, SquaresReduction<T, Real>()));
+		}
+
+		/**
+		 * @return the Frobenius norm, i.e. the L2 norm of all the values
+		 */
+		auto frobeniusNorm() const {
+			return this->normL2();
+		}
+
+		/**
+		 * @return the maximum absolute value
+		 */
+		T maxNorm() const {
+			return Reduction<T>::all(this->data, AbsMaxReduction<T>());
+		}
+
+		/**
+		 * Can only be called on a squared matrix.
+		 * @return the sum of the values on the diagonal
+		 */
+		T trace() const {
+			return Reduction<T>::trace(this->data);
+		}
+
+		/**
+		 * @return a vector with the sum of each row
+		 */
+		Matrix<T> rowSums() const {
+			return Matrix<T>(Reduction<T>::rows(this->data, SumReduction<T>()));
+		}
+
+		/**
+		 * @return a covector with the sum of each column
+		 */
+		Matrix<T> columnSums() const {
+			return Matrix<T>(Reduction<T>::columns(this->data, SumReduction<T>()));
+		}
+
+		/**
+		 * @return a vector with the mean of each row
+		 */
+		auto rowMeans() const {
+			typedef typename Reduction<T>::Real Real;
+			Real columns = this->columns();
+			return Matrix<Real>(Reduction<T>::map(Reduction<T>::rows(this->data, SumReduction<T, Real>()), [columns](Real sum) {
+				return sum / columns;
+			}));
+		}
+
+		/**
+		 * @return a covector with the mean of each column
+		 */
+		auto columnMeans() const {
+			typedef typename Reduction<T>::Real Real;
+			Real rows = this->rows();
+			return Matrix<Real>(Reduction<T>::map(Reduction<T>::columns(this->data, SumReduction<T, Real>()), [rows](Real sum) {
+				return sum / rows;
+			}));
+		}
+
+		Matrix<T> rowMin() const {
+			return Matrix<T>(Reduction<T>::rows(this->data, MinReduction<T>()));
+		}
+
+		Matrix<T> rowMax() const {
+			return Matrix<T>(Reduction<T>::rows(this->data, MaxReduction<T>()));
+		}
+
+		Matrix<T> columnMin() const {
+			return Matrix<T>(Reduction<T>::columns(this->data, MinReduction<T>()));
+		}
+
+		Matrix<T> columnMax() const {
+			return Matrix<T>(Reduction<T>::columns(this->data, MaxReduction<T>()));
+		}
+
+		/**
+		 * @return a vector with the L2 norm of each row
+		 */
+		auto rowNorms() const {
+			typedef typename Reduction<T>::Real Real;
+			return Matrix<Real>(Reduction<T>::map(Reduction<T>::rows(this->data, SquaresReduction<T, Real>()), [](Real squares) {
+				return std::sqrt(squares);
+			}));
+		}
+
+		/**
+		 * @return a covector with the L2 norm of each column
+		 */
+		auto columnNorms() const {
+			typedef typename Reduction<T>::Real Real;
+			return Matrix<Real>(Reduction<T>::map(Reduction<T>::columns(this->data, SquaresReduction<T, Real>()), [](Real squares) {
+				return std::sqrt(squares);
+			}));
+		}
+
 		/**
  		 * @return true if this matrix is a square (has the same number of rows and columns)
  		 */
@@ -210,6 +477,15 @@ class Matrix {
 			return MatrixColumnMajorIterator<T, MD>(this->data, 0, columns());
 		}
 
+		/**
+		 * @return a functor <code>(row, col) -> value</code> that reads this matrix without virtual calls nor runtime checks,
+		 * resolving the whole tree of views at compile time (see StaticEval.h). Bounds are not checked.
+		 * It must not be used after this matrix has been destroyed.
+		 */
+		auto accessor() const {
+			return StaticAccessor<T, MD>::create(this->data);
+		}
+
 		Matrix<T, VectorMatrixData<T>> copy() const {
 			return Matrix<T, VectorMatrixData<T>>(VectorMatrixData<T>::template toVector<MD>(this->data));
 		}
@@ -219,6 +495,33 @@ class Matrix {
 			return Matrix<U, MatrixCaster<U, MD>>(MatrixCaster<U, MD>(this->data));
 		}
 
+		/**
+		 * Writes this matrix to a binary file (see MatrixIO.h), one chunk of rows at a time.
+		 * Only the buffer of one chunk is allocated by the writer, so lazy views and element-wise expressions are
+		 * never materialized as a whole. A product, instead, is computed entirely before its first chunk is written.
+		 * @param chunkRows rows in each chunk. When 0, chunks of about 1MB are used.
+		 */
+		void save(const std::string &path, unsigned chunkRows = 0) const {
+			MatrixWriter<T> writer(path, this->rows(), this->columns(), chunkRows);
+			writer.write(this->data);
+			writer.close();
+		}
+
+		/**
+		 * Reads in memory a matrix written by <code>save()</code>, verifying its checksums
+		 */
+		static Matrix<T> load(const std::string &path) {
+			return Matrix<T>(MatrixReader<T>(path).readAll());
+		}
+
+		/**
+		 * Maps in memory a matrix written by <code>save()</code>, without reading it
+		 */
+		static Matrix<T, MappedMatrixData<T>> map(const std::string &path,
+		                                          typename MappedMatrixData<T>::Mode mode = MappedMatrixData<T>::READ_ONLY) {
+			return Matrix<T, MappedMatrixData<T>>(MatrixReader<T>(path).map(mode));
+		}
+
 		/**
 		 * Prints the content of this matrix to the standard output
 		 * @param format the format string to use when printing values
@@ -0,0 +1,293 @@
+#ifndef MATRIXTEMPLATE_MATRIXALLOCATOR_H
+#define MATRIXTEMPLATE_MATRIXALLOCATOR_H
+
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <new>
+#include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <type_traits>
+
+/**
+ * Source of the buffers of <code>VectorMatrixData</code>.
+ * Every buffer is returned to the allocator that created it, so the allocator used for new matrices can be changed
+ * at any time with <code>use()</code>, as long as the old one outlives its buffers.
+ */
+class MatrixAllocator {
+public:
+    //Buffers are aligned to a cache line, which is also enough for any vector register
+    static const size_t ALIGNMENT = 64;
+
+    virtual ~MatrixAllocator() = default;
+
+    /**
+     * @return a buffer of at least the given bytes, aligned to ALIGNMENT
+     */
+    virtual void *allocate(size_t bytes) = 0;
+
+    /**
+     * Releases a buffer returned by allocate(bytes)
+     */
+    virtual void deallocate(void *pointer, size_t bytes) = 0;
+
+    /**
+     * @return the allocator used by the new matrices, by default <code>MatrixBufferPool::shared()</code>
+     */
+    static MatrixAllocator &current();
+
+    /**
+     * Uses the given allocator for the new matrices, or the shared pool if nullptr
+     */
+    static void use(MatrixAllocator *allocator) {
+        currentPointer().store(allocator);
+    }
+
+    /**
+     * @return an array of count value-initialized elements allocated by <code>current()</code>, that is destroyed
+     * and given back to the same allocator when the last reference is released
+     */
+    template<typename T>
+    static std::shared_ptr<T> allocateArray(size_t count) {
+        MatrixAllocator *allocator = &current();
+        size_t bytes = std::max<size_t>(count * sizeof(T), 1);
+        T *values = static_cast<T *>(allocator->allocate(bytes));
+        if (std::is_trivially_default_constructible<T>::value) {
+            std::memset(static_cast<void *>(values), 0, count * sizeof(T));
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                new(values + i) T();
+            }
+        }
+        return std::shared_ptr<T>(values, [allocator, count, bytes](T *pointer) {
+            if (!std::is_trivially_destructible<T>::value) {
+                for (size_t i = 0; i < count; i++) {
+                    pointer[i].~T();
+                }
+            }
+            allocator->deallocate(pointer, bytes);
+        });
+    }
+
+private:
+    static std::atomic<MatrixAllocator *> &currentPointer() {
+        static std::atomic<MatrixAllocator *> allocator(nullptr);
+        return allocator;
+    }
+};
+
+/**
+ * Allocates each buffer from the heap, without recycling them
+ */
+class AlignedAllocator : public MatrixAllocator {
+public:
+    void *allocate(size_t bytes) override {
+        return allocateAligned(bytes);
+    }
+
+    void deallocate(void *pointer, size_t) override {
+        std::free(pointer);
+    }
+
+    /**
+     * @return a buffer allocated from the heap, aligned to ALIGNMENT, to be released with free()
+     */
+    static void *allocateAligned(size_t bytes) {
+        void *pointer = nullptr;
+        if (posix_memalign(&pointer, ALIGNMENT, roundUp(bytes)) != 0) {
+            throw std::bad_alloc();
+        }
+        return pointer;
+    }
+
+    /**
+     * @return bytes rounded up to a multiple of ALIGNMENT
+     */
+    static size_t roundUp(size_t bytes) {
+        return (bytes + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+};
+
+/**
+ * Statistics of a <code>MatrixBufferPool</code>
+ */
+struct MatrixAllocatorStats {
+    //Number of buffers requested, and how many of them were recycled
+    size_t allocations, reused;
+    //Bytes of the buffers currently used by matrices, and the maximum ever reached
+    size_t bytesInUse, peakBytes;
+    //Bytes of the free buffers kept by the threads to be reused
+    size_t cachedBytes;
+
+    double reuseRate() const {
+        return this->allocations == 0 ? 0 : (double) this->reused / this->allocations;
+    }
+};
+
+/**
+ * Allocator that recycles the buffers: each thread keeps the buffers it releases in its own cache, grouped by size,
+ * so that the blocks of a product (all of the same size) are reused by the next ones without going through malloc
+ * and without any lock. Sizes are rounded up to 4 classes for each power of two, wasting at most 25% of a buffer.
+ * When a cache exceeds its limit, the released buffers are freed.
+ */
+class MatrixBufferPool : public MatrixAllocator {
+private:
+    static const size_t DEFAULT_THREAD_CACHE_LIMIT = 64 << 20;
+
+    std::atomic<size_t> threadCacheLimit{DEFAULT_THREAD_CACHE_LIMIT};
+    std::atomic<size_t> allocations{0}, reused{0}, bytesInUse{0}, peakBytes{0}, cachedBytes{0};
+
+    struct ThreadCache {
+        MatrixBufferPool *pool;
+        std::unordered_map<size_t, std::vector<void *>> buffers;
+        size_t bytes = 0;
+
+        explicit ThreadCache(MatrixBufferPool *pool) : pool(pool) {
+        }
+
+        void clear() {
+            for (auto &sizeAndBuffers : this->buffers) {
+                for (void *buffer : sizeAndBuffers.second) {
+                    std::free(buffer);
+                }
+            }
+            this->buffers.clear();
+            this->pool->cachedBytes -= this->bytes;
+            this->bytes = 0;
+        }
+
+        ~ThreadCache() {
+            this->clear();
+            //Buffers released while the thread is exiting are freed directly
+            exited() = true;
+        }
+    };
+
+public:
+
+    /**
+     * @return the pool used by default. It is never destroyed, since matrices may be released during the destruction
+     * of static objects.
+     */
+    static MatrixBufferPool &shared() {
+        static MatrixBufferPool *pool = new MatrixBufferPool();
+        return *pool;
+    }
+
+    void *allocate(size_t bytes) override {
+        size_t size = sizeClass(bytes);
+        this->allocations++;
+        this->addInUse(size);
+        if (!exited()) {
+            ThreadCache &cache = this->threadCache();
+            auto found = cache.buffers.find(size);
+            if (found != cache.buffers.end() && !found->second.empty()) {
+                void *buffer = found->second.back();
+                found->second.pop_back();
+                cache.bytes -= size;
+                this->cachedBytes -= size;
+                this->reused++;
+                return buffer;
+            }
+        }
+        try {
+            return AlignedAllocator::allocateAligned(size);
+        } catch (const std::bad_alloc &) {
+            this->bytesInUse -= size;
+            throw;
+        }
+    }
+
+    void deallocate(void *pointer, size_t bytes) override {
+        size_t size = sizeClass(bytes);
+        this->bytesInUse -= size;
+        if (!exited()) {
+            ThreadCache &cache = this->threadCache();
+            if (cache.bytes + size <= this->threadCacheLimit) {
+                cache.buffers[size].push_back(pointer);
+                cache.bytes += size;
+                this->cachedBytes += size;
+                return;
+            }
+        }
+        std::free(pointer);
+    }
+
+    MatrixAllocatorStats stats() const {
+        return {this->allocations, this->reused, this->bytesInUse, this->peakBytes, this->cachedBytes};
+    }
+
+    /**
+     * Restarts counting the allocations, and the peak from the bytes currently in use
+     */
+    void resetStats() {
+        this->allocations = 0;
+        this->reused = 0;
+        this->peakBytes = this->bytesInUse.load();
+    }
+
+    /**
+     * Sets the maximum number of bytes that each thread keeps for reuse. 0 disables the recycling.
+     */
+    void setThreadCacheLimit(size_t bytes) {
+        this->threadCacheLimit = bytes;
+    }
+
+    /**
+     * Frees the buffers kept by the calling thread
+     */
+    void trim() {
+        if (!exited()) {
+            this->threadCache().clear();
+        }
+    }
+
+    /**
+     * @return the size actually allocated for a request of the given bytes
+     */
+    static size_t sizeClass(size_t bytes) {
+        if (bytes <= 4 * ALIGNMENT) {
+            return AlignedAllocator::roundUp(std::max<size_t>(bytes, 1));
+        }
+        size_t power = 4 * ALIGNMENT;
+        while (power * 2 < bytes) {
+            power *= 2;
+        }
+        //bytes is in (power, 2 * power], and the step is a multiple of ALIGNMENT
+        size_t step = power / 4;
+        return (bytes + step - 1) / step * step;
+    }
+
+private:
+
+    ThreadCache &threadCache() {
+        //Only the shared pool is expected, but each pool has its own caches
+        static thread_local std::unordered_map<MatrixBufferPool *, std::unique_ptr<ThreadCache>> caches;
+        std::unique_ptr<ThreadCache> &cache = caches[this];
+        if (cache == nullptr) {
+            cache = std::make_unique<ThreadCache>(this);
+        }
+        return *cache;
+    }
+
+    static bool &exited() {
+        static thread_local bool exited = false;
+        return exited;
+    }
+
+    void addInUse(size_t bytes) {
+        size_t inUse = this->bytesInUse += bytes;
+        size_t peak = this->peakBytes;
+        while (inUse > peak && !this->peakBytes.compare_exchange_weak(peak, inUse)) {
+        }
+    }
+};
+
+inline MatrixAllocator &MatrixAllocator::current() {
+    MatrixAllocator *allocator = currentPointer().load();
+    return allocator != nullptr ? *allocator : MatrixBufferPool::shared();
+}
+
+#endif //MATRIXTEMPLATE_MATRIXALLOCATOR_H
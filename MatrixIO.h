@@ -0,0 +1,456 @@
+#ifndef MATRIXTEMPLATE_MATRIXIO_H
+#define MATRIXTEMPLATE_MATRIXIO_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "MultipleMethod.h"
+#include "MappedMatrixData.h"
+
+/*
+ * Binary format of a matrix file. All the numbers are stored in the byte order of the machine that wrote the file.
+ *
+ * Header, 64 bytes:
+ *   0  magic "MTXB"                       4 bytes
+ *   4  version (1)                        uint16
+ *   6  byte order mark (0x0102)           uint16
+ *   8  element type (MatrixElementType)   uint8
+ *   9  element size in bytes              uint8
+ *  10  layout (0 = row-major)             uint8
+ *  11  flags (MatrixFileHeader::*)        uint8
+ *  12  rows per chunk                     uint32
+ *  16  rows                               uint64
+ *  24  columns                            uint64
+ *  32  offset of the values               uint64
+ *  40  offset of the block index          uint64, 0 if absent
+ *  48  checksum of all the values         uint64, 0 if absent
+ *  56  reserved                           8 bytes
+ *
+ * The values follow the header, contiguous and row-major, so that the file can be mapped with MappedMatrixData.
+ * They are written in chunks of "rows per chunk" rows (the last one can be shorter).
+ * The block index, after the values, contains the FNV-1a checksum (uint64) of the bytes of each chunk.
+ */
+
+/**
+ * Code stored in the header for each type of element. Types without a code cannot be saved.
+ * @tparam T type of the data
+ */
+template<typename T>
+struct MatrixElementType;
+
+#define MATRIX_ELEMENT_TYPE(TYPE, VALUE) \
+template<> \
+struct MatrixElementType<TYPE> { \
+    static const uint8_t CODE = VALUE; \
+    static const char *name() { return #TYPE; } \
+};
+
+MATRIX_ELEMENT_TYPE(int8_t, 1)
+MATRIX_ELEMENT_TYPE(uint8_t, 2)
+MATRIX_ELEMENT_TYPE(int16_t, 3)
+MATRIX_ELEMENT_TYPE(uint16_t, 4)
+MATRIX_ELEMENT_TYPE(int32_t, 5)
+MATRIX_ELEMENT_TYPE(uint32_t, 6)
+MATRIX_ELEMENT_TYPE(int64_t, 7)
+MATRIX_ELEMENT_TYPE(uint64_t, 8)
+MATRIX_ELEMENT_TYPE(float, 9)
+MATRIX_ELEMENT_TYPE(double, 10)
+
+#undef MATRIX_ELEMENT_TYPE
+
+/**
+ * 64 bits FNV-1a hash, computed incrementally
+ */
+class Fnv1a {
+private:
+    uint64_t hash = 14695981039346656037ULL;
+
+public:
+    void update(const void *data, size_t length) {
+        auto *bytes = static_cast<const unsigned char *>(data);
+        uint64_t h = this->hash;
+        for (size_t i = 0; i < length; i++) {
+            h = (h ^ bytes[i]) * 1099511628211ULL;
+        }
+        this->hash = h;
+    }
+
+    uint64_t value() const {
+        return this->hash;
+    }
+};
+
+/**
+ * Header of a matrix file
+ */
+struct MatrixFileHeader {
+    static const unsigned SIZE = 64;
+    static const uint16_t VERSION = 1;
+    static const uint16_t BYTE_ORDER_MARK = 0x0102;
+    static const uint8_t ROW_MAJOR = 0;
+    static const uint8_t HAS_BLOCK_INDEX = 1;
+    static const uint8_t HAS_CHECKSUM = 2;
+
+    uint8_t elementType = 0, elementSize = 0, layout = ROW_MAJOR, flags = 0;
+    uint32_t chunkRows = 0;
+    uint64_t rows = 0, columns = 0, dataOffset = SIZE, indexOffset = 0, checksum = 0;
+
+    void write(std::ostream &output) const {
+        char buffer[SIZE] = {};
+        uint16_t version = VERSION, byteOrder = BYTE_ORDER_MARK;
+        std::memcpy(buffer, "MTXB", 4);
+        std::memcpy(buffer + 4, &version, 2);
+        std::memcpy(buffer + 6, &byteOrder, 2);
+        buffer[8] = (char) this->elementType;
+        buffer[9] = (char) this->elementSize;
+        buffer[10] = (char) this->layout;
+        buffer[11] = (char) this->flags;
+        std::memcpy(buffer + 12, &this->chunkRows, 4);
+        std::memcpy(buffer + 16, &this->rows, 8);
+        std::memcpy(buffer + 24, &this->columns, 8);
+        std::memcpy(buffer + 32, &this->dataOffset, 8);
+        std::memcpy(buffer + 40, &this->indexOffset, 8);
+        std::memcpy(buffer + 48, &this->checksum, 8);
+        output.write(buffer, SIZE);
+    }
+
+    static MatrixFileHeader read(std::istream &input, const std::string &path) {
+        char buffer[SIZE];
+        if (!input.read(buffer, SIZE) || std::memcmp(buffer, "MTXB", 4) != 0) {
+            Utils::error(path + " is not a matrix file");
+        }
+        uint16_t version, byteOrder;
+        std::memcpy(&version, buffer + 4, 2);
+        std::memcpy(&byteOrder, buffer + 6, 2);
+        if (version != VERSION) {
+            Utils::error(path + " has an unsupported version (" + std::to_string(version) + ")");
+        } else if (byteOrder != BYTE_ORDER_MARK) {
+            Utils::error(path + " has been written by a machine with a different byte order");
+        }
+        MatrixFileHeader header;
+        header.elementType = (uint8_t) buffer[8];
+        header.elementSize = (uint8_t) buffer[9];
+        header.layout = (uint8_t) buffer[10];
+        header.flags = (uint8_t) buffer[11];
+        std::memcpy(&header.chunkRows, buffer + 12, 4);
+        std::memcpy(&header.rows, buffer + 16, 8);
+        std::memcpy(&header.columns, buffer + 24, 8);
+        std::memcpy(&header.dataOffset, buffer + 32, 8);
+        std::memcpy(&header.indexOffset, buffer + 40, 8);
+        std::memcpy(&header.checksum, buffer + 48, 8);
+        if (header.layout != ROW_MAJOR) {
+            Utils::error(path + " has an unsupported layout");
+        }
+        header.validate(fileSize(input), path);
+        return header;
+    }
+
+    unsigned numberOfChunks() const {
+        return this->rows == 0 ? 0 : Utils::ceilDiv((unsigned) this->rows, this->chunkRows);
+    }
+
+private:
+    /**
+     * Checks that the sizes can be represented, and that the values and the block index are inside the file
+     */
+    void validate(uint64_t fileSize, const std::string &path) const {
+        const uint64_t maxSize = std::numeric_limits<unsigned>::max();
+        if (this->chunkRows == 0) {
+            Utils::error(path + " has chunks of 0 rows");
+        } else if (this->rows > maxSize || this->columns > maxSize) {
+            Utils::error(path + " is too large (" + std::to_string(this->rows) + "x" + std::to_string(this->columns) + ")");
+        } else if (this->elementSize == 0) {
+            Utils::error(path + " has elements of 0 bytes");
+        }
+        //rows * columns fits in 64 bits, since both fit in 32 bits
+        if (this->dataOffset < SIZE || this->dataOffset > fileSize ||
+            this->rows * this->columns > (fileSize - this->dataOffset) / this->elementSize) {
+            Utils::error(path + " is truncated, or its values are outside the file");
+        }
+        if ((this->flags & HAS_BLOCK_INDEX) &&
+            (this->indexOffset > fileSize || (uint64_t) this->numberOfChunks() > (fileSize - this->indexOffset) / sizeof(uint64_t))) {
+            Utils::error(path + " is truncated, or its block index is outside the file");
+        }
+    }
+
+    static uint64_t fileSize(std::istream &input) {
+        std::streampos position = input.tellg();
+        input.seekg(0, std::ios::end);
+        auto size = (uint64_t) input.tellg();
+        input.seekg(position);
+        return size;
+    }
+};
+
+/**
+ * Writes a matrix file a chunk of rows at a time, so that the writer never holds more than a chunk in memory
+ * (the matrix itself may still compute its whole values, e.g. a product).
+ * The rows must be given in order; <code>close()</code> writes the block index and completes the header.
+ * @tparam T type of the data
+ */
+template<typename T>
+class MatrixWriter {
+private:
+    std::string path;
+    std::ofstream output;
+    MatrixFileHeader header;
+    std::vector<uint64_t> chunkChecksums;
+    Fnv1a checksum, chunkChecksum;
+    unsigned writtenRows = 0;
+    bool closed = false;
+
+public:
+
+    /**
+     * @param chunkRows rows in each chunk of the file. When 0, chunks of about 1MB are used.
+     * @param checksums whether to compute the checksums of the chunks and of the whole matrix
+     */
+    MatrixWriter(const std::string &path, unsigned rows, unsigned columns, unsigned chunkRows = 0, bool checksums = true) :
+            path(path), output(path, std::ios::binary | std::ios::trunc) {
+        if (!this->output) {
+            Utils::error("Cannot create " + path);
+        }
+        if (chunkRows == 0) {
+            chunkRows = std::max<size_t>(1, (1 << 20) / std::max<size_t>(1, (size_t) columns * sizeof(T)));
+        }
+        this->header.elementType = MatrixElementType<T>::CODE;
+        this->header.elementSize = sizeof(T);
+        this->header.flags = checksums ? MatrixFileHeader::HAS_BLOCK_INDEX | MatrixFileHeader::HAS_CHECKSUM : 0;
+        this->header.chunkRows = chunkRows;
+        this->header.rows = rows;
+        this->header.columns = columns;
+        //The header is written by close(): until then the file is not recognized as a matrix
+        char placeholder[MatrixFileHeader::SIZE] = {};
+        this->output.write(placeholder, MatrixFileHeader::SIZE);
+    }
+
+    MatrixWriter(const MatrixWriter<T> &) = delete;
+
+    ~MatrixWriter() {
+        if (!this->closed) {
+            try {
+                this->close();
+            } catch (...) {
+                //Destructors cannot throw: the incomplete file has no valid header
+            }
+        }
+    }
+
+    unsigned rows() const {
+        return (unsigned) this->header.rows;
+    }
+
+    unsigned columns() const {
+        return (unsigned) this->header.columns;
+    }
+
+    unsigned chunkRows() const {
+        return this->header.chunkRows;
+    }
+
+    /**
+     * Appends the given rows, stored contiguously in row-major order
+     */
+    void writeRows(const T *values, unsigned rows) {
+        if (this->closed || this->writtenRows + rows > this->header.rows) {
+            Utils::error("Too many rows written to " + this->path);
+        }
+        const size_t rowBytes = (size_t) this->header.columns * sizeof(T);
+        this->output.write(reinterpret_cast<const char *>(values), (std::streamsize) (rowBytes * rows));
+        if (this->header.flags & MatrixFileHeader::HAS_CHECKSUM) {
+            //The checksum of each chunk covers exactly its rows, even if they are written in pieces of different sizes
+            const char *bytes = reinterpret_cast<const char *>(values);
+            while (rows > 0) {
+                unsigned inChunk = std::min(rows, this->header.chunkRows - this->writtenRows % this->header.chunkRows);
+                this->checksum.update(bytes, rowBytes * inChunk);
+                this->chunkChecksum.update(bytes, rowBytes * inChunk);
+                this->writtenRows += inChunk;
+                if (this->writtenRows % this->header.chunkRows == 0 || this->writtenRows == this->header.rows) {
+                    this->chunkChecksums.push_back(this->chunkChecksum.value());
+                    this->chunkChecksum = Fnv1a();
+                }
+                bytes += rowBytes * inChunk;
+                rows -= inChunk;
+            }
+        } else {
+            this->writtenRows += rows;
+        }
+        if (!this->output) {
+            Utils::error("Cannot write to " + this->path);
+        }
+    }
+
+    /**
+     * Appends the given rows of a matrix of any kind, materializing only one chunk at a time
+     */
+    void write(const MatrixData<T> &matrix, unsigned rowOffset, unsigned rows) {
+        if (matrix.columns() != this->header.columns) {
+            Utils::error("The matrix written to " + this->path + " has the wrong number of columns");
+        }
+        //Starting the optimization of the whole matrix, so that its parts are computed in parallel
+        matrix.virtualOptimize();
+        std::vector<T> buffer((size_t) std::min(this->header.chunkRows, rows) * this->header.columns);
+        for (unsigned r = 0; r < rows; r += this->header.chunkRows) {
+            unsigned height = std::min(this->header.chunkRows, rows - r);
+            matrix.virtualMaterializeInto(buffer.data(), this->header.columns, rowOffset + r, 0, height, this->header.columns);
+            this->writeRows(buffer.data(), height);
+        }
+    }
+
+    void write(const MatrixData<T> &matrix) {
+        this->write(matrix, 0, matrix.rows());
+    }
+
+    /**
+     * Writes the block index and the header. Every row must have been written.
+     */
+    void close() {
+        if (this->closed) {
+            return;
+        }
+        this->closed = true;
+        if (this->writtenRows != this->header.rows) {
+            Utils::error("Only " + std::to_string(this->writtenRows) + " of " + std::to_string(this->header.rows) +
+                         " rows have been written to " + this->path);
+        }
+        if (this->header.flags & MatrixFileHeader::HAS_BLOCK_INDEX) {
+            this->header.indexOffset = (uint64_t) this->output.tellp();
+            this->output.write(reinterpret_cast<const char *>(this->chunkChecksums.data()),
+                               (std::streamsize) (this->chunkChecksums.size() * sizeof(uint64_t)));
+        }
+        if (this->header.flags & MatrixFileHeader::HAS_CHECKSUM) {
+            this->header.checksum = this->checksum.value();
+        }
+        this->output.seekp(0);
+        this->header.write(this->output);
+        this->output.close();
+        if (!this->output) {
+            Utils::error("Cannot write to " + this->path);
+        }
+    }
+};
+
+/**
+ * Reads a matrix file a chunk of rows at a time, verifying the checksum of each chunk when the file has them
+ * @tparam T type of the data
+ */
+template<typename T>
+class MatrixReader {
+private:
+    std::string path;
+    std::ifstream input;
+    MatrixFileHeader header;
+    std::vector<uint64_t> chunkChecksums;
+    unsigned nextChunk = 0;
+
+public:
+
+    explicit MatrixReader(const std::string &path) : path(path), input(path, std::ios::binary) {
+        if (!this->input) {
+            Utils::error("Cannot open " + path);
+        }
+        this->header = MatrixFileHeader::read(this->input, path);
+        if (this->header.elementType != MatrixElementType<T>::CODE || this->header.elementSize != sizeof(T)) {
+            Utils::error(path + " does not contain values of type " + MatrixElementType<T>::name());
+        }
+        if (this->header.flags & MatrixFileHeader::HAS_BLOCK_INDEX) {
+            this->chunkChecksums.resize(this->header.numberOfChunks());
+            this->input.seekg((std::streamoff) this->header.indexOffset);
+            this->input.read(reinterpret_cast<char *>(this->chunkChecksums.data()),
+                             (std::streamsize) (this->chunkChecksums.size() * sizeof(uint64_t)));
+            if (!this->input) {
+                Utils::error(path + " is truncated");
+            }
+        }
+    }
+
+    unsigned rows() const {
+        return (unsigned) this->header.rows;
+    }
+
+    unsigned columns() const {
+        return (unsigned) this->header.columns;
+    }
+
+    unsigned chunkRows() const {
+        return this->header.chunkRows;
+    }
+
+    unsigned numberOfChunks() const {
+        return this->header.numberOfChunks();
+    }
+
+    /**
+     * @return the number of rows of the given chunk
+     */
+    unsigned rowsOfChunk(unsigned chunk) const {
+        return std::min(this->header.chunkRows, this->rows() - chunk * this->header.chunkRows);
+    }
+
+    /**
+     * Reads the given chunk in a row-major buffer, with room for <code>rowsOfChunk(chunk)</code> rows
+     */
+    void readChunk(unsigned chunk, T *destination) {
+        if (chunk >= this->numberOfChunks()) {
+            Utils::error("Chunk out of bounds");
+        }
+        size_t rowBytes = (size_t) this->header.columns * sizeof(T);
+        size_t bytes = rowBytes * this->rowsOfChunk(chunk);
+        this->input.seekg((std::streamoff) (this->header.dataOffset + rowBytes * chunk * this->header.chunkRows));
+        this->input.read(reinterpret_cast<char *>(destination), (std::streamsize) bytes);
+        if (!this->input) {
+            Utils::error(this->path + " is truncated");
+        }
+        if (!this->chunkChecksums.empty()) {
+            Fnv1a checksum;
+            checksum.update(destination, bytes);
+            if (checksum.value() != this->chunkChecksums[chunk]) {
+                Utils::error("Chunk " + std::to_string(chunk) + " of " + this->path + " is corrupted");
+            }
+        }
+    }
+
+    /**
+     * Reads the next chunk of rows
+     * @return false when all the chunks have been read
+     */
+    bool readNextChunk(VectorMatrixData<T> &destination) {
+        if (this->nextChunk >= this->numberOfChunks()) {
+            return false;
+        }
+        destination = VectorMatrixData<T>(this->rowsOfChunk(this->nextChunk), this->columns());
+        this->readChunk(this->nextChunk++, destination.rawData());
+        return true;
+    }
+
+    /**
+     * @return the whole matrix, verifying also the checksum of all the values when the file has it
+     */
+    VectorMatrixData<T> readAll() {
+        VectorMatrixData<T> matrix(this->rows(), this->columns());
+        size_t chunkSize = (size_t) this->header.chunkRows * this->header.columns;
+        for (unsigned chunk = 0; chunk < this->numberOfChunks(); chunk++) {
+            this->readChunk(chunk, matrix.rawData() + chunkSize * chunk);
+        }
+        if (this->header.flags & MatrixFileHeader::HAS_CHECKSUM) {
+            Fnv1a checksum;
+            checksum.update(static_cast<const VectorMatrixData<T> &>(matrix).rawData(), (size_t) matrix.rows() * matrix.columns() * sizeof(T));
+            if (checksum.value() != this->header.checksum) {
+                Utils::error(this->path + " is corrupted");
+            }
+        }
+        return matrix;
+    }
+
+    /**
+     * @return the values of the file, mapped in memory without reading them. Checksums are not verified.
+     */
+    MappedMatrixData<T> map(typename MappedMatrixData<T>::Mode mode = MappedMatrixData<T>::READ_ONLY) const {
+        return MappedMatrixData<T>(this->path, this->rows(), this->columns(), mode, this->header.dataOffset);
+    }
+};
+
+#endif //MATRIXTEMPLATE_MATRIXIO_H
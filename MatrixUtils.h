@@ -6,15 +6,36 @@
 #define MATRIXTEMPLATE_MATRIXUTILS_H
 
 #include <future>
+#include <limits>
+#include "ThreadPool.h"
+#include "MemoryBudget.h"
 
 template<typename T, class O>
 class OptimizableMD : public MatrixData<T> {
-protected:
-    mutable std::mutex optimizeMutex; //Mutex for the method optimize()
 private:
-    mutable std::shared_future<std::unique_ptr<O>> optimized;
-    //I'm saving the pointer to optimized matrix in order to skip accessing it through a future and a unique_ptr
-    mutable O *optimizedPointer = NULL;
+    /**
+     * The optimized matrix, shared by all the copies of this object: it is computed only once, by the first one
+     * that needs it, and released with the last one
+     */
+    struct OptimizedState {
+        std::mutex mutex; //Mutex for the method optimize()
+        bool started = false;
+        //What the optimized matrix refers to. Declared before it, so that it is released after it
+        std::shared_ptr<const void> sources;
+        //Ready once matrix has been computed (or has failed)
+        std::shared_future<void> optimized;
+        std::unique_ptr<O> matrix;
+        //I'm saving the pointer to optimized matrix in order to skip accessing it through a future and a unique_ptr
+        std::atomic<O *> pointer{nullptr};
+        //Signalled once the optimized matrix, and everything it contains, has been computed
+        std::shared_ptr<CompletionEvent> completion = std::make_shared<CompletionEvent>();
+        //The memory granted by the MemoryBudget to compute the optimized matrix, if any
+        std::shared_ptr<MemoryBudget::Reservation> reservation;
+    };
+
+    std::shared_ptr<OptimizedState> state = std::make_shared<OptimizedState>();
+    //Whether the optimized matrix is being computed by this object, which then can't be destroyed before it is done
+    mutable bool computing = false;
 
 public:
 
@@ -23,34 +44,47 @@ public:
     }
 
     OptimizableMD(const OptimizableMD<T, O> &another) :
-            MatrixData<T>(another.rows(), another.columns()) {
-        //The cached data is not passed around, since it will be too difficult to copy
-        if (another.optimizedPointer != NULL) {
-            std::cout << "Warning: cached data is lost!\n";
-        }
+            MatrixData<T>(another.rows(), another.columns()), state(another.state) {
     }
 
+    //The state is shared rather than stolen: the moved object could be the one computing the optimized matrix
     OptimizableMD(OptimizableMD<T, O> &&another) noexcept :
-            MatrixData<T>(another.rows(), another.columns()) {
-        //The cached data is not passed around, since it will be too difficult to move
+            MatrixData<T>(another.rows(), another.columns()), state(another.state) {
     }
 
     virtual ~OptimizableMD() {
-        if (this->optimized.valid()) {
-            this->optimized.wait();
+        if (this->computing) {
+            auto future = this->getOptimizedFuture();
+            ThreadPool::shared().wait(future);
         }
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        if (!this->optimizeHasBeenCalled) {
+            this->optimize();
+        }
+        this->waitOptimizedPointer()->virtualMaterializeInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        if (!this->optimizeHasBeenCalled) {
+            this->optimize();
+        }
+        this->waitOptimizedPointer()->virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+    }
 
     void virtualWaitOptimized() const override {
         MatrixData<T>::virtualWaitOptimized();
-        auto future = this->optimized;
+        auto future = this->getOptimizedFuture();
         if (future.valid()) {
-            future.wait();
-        }
-        if (this->optimizedPointer != NULL) {
-            this->optimizedPointer->virtualWaitOptimized();
+            ThreadPool::shared().wait(future);
+            if (this->state->matrix != nullptr) {
+                this->state->matrix->virtualWaitOptimized();
+            }
         }
     }
 
@@ -58,25 +92,107 @@ public:
         this->optimize();
     }
 
+    const MatrixData<T> *virtualGetOptimized() const override {
+        return this->waitOptimizedPointer()->virtualGetOptimized();
+    }
+
+    void virtualWhenOptimized(std::function<void()> callback) const override {
+        this->optimize();
+        this->state->completion->whenDone(callback);
+    }
+
     void optimize() const {
-        std::unique_lock<std::mutex> lock(this->optimizeMutex);
-        if (!this->optimizeHasBeenCalled) {
-            this->optimized = std::async(std::launch::async, [=] {
+        std::unique_lock<std::mutex> lock(this->state->mutex);
+        this->optimizeHasBeenCalled = true;
+        //Already computed, or being computed, by a copy of this object
+        if (this->state->started) {
+            return;
+        }
+        this->state->started = true;
+        this->computing = true;
+        auto promise = std::make_shared<std::promise<void>>();
+        this->state->optimized = promise->get_future().share();
+        lock.unlock();
+
+        auto dependencies = this->virtualGetDependencies();
+        for (auto &dependency : dependencies) {
+            dependency->virtualOptimize();
+        }
+        //The task is submitted to the shared pool only once its dependencies are ready, so it never waits inside a worker
+        MatrixData<T>::whenAllOptimized(dependencies, [this, promise] {
+            size_t bytes = this->virtualGetReservedBytes();
+            if (bytes == 0) {
+                this->submitOptimization(promise);
+                return;
+            }
+            //Reserving only now: a running computation never waits for another one to be admitted
+            MemoryBudget::shared().whenAvailable(bytes, this->virtualGetMemoryUsage(),
+                                                 [this, promise](std::shared_ptr<MemoryBudget::Reservation> reservation) {
+                                                     this->state->reservation = std::move(reservation);
+                                                     this->submitOptimization(promise);
+                                                 });
+        });
+    }
+
+private:
+    void submitOptimization(std::shared_ptr<std::promise<void>> promise) const {
+        //Not the whole state: it would be released by the worker, instead of by whoever destroys the last copy
+        std::shared_ptr<CompletionEvent> completion = this->state->completion;
+        ThreadPool::shared().submit([this, promise, completion] {
+            try {
                 auto ptr = this->virtualCreateOptimizedMatrix();
                 ptr->virtualOptimize();
-                return ptr;
-            }).share();
-            this->optimizeHasBeenCalled = true;
+                //The computation ends only once everything inside the result has been computed, since until then it
+                //can still allocate or free memory. Not keeping the reservation alive: it belongs to this matrix.
+                std::weak_ptr<MemoryBudget::Reservation> reservation = this->state->reservation;
+                size_t keptBytes = this->virtualGetKeptBytes();
+                //Registering before publishing the result, since afterwards this object could be destroyed.
+                //The dependent matrices are started only once the result is also published, so they never wait for it.
+                auto pending = std::make_shared<std::atomic<int>>(2);
+                auto signal = [completion, pending, reservation, keptBytes] {
+                    if (--*pending == 0) {
+                        if (auto finished = reservation.lock()) {
+                            finished->finish(keptBytes);
+                        }
+                        completion->signal();
+                    }
+                };
+                ptr->virtualWhenOptimized(signal);
+                this->state->matrix = std::move(ptr);
+                promise->set_value();
+                signal();
+            } catch (...) {
+                this->finishReservation(0);
+                promise->set_exception(std::current_exception());
+                completion->signal();
+            }
+        });
+    }
+
+    /**
+     * @return the optimized matrix, waiting for it (and starting its computation, if needed)
+     */
+    O *waitOptimizedPointer() const {
+        O *pointer = this->state->pointer;
+        if (pointer == nullptr) {
+            this->optimize();
+            auto future = this->getOptimizedFuture();
+            ThreadPool::shared().wait(future);
+            //Rethrows the error of the computation, if any
+            future.get();
+            pointer = this->state->matrix.get();
+            this->state->pointer = pointer;
         }
+        return pointer;
+    }
+
+    std::shared_future<void> getOptimizedFuture() const {
+        std::unique_lock<std::mutex> lock(this->state->mutex);
+        return this->state->optimized;
     }
 
-private:
     T doGet(unsigned row, unsigned col) const {
-        if (this->optimizedPointer == NULL) {
-            //I'm saving the pointer to optimized matrix in order to skip accessing it through a future and a unique_ptr
-            this->optimizedPointer = optimized.get().get();
-        }
-        return this->optimizedPointer->get(row, col);
+        return this->waitOptimizedPointer()->get(row, col);
     }
 
 
@@ -86,6 +202,61 @@ protected:
      * This method optimizes the multiplication if the multiplication chain involves more than three matrix.
      */
     virtual std::unique_ptr<O> virtualCreateOptimizedMatrix() const = 0;
+
+    /**
+     * @return the matrices read by <code>virtualCreateOptimizedMatrix()</code>: it is executed only once all of them have been optimized
+     */
+    virtual std::vector<const MatrixData<T> *> virtualGetDependencies() const {
+        return std::vector<const MatrixData<T> *>();
+    }
+
+    /**
+     * @return the bytes needed by <code>virtualCreateOptimizedMatrix()</code>, reserved from
+     * <code>MemoryBudget::shared()</code> once the dependencies are ready. 0 to start immediately.
+     */
+    virtual size_t virtualGetReservedBytes() const {
+        return 0;
+    }
+
+    /**
+     * @return where the reserved bytes are accounted, e.g. shared by all the blocks of a product
+     */
+    virtual std::shared_ptr<MemoryUsage> virtualGetMemoryUsage() const {
+        return nullptr;
+    }
+
+    /**
+     * @return the reserved bytes that stay reserved, until this matrix is destroyed, once everything inside the
+     * optimized matrix has been computed (e.g. its buffer). By default all of them.
+     */
+    virtual size_t virtualGetKeptBytes() const {
+        return std::numeric_limits<size_t>::max();
+    }
+
+    /**
+     * Ends the computation keeping only the given bytes, e.g. when it fails
+     */
+    void finishReservation(size_t keptBytes) const {
+        if (this->state->reservation != nullptr) {
+            this->state->reservation->finish(keptBytes);
+        }
+    }
+
+    /**
+     * @return whether the optimized matrix has already been computed, or is being computed, by this object or a copy
+     */
+    bool isOptimizationStarted() const {
+        std::unique_lock<std::mutex> lock(this->state->mutex);
+        return this->state->started;
+    }
+
+    /**
+     * The given objects, referred by the optimized matrix, are kept alive as long as it is, i.e. as long as any
+     * copy of this object
+     */
+    void keepWithOptimized(std::shared_ptr<const void> sources) {
+        this->state->sources = std::move(sources);
+    }
 };
 
 
@@ -102,6 +273,11 @@ public:
 
 protected:
     std::unique_ptr<VectorMatrixData<T>> virtualCreateOptimizedMatrix() const override {
+    //Values already in a buffer (with any layout) are not copied, e.g. the result of a product
+    auto view = this->wrapped->virtualGetOptimized()->virtualGetStridedView();
+    if (view != nullptr) {
+        return std::make_unique<VectorMatrixData<T>>(view->submatrixView(rowOffset, colOffset, this->rows(), this->columns()));
+    }
     auto materialized = this->wrapped->virtualMaterialize(rowOffset, colOffset, this->rows(), this->columns());
     return std::make_unique<VectorMatrixData<T>>(materialized);
     }
@@ -109,6 +285,10 @@ protected:
     std::vector<const MatrixData<T> *> virtualGetChildren() const override {
     return {this->wrapped};
     }
+
+    std::vector<const MatrixData<T> *> virtualGetDependencies() const override {
+    return {this->wrapped};
+    }
 };
 
 #endif //MATRIXTEMPLATE_MATRIXUTILS_H
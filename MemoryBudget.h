@@ -0,0 +1,258 @@
+#ifndef MATRIXTEMPLATE_MEMORYBUDGET_H
+#define MATRIXTEMPLATE_MEMORYBUDGET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * Bytes reserved by one evaluation (e.g. all the blocks of a product), and the maximum reached
+ */
+class MemoryUsage {
+private:
+    std::atomic<size_t> current{0}, peak{0};
+
+public:
+    size_t bytes() const {
+        return this->current;
+    }
+
+    size_t peakBytes() const {
+        return this->peak;
+    }
+
+    void add(size_t bytes) {
+        size_t now = this->current += bytes;
+        size_t max = this->peak;
+        while (now > max && !this->peak.compare_exchange_weak(max, now)) {
+        }
+    }
+
+    void remove(size_t bytes) {
+        this->current -= bytes;
+    }
+};
+
+/**
+ * Limit on the bytes of the buffers created while optimizing the matrices (see <code>OptimizableMD</code>).
+ *
+ * Each computation asks for the bytes it will need before starting, and is started only when they fit in the limit:
+ * the requests are admitted in order, so that a large one is not starved by smaller ones. When a computation ends,
+ * it keeps only the bytes of its result, and the waiting computations are admitted.
+ * A request is always admitted when no other computation is running, even if the limit is exceeded (e.g. by
+ * results that are still in use), so the evaluation never stops: it just runs one computation at a time.
+ */
+class MemoryBudget {
+public:
+
+    /**
+     * Bytes granted to a computation, given back when destroyed
+     */
+    class Reservation {
+    private:
+        MemoryBudget *budget;
+        std::shared_ptr<MemoryUsage> usage;
+        size_t bytes;
+        bool running = true;
+
+        friend class MemoryBudget;
+
+        Reservation(MemoryBudget *budget, std::shared_ptr<MemoryUsage> usage, size_t bytes) :
+                budget(budget), usage(usage), bytes(bytes) {
+            if (this->usage != nullptr) {
+                this->usage->add(bytes);
+            }
+        }
+
+    public:
+        Reservation(const Reservation &) = delete;
+
+        ~Reservation() {
+            this->finish(0);
+        }
+
+        size_t getBytes() const {
+            return this->bytes;
+        }
+
+        /**
+         * Marks the computation as ended, keeping only the given bytes (e.g. its result) until destroyed
+         */
+        void finish(size_t keptBytes) {
+            size_t released = this->bytes - std::min(keptBytes, this->bytes);
+            if (this->usage != nullptr) {
+                this->usage->remove(released);
+            }
+            this->bytes -= released;
+            bool wasRunning = this->running;
+            this->running = false;
+            this->budget->release(released, wasRunning);
+        }
+    };
+
+    typedef std::function<void(std::shared_ptr<Reservation>)> Callback;
+
+private:
+    struct Request {
+        size_t bytes;
+        std::shared_ptr<MemoryUsage> usage;
+        Callback callback;
+    };
+
+    std::mutex mutex;
+    std::deque<Request> waiting;
+    size_t limit;
+    size_t reserved = 0, peak = 0;
+    unsigned running = 0;
+
+public:
+
+    /**
+     * @param limit maximum number of bytes, 0 for no limit
+     */
+    explicit MemoryBudget(size_t limit) : limit(limit) {
+    }
+
+    MemoryBudget(const MemoryBudget &) = delete;
+
+    /**
+     * @return the budget used by the library. Its limit is read from the environment variable MATRIX_MEMORY_BUDGET
+     * (e.g. 4G or 512M), and is unlimited by default.
+     */
+    static MemoryBudget &shared() {
+        static MemoryBudget budget(parseSize(std::getenv("MATRIX_MEMORY_BUDGET")));
+        return budget;
+    }
+
+    /**
+     * Changes the limit: 0 removes it
+     */
+    void setLimit(size_t bytes) {
+        std::vector<std::pair<Request, std::shared_ptr<Reservation>>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->limit = bytes;
+            this->admit(admitted);
+        }
+        run(admitted);
+    }
+
+    size_t getLimit() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        return this->limit;
+    }
+
+    /**
+     * @return the bytes currently reserved
+     */
+    size_t getReserved() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        return this->reserved;
+    }
+
+    /**
+     * @return the maximum number of bytes that has been reserved at the same time
+     */
+    size_t getPeak() {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        return this->peak;
+    }
+
+    /**
+     * Calls the given function with a reservation of the given bytes, as soon as they are available.
+     * The function may be called immediately by the calling thread, or later by the thread releasing the memory.
+     * @param usage if not null, it is updated with the bytes of the reservation
+     */
+    void whenAvailable(size_t bytes, std::shared_ptr<MemoryUsage> usage, Callback callback) {
+        std::vector<std::pair<Request, std::shared_ptr<Reservation>>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->waiting.push_back({bytes, usage, callback});
+            this->admit(admitted);
+        }
+        run(admitted);
+    }
+
+    /**
+     * Parses a number of bytes, with an optional suffix K, M or G. Returns 0 if null or invalid.
+     */
+    static size_t parseSize(const char *text) {
+        if (text == nullptr) {
+            return 0;
+        }
+        char *end = nullptr;
+        double value = std::strtod(text, &end);
+        if (end == text || value < 0) {
+            return 0;
+        }
+        switch (*end) {
+            case 'k':
+            case 'K':
+                value *= 1024.0;
+                break;
+            case 'm':
+            case 'M':
+                value *= 1024.0 * 1024;
+                break;
+            case 'g':
+            case 'G':
+                value *= 1024.0 * 1024 * 1024;
+                break;
+            default:
+                break;
+        }
+        return (size_t) value;
+    }
+
+private:
+
+    void release(size_t bytes, bool ended) {
+        std::vector<std::pair<Request, std::shared_ptr<Reservation>>> admitted;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->reserved -= bytes;
+            if (ended) {
+                this->running--;
+            }
+            this->admit(admitted);
+        }
+        run(admitted);
+    }
+
+    /**
+     * Moves the requests that fit from the queue to admitted. Must be called holding the mutex.
+     */
+    void admit(std::vector<std::pair<Request, std::shared_ptr<Reservation>>> &admitted) {
+        while (!this->waiting.empty()) {
+            Request &request = this->waiting.front();
+            bool fits = this->limit == 0 || this->reserved + request.bytes <= this->limit;
+            if (!fits && this->running > 0) {
+                return;
+            }
+            this->reserved += request.bytes;
+            this->peak = std::max(this->peak, this->reserved);
+            this->running++;
+            std::shared_ptr<Reservation> reservation(new Reservation(this, request.usage, request.bytes));
+            admitted.emplace_back(std::move(request), reservation);
+            this->waiting.pop_front();
+        }
+    }
+
+    /**
+     * Starts the admitted computations, without holding the mutex
+     */
+    static void run(std::vector<std::pair<Request, std::shared_ptr<Reservation>>> &admitted) {
+        for (auto &requestAndReservation : admitted) {
+            //Not keeping a reference: the reservation must be released as soon as its owner is destroyed
+            requestAndReservation.first.callback(std::move(requestAndReservation.second));
+        }
+    }
+};
+
+#endif //MATRIXTEMPLATE_MEMORYBUDGET_H
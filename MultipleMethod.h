@@ -11,7 +11,13 @@
 #include <tuple>
 #include <deque>
 #include <mutex>
+#include <atomic>
+#include <functional>
 #include "Utils.h"
+#include "Simd.h"
+#include "Transpose.h"
+#include "MatrixAllocator.h"
+#include "ThreadPool.h"
 
 template<typename T>
 class VectorMatrixData;
@@ -21,7 +27,8 @@ class MultiplyMD;
 
 //This macro is used to add the method virtualMaterialize() to implementations of MatrixData, without copy-pasting code.
 //It is necessary, since this methods call an inherited non-virtual method (i.e. get(r,c))
-#define MATERIALIZE_IMPL        \
+//Classes using this macro directly must provide their own virtualMaterializeInto().
+#define MATERIALIZE_COMMON_IMPL        \
 VectorMatrixData<T> virtualMaterialize(unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {\
     if (rows < 0 || columns < 0 || rowOffset < 0 || colOffset < 0 || rowOffset + rows > this->rows() || colOffset + columns > this->columns()) {\
         Utils::error("Illegal bounds");\
@@ -30,11 +37,7 @@ VectorMatrixData<T> virtualMaterialize(unsigned rowOffset, unsigned colOffset, u
         this->optimize();\
     }\
     VectorMatrixData<T> ret(rows, columns);\
-    for (unsigned r = 0; r < rows; r++) {\
-        for (unsigned c = 0; c < columns; c++) {\
-            ret.set(r, c, this->doGet(r + rowOffset, c + colOffset));\
-        }\
-    }\
+    this->materializeInParallel(ret.rawData(), columns, rowOffset, colOffset, rows, columns);\
     return ret;\
 }\
 \
@@ -43,6 +46,25 @@ T get(unsigned row, unsigned col) const {\
         this->optimize();\
     }\
     return this->doGet(row, col);\
+}\
+\
+T virtualGet(unsigned row, unsigned col) const override {\
+    return this->get(row, col);\
+}
+
+//Same as MATERIALIZE_COMMON_IMPL, materializing cell by cell
+#define MATERIALIZE_IMPL        \
+MATERIALIZE_COMMON_IMPL \
+\
+void virtualMaterializeInto(T *destination, unsigned destinationStride, unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {\
+    if (!this->optimizeHasBeenCalled) {\
+        this->optimize();\
+    }\
+    for (unsigned r = 0; r < rows; r++) {\
+        for (unsigned c = 0; c < columns; c++) {\
+            destination[(size_t) r * destinationStride + c] = this->doGet(r + rowOffset, c + colOffset);\
+        }\
+    }\
 }
 
 /**
@@ -90,6 +112,76 @@ public:
 
     virtual VectorMatrixData<T> virtualMaterialize(unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const = 0;
 
+    /**
+     * Same as get(), for when the type of the matrix is not known
+     */
+    virtual T virtualGet(unsigned row, unsigned col) const = 0;
+
+    T get(unsigned row, unsigned col) const {
+        return this->virtualGet(row, col);
+    }
+
+    /**
+     * @return the matrix that actually holds the values of this one once it has been optimized (e.g. the result of a
+     * product), or this matrix itself. Must be called only once the optimization has completed.
+     */
+    virtual const MatrixData<T> *virtualGetOptimized() const {
+        return this;
+    }
+
+    /**
+     * @return if this is a diagonal matrix built from a vector (see <code>DiagonalMatrixMD</code>), that vector.
+     * Otherwise nullptr.
+     */
+    virtual const MatrixData<T> *virtualGetDiagonalVector() const {
+        return nullptr;
+    }
+
+    /**
+     * @return a <code>VectorMatrixData</code> sharing the values of this matrix, if they are stored in a buffer
+     * (possibly with any stride, e.g. a transposed or a submatrix of a dense matrix). Otherwise nullptr.
+     * Kernels use it to read the values in place, instead of materializing them.
+     */
+    virtual std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const {
+        return nullptr;
+    }
+
+    /**
+     * Copies the given region of this matrix in a row-major buffer, whose rows start every <code>destinationStride</code> elements.
+     * Bounds are not checked.
+     */
+    virtual void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                        unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const = 0;
+
+    /**
+     * Same as <code>virtualMaterializeInto()</code>, but large regions are split in ranges of rows materialized in
+     * parallel by <code>ThreadPool::shared()</code>
+     */
+    void materializeInParallel(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const {
+        ThreadPool::shared().parallelFor(0, rows, columns, [&](unsigned first, unsigned last) {
+            this->virtualMaterializeInto(destination + (size_t) first * destinationStride, destinationStride,
+                                         rowOffset + first, colOffset, last - first, columns);
+        });
+    }
+
+    /**
+     * Adds the given region of this matrix to a row-major buffer, like <code>virtualMaterializeInto()</code>.
+     * By default, the region is materialized a strip of rows at a time in a small buffer.
+     */
+    virtual void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                                       unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const {
+        unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+        std::vector<T> strip((size_t) std::min(stripRows, rows) * columns);
+        for (unsigned s = 0; s < rows; s += stripRows) {
+            unsigned height = std::min(stripRows, rows - s);
+            this->virtualMaterializeInto(strip.data(), columns, rowOffset + s, colOffset, height, columns);
+            for (unsigned r = 0; r < height; r++) {
+                SimdOps<T>::add(destination + (size_t) (s + r) * destinationStride, strip.data() + (size_t) r * columns, columns);
+            }
+        }
+    }
+
     virtual std::vector<const MatrixData<T> *> virtualGetChildren() const {
         return std::vector<const MatrixData<T> *>();
     }
@@ -109,34 +201,273 @@ public:
             child->virtualWaitOptimized();
         }
     }
+
+    /**
+     * Calls the given function, without blocking, once this matrix and all its children have been optimized.
+     * The function may be called immediately, by the calling thread.
+     */
+    virtual void virtualWhenOptimized(std::function<void()> callback) const {
+        whenAllOptimized(this->virtualGetChildren(), callback);
+    }
+
+    /**
+     * Calls the given function once all the given matrices have been optimized
+     */
+    static void whenAllOptimized(const std::vector<const MatrixData<T> *> &matrices, std::function<void()> callback) {
+        if (matrices.empty()) {
+            callback();
+            return;
+        }
+        auto remaining = std::make_shared<std::atomic<unsigned>>(matrices.size());
+        for (auto &matrix : matrices) {
+            matrix->virtualWhenOptimized([remaining, callback] {
+                if (--*remaining == 0) {
+                    callback();
+                }
+            });
+        }
+    }
+};
+
+/**
+ * Order in which the values of a dense matrix are stored
+ */
+enum class MatrixLayout {
+    ROW_MAJOR,
+    COLUMN_MAJOR,
+    //Any other distance between rows and columns, e.g. a view over a part of another buffer
+    STRIDED
 };
 
 /**
- * Implementation of <code>MatrixData</code> that actually holds the value in a <code>std::vector</code>
+ * Implementation of <code>MatrixData</code> that actually holds the values, in a buffer obtained from
+ * <code>MatrixAllocator::current()</code>.
+ * The cell (r, c) is stored at <code>rawData()[r * getRowStride() + c * getColStride()]</code>: new matrices are
+ * row-major or column-major, while <code>transposedView()</code> and <code>submatrixView()</code> describe a part
+ * of the same buffer with different strides, without copying it.
  * @tparam T type of the data
  */
 template<typename T>
 class VectorMatrixData : public MatrixData<T> {
 
 private:
-    std::shared_ptr<std::vector<T>> vector;
+    /**
+     * The buffer of a matrix, shared by all its views. The copies of the matrix (see <code>copy()</code>) have a
+     * Storage of their own, sharing the same values until one of them is written.
+     */
+    struct Storage {
+        //Keeps the values alive. If they have been allocated by this class, its use count is the number of copies sharing them.
+        std::shared_ptr<void> owner;
+        T *values;
+        //Number of values, 0 if they are owned by someone else: they are then never shared by the copies
+        size_t size;
+        //Whether the values cannot be written, e.g. a file mapped as read-only
+        bool readOnly = false;
+        std::mutex mutex;
+
+        Storage(std::shared_ptr<void> owner, T *values, size_t size) : owner(std::move(owner)), values(values), size(size) {
+        }
+    };
+
+    std::shared_ptr<Storage> storage;
+    //Position of the cell (0, 0) in the buffer
+    size_t offset = 0;
+    size_t rowStride, colStride;
+
+    VectorMatrixData(unsigned rows, unsigned columns, std::shared_ptr<Storage> storage, size_t offset, size_t rowStride, size_t colStride) :
+            MatrixData<T>(rows, columns), storage(std::move(storage)), offset(offset), rowStride(rowStride), colStride(colStride) {
+    }
+
 public:
 
-    VectorMatrixData(unsigned rows, unsigned columns, std::shared_ptr<std::vector<T>> vector) : MatrixData<T>(rows, columns), vector(vector) {
+    VectorMatrixData(unsigned rows, unsigned columns, std::shared_ptr<std::vector<T>> vector) :
+            MatrixData<T>(rows, columns), storage(std::make_shared<Storage>(vector, vector->data(), 0)), rowStride(columns), colStride(1) {
     }
 
-    VectorMatrixData(unsigned rows, unsigned columns) : MatrixData<T>(rows, columns), vector(std::make_shared<std::vector<T >>(rows * columns)) {
+    VectorMatrixData(unsigned rows, unsigned columns) : VectorMatrixData(rows, columns, MatrixLayout::ROW_MAJOR) {
     }
 
-    MATERIALIZE_IMPL
+    VectorMatrixData(unsigned rows, unsigned columns, MatrixLayout layout) : MatrixData<T>(rows, columns) {
+        if (layout == MatrixLayout::STRIDED) {
+            Utils::error("A new matrix is either row-major or column-major");
+        }
+        std::shared_ptr<T> buffer = MatrixAllocator::allocateArray<T>((size_t) rows * columns);
+        this->storage = std::make_shared<Storage>(buffer, buffer.get(), (size_t) rows * columns);
+        this->rowStride = layout == MatrixLayout::ROW_MAJOR ? columns : 1;
+        this->colStride = layout == MatrixLayout::ROW_MAJOR ? 1 : rows;
+    }
+
+    /**
+     * View over values owned by someone else
+     * @param owner keeps the values alive as long as this matrix (or one of its copies) exists
+     * @param values position of the cell (0, 0)
+     */
+    VectorMatrixData(unsigned rows, unsigned columns, std::shared_ptr<void> owner, T *values, size_t rowStride, size_t colStride) :
+            MatrixData<T>(rows, columns), storage(std::make_shared<Storage>(owner, values, 0)), rowStride(rowStride), colStride(colStride) {
+    }
+
+    /**
+     * View over values owned by someone else, that cannot be written: <code>set()</code>, the non-const
+     * <code>rawData()</code> and <code>transposeInPlace()</code> raise an error (also on its views)
+     */
+    static VectorMatrixData<T> readOnlyView(unsigned rows, unsigned columns, std::shared_ptr<void> owner, const T *values,
+                                            size_t rowStride, size_t colStride) {
+        auto storage = std::make_shared<Storage>(owner, const_cast<T *>(values), 0);
+        storage->readOnly = true;
+        return VectorMatrixData<T>(rows, columns, storage, 0, rowStride, colStride);
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        const T *source = this->cell(rowOffset, colOffset);
+        if (this->colStride == 1) {
+            for (unsigned r = 0; r < rows; r++) {
+                std::copy_n(source + r * this->rowStride, columns, destination + (size_t) r * destinationStride);
+            }
+        } else if (this->rowStride == 1) {
+            //The rows of the destination are columns of the buffer
+            Transpose<T>::transpose(source, this->colStride, destination, destinationStride, columns, rows);
+        } else {
+            for (unsigned r = 0; r < rows; r++) {
+                for (unsigned c = 0; c < columns; c++) {
+                    destination[(size_t) r * destinationStride + c] = source[r * this->rowStride + c * this->colStride];
+                }
+            }
+        }
+    }
 
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        if (this->colStride != 1) {
+            MatrixData<T>::virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+            return;
+        }
+        const T *source = this->cell(rowOffset, colOffset);
+        for (unsigned r = 0; r < rows; r++) {
+            SimdOps<T>::add(destination + (size_t) r * destinationStride, source + r * this->rowStride, columns);
+        }
+    }
+
+    /**
+     * Changes a value. As for all the writes, if the buffer is shared with a copy it is duplicated first.
+     * The change is visible to all the views of this matrix.
+     */
     void set(unsigned row, unsigned col, T t) {
-        (*this->vector.get())[row * this->columns() + col] = t;
+        this->detach();
+        *this->cell(row, col) = t;
     }
 
+    /**
+     * @return the position of the cell (0, 0) in the underlying buffer, to write it. If the buffer is shared with a
+     * copy, it is duplicated first: only the const version should be used to read.
+     */
+    T *rawData() {
+        this->detach();
+        return this->storage->values + this->offset;
+    }
+
+    const T *rawData() const {
+        return this->storage->values + this->offset;
+    }
+
+    /**
+     * @return the distance in the buffer between two consecutive rows
+     */
+    size_t getRowStride() const {
+        return this->rowStride;
+    }
+
+    /**
+     * @return the distance in the buffer between two consecutive columns
+     */
+    size_t getColStride() const {
+        return this->colStride;
+    }
+
+    /**
+     * @return ROW_MAJOR or COLUMN_MAJOR if the values are contiguous in that order, otherwise STRIDED
+     */
+    MatrixLayout getLayout() const {
+        if (this->colStride == 1 && (this->rowStride == this->columns() || this->rows() <= 1)) {
+            return MatrixLayout::ROW_MAJOR;
+        } else if (this->rowStride == 1 && (this->colStride == this->rows() || this->columns() <= 1)) {
+            return MatrixLayout::COLUMN_MAJOR;
+        }
+        return MatrixLayout::STRIDED;
+    }
+
+    /**
+     * @return the transposed of this matrix, sharing the same values
+     */
+    VectorMatrixData<T> transposedView() const {
+        return VectorMatrixData<T>(this->columns(), this->rows(), this->storage, this->offset, this->colStride, this->rowStride);
+    }
+
+    /**
+     * @return a part of this matrix, sharing the same values
+     */
+    VectorMatrixData<T> submatrixView(unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const {
+        if (rowOffset + rows > this->rows() || colOffset + columns > this->columns()) {
+            Utils::error("Illegal bounds");
+        }
+        return VectorMatrixData<T>(rows, columns, this->storage, this->offset + rowOffset * this->rowStride + colOffset * this->colStride,
+                                   this->rowStride, this->colStride);
+    }
+
+    std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const override {
+        return std::make_unique<VectorMatrixData<T>>(*this);
+    }
+
+    /**
+     * Transposes the matrix without allocating a new buffer.
+     * As for <code>set()</code>, the change is visible to all the views sharing this data.
+     */
+    void transposeInPlace() {
+        if (this->rows() != this->columns()) {
+            Utils::error("Only square matrices can be transposed in place");
+        }
+        this->detach();
+        if (this->colStride == 1 || this->rowStride == 1) {
+            //Transposing the buffer transposes the matrix, whatever the order of the values
+            Transpose<T>::transposeInPlace(this->cell(0, 0), std::max(this->rowStride, this->colStride), this->rows());
+        } else {
+            for (unsigned r = 0; r < this->rows(); r++) {
+                for (unsigned c = r + 1; c < this->columns(); c++) {
+                    std::swap(*this->cell(r, c), *this->cell(c, r));
+                }
+            }
+        }
+    }
+
+    /**
+     * @return a copy with contiguous values, in the same order of this one (row-major if strided).
+     * A copy of a whole buffer shares it until either matrix is written (copy-on-write), so passing a matrix by value
+     * costs nothing if it is only read. Each of the two matrices then keeps its views.
+     */
     VectorMatrixData<T> copy() const {
-        //std::cout << "copying" << std::endl;
-        return VectorMatrixData<T>(this->rows(), this->columns(), std::make_shared<std::vector<T>>(*this->vector.get()));
+        size_t size = (size_t) this->rows() * this->columns();
+        if (this->storage->size == size && this->offset == 0 && this->getLayout() != MatrixLayout::STRIDED) {
+            std::unique_lock<std::mutex> lock(this->storage->mutex);
+            auto storage = std::make_shared<Storage>(this->storage->owner, this->storage->values, size);
+            return VectorMatrixData<T>(this->rows(), this->columns(), storage, 0, this->rowStride, this->colStride);
+        }
+        if (this->getLayout() != MatrixLayout::COLUMN_MAJOR) {
+            VectorMatrixData<T> ret(this->rows(), this->columns(), MatrixLayout::ROW_MAJOR);
+            this->materializeInParallel(ret.rawData(), this->columns(), 0, 0, this->rows(), this->columns());
+            return ret;
+        }
+        VectorMatrixData<T> ret(this->rows(), this->columns(), MatrixLayout::COLUMN_MAJOR);
+        std::copy_n(this->rawData(), size, ret.rawData());
+        return ret;
+    }
+
+    /**
+     * @return whether the values are shared with a copy of this matrix, i.e. the next write will duplicate them
+     */
+    bool isShared() const {
+        return this->storage->size != 0 && this->storage->owner.use_count() > 1;
     }
 
     template<class MD>
@@ -145,8 +476,38 @@ public:
     }
 
 private:
+    /**
+     * Before a write: gives a buffer of its own to this matrix (and to its views) if it is shared with a copy
+     */
+    void detach() {
+        Storage &storage = *this->storage;
+        if (storage.readOnly) {
+            Utils::error("Cannot write into a read-only matrix");
+        }
+        if (storage.size == 0 || storage.owner.use_count() == 1) {
+            return;
+        }
+        std::unique_lock<std::mutex> lock(storage.mutex);
+        if (storage.owner.use_count() == 1) {
+            return;
+        }
+        std::shared_ptr<T> buffer = MatrixAllocator::allocateArray<T>(storage.size);
+        std::copy_n(storage.values, storage.size, buffer.get());
+        storage.values = buffer.get();
+        //The other copies still hold the old values
+        storage.owner = buffer;
+    }
+
+    T *cell(unsigned row, unsigned col) {
+        return this->storage->values + this->offset + row * this->rowStride + col * this->colStride;
+    }
+
+    const T *cell(unsigned row, unsigned col) const {
+        return this->storage->values + this->offset + row * this->rowStride + col * this->colStride;
+    }
+
     T doGet(unsigned row, unsigned col) const {
-        return (*this->vector.get())[row * this->columns() + col];
+        return *this->cell(row, col);
     }
 };
 
@@ -164,6 +525,13 @@ public:
     SingleMatrixWrapper(MD wrapped, unsigned rows, unsigned columns) : MatrixData<T>(rows, columns), wrapped(wrapped) {
     }
 
+    /**
+     * @return the wrapped matrix
+     */
+    const MD &getWrapped() const {
+        return this->wrapped;
+    }
+
     std::vector<const MatrixData<T> *> virtualGetChildren() const override {
         return {&this->wrapped};
     }
@@ -184,6 +552,14 @@ public:
     BiMatrixWrapper(MD1 left, MD2 right, unsigned rows, unsigned columns) : MatrixData<T>(rows, columns), left(left), right(right) {
     }
 
+    const MD1 &getLeft() const {
+        return this->left;
+    }
+
+    const MD2 &getRight() const {
+        return this->right;
+    }
+
     std::vector<const MatrixData<T> *> virtualGetChildren() const override {
         const MatrixData<T> *left = &this->left;
         const MatrixData<T> *right = &this->right;
@@ -213,6 +589,13 @@ public:
     MultiMatrixWrapper(std::deque<MD> wrapped, unsigned rows, unsigned columns) : MatrixData<T>(rows, columns), wrapped(wrapped) {
     }
 
+    /**
+     * @return the wrapped matrices
+     */
+    const std::deque<MD> &getWrapped() const {
+        return this->wrapped;
+    }
+
     std::vector<const MatrixData<T> *> virtualGetChildren() const override {
         std::vector<const MatrixData<T> *> pointers;
         for (auto it = this->wrapped.begin(); it < wrapped.end(); it++) {
@@ -242,12 +625,44 @@ public:
         }
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        this->wrapped.virtualMaterializeInto(destination, destinationStride,
+                                             rowOffset + this->rowOffset, colOffset + this->colOffset, rows, columns);
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        this->wrapped.virtualAccumulateInto(destination, destinationStride,
+                                            rowOffset + this->rowOffset, colOffset + this->colOffset, rows, columns);
+    }
 
     void set(unsigned row, unsigned col, T t) {
         this->wrapped.set(row + this->rowOffset, col + this->colOffset, t);
     }
 
+    /**
+     * @return the row of the wrapped matrix where this submatrix starts
+     */
+    unsigned getRowOffset() const {
+        return this->rowOffset;
+    }
+
+    /**
+     * @return the column of the wrapped matrix where this submatrix starts
+     */
+    unsigned getColOffset() const {
+        return this->colOffset;
+    }
+
+    std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const override {
+        auto view = this->wrapped.virtualGetStridedView();
+        return view == nullptr ? nullptr : std::make_unique<VectorMatrixData<T>>(
+                view->submatrixView(this->rowOffset, this->colOffset, this->rows(), this->columns()));
+    }
+
     SubmatrixMD<T, MD> copy() const {
         return SubmatrixMD<T, MD>(this->rowOffset, this->colOffset, this->rows(), this->columns(), this->wrapped.copy());
     }
@@ -267,15 +682,44 @@ class TransposedMD : public SingleMatrixWrapper<T, MD> {
 
 public:
 
+    //Number of rows materialized at a time, when the wrapped matrix does not expose its values
+    static const unsigned STRIP = 64;
+
     explicit TransposedMD(MD wrapped) : SingleMatrixWrapper<T, MD>(wrapped, wrapped.columns(), wrapped.rows()) {
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        auto view = this->virtualGetStridedView();
+        if (view != nullptr) {
+            view->virtualMaterializeInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+            return;
+        }
+        //Only a strip of the source is materialized at a time, so that it stays in cache while it is transposed
+        for (unsigned r = 0; r < rows; r += STRIP) {
+            unsigned stripRows = rows - r < STRIP ? rows - r : STRIP;
+            const VectorMatrixData<T> source = this->wrapped.virtualMaterialize(colOffset, rowOffset + r, columns, stripRows);
+            Transpose<T>::transpose(source.rawData(), stripRows, destination + (size_t) r * destinationStride,
+                                    destinationStride, columns, stripRows);
+        }
+    }
 
     void set(unsigned row, unsigned col, T t) {
         this->wrapped.set(col, row, t);
     }
 
+    std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const override {
+        auto view = this->wrapped.virtualGetStridedView();
+        return view == nullptr ? nullptr : std::make_unique<VectorMatrixData<T>>(view->transposedView());
+    }
+
+    //A diagonal matrix is its own transpose
+    const MatrixData<T> *virtualGetDiagonalVector() const override {
+        return this->wrapped.virtualGetDiagonalVector();
+    }
+
     TransposedMD<T, MD> copy() const {
         return TransposedMD<T, MD>(this->wrapped.copy());
     }
@@ -332,12 +776,34 @@ public:
         }
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        for (unsigned r = 0; r < rows; r++) {
+            std::fill_n(destination + (size_t) r * destinationStride, columns, T(0));
+        }
+        //The part of the diagonal inside the region
+        unsigned first = std::max(rowOffset, colOffset);
+        unsigned last = std::min(rowOffset + rows, colOffset + columns);
+        if (first >= last) {
+            return;
+        }
+        const VectorMatrixData<T> diagonal = this->wrapped.virtualMaterialize(first, 0, last - first, 1);
+        T *start = destination + (size_t) (first - rowOffset) * destinationStride + (first - colOffset);
+        for (unsigned i = 0; i < last - first; i++) {
+            start[(size_t) i * (destinationStride + 1)] = diagonal.rawData()[i];
+        }
+    }
 
     DiagonalMatrixMD<T, MD> copy() const {
         return DiagonalMatrixMD<T, MD>(this->wrapped.copy());
     }
 
+    const MatrixData<T> *virtualGetDiagonalVector() const override {
+        return &this->wrapped;
+    }
+
 private:
     T doGet(unsigned row, unsigned col) const {
         if (row == col) {
@@ -363,12 +829,30 @@ private:
  */
 template<typename T, class MD>
 class ConcatenationMD : public MultiMatrixWrapper<T, MD> {
+private:
+    /**
+     * Whether the values of all the blocks are in buffer. It does not own the buffer, since it is kept by the
+     * callbacks of the blocks, which may be destroyed by the pool after this matrix.
+     */
+    struct CompactState {
+        std::mutex mutex;
+        bool hasBuffer = false;
+        std::atomic<bool> compacted{false};
+    };
+
+    unsigned blockRows, blockCols, numberOfColumnBlocks;
+    //The buffer where the blocks write their values, if any
+    std::shared_ptr<VectorMatrixData<T>> blocksBuffer;
+    //The values of all the blocks in a single row-major buffer, readable once compacted is set
+    mutable std::shared_ptr<VectorMatrixData<T>> buffer;
+    std::shared_ptr<CompactState> state = std::make_shared<CompactState>();
+
 public:
     explicit ConcatenationMD(std::deque<MD> blocks, unsigned rows, unsigned columns) :
             MultiMatrixWrapper<T, MD>(blocks, rows, columns) {
         //Checking that all the blocks have the same size
-        unsigned blockRows = this->getRowsOfBlocks();
-        unsigned blockCols = this->getColumnsOfBlocks();
+        this->blockRows = blocks[0].rows();
+        this->blockCols = blocks[0].columns();
         for (auto &block: blocks) {
             if (block.rows() != blockRows || block.columns() != blockCols) {
                 Utils::error("All the matrices must be of the same size!");
@@ -383,43 +867,204 @@ public:
         } else if ((rows / blockRows) * (columns / blockCols) != blocks.size()) {
             Utils::error("The number of blocks (" + std::to_string(blocks.size()) + ") is not enough to cover the whole matrix");
         }
+        this->numberOfColumnBlocks = columns / blockCols;
+    }
+
+    /**
+     * Concatenation of blocks that store their values in the given row-major buffer of rows x columns values, each
+     * one in its position (e.g. views of it): once the blocks have been optimized, the buffer is read directly.
+     */
+    ConcatenationMD(std::deque<MD> blocks, unsigned rows, unsigned columns, std::shared_ptr<VectorMatrixData<T>> buffer) :
+            ConcatenationMD(blocks, rows, columns) {
+        if (buffer->rows() != rows || buffer->columns() != columns || buffer->getLayout() != MatrixLayout::ROW_MAJOR) {
+            Utils::error("The buffer must be a row-major matrix of the same size");
+        }
+        this->blocksBuffer = buffer;
+        this->buffer = buffer;
+        this->state->hasBuffer = true;
+    }
+
+    //The blocks of the copy are optimized on their own
+    ConcatenationMD(const ConcatenationMD<T, MD> &another) :
+            MultiMatrixWrapper<T, MD>(another.wrapped, another.rows(), another.columns()),
+            blockRows(another.blockRows), blockCols(another.blockCols), numberOfColumnBlocks(another.numberOfColumnBlocks),
+            blocksBuffer(another.blocksBuffer), buffer(another.blocksBuffer) {
+        this->state->hasBuffer = this->blocksBuffer != nullptr;
     }
 
     /**
      * @return the number of vertical blocks
      */
-    unsigned getNumberOfColumnBlocks() const { return this->columns() / this->getColumnsOfBlocks(); }
+    unsigned getNumberOfColumnBlocks() const { return this->numberOfColumnBlocks; }
 
     /**
      * @return the number of horizontal blocks
      */
-    unsigned getNumberOfRowBlocks() const { return this->rows() / this->getRowsOfBlocks(); }
+    unsigned getNumberOfRowBlocks() const { return this->rows() / this->blockRows; }
 
     /**
      * @return the number of rows of each block
      */
-    unsigned getRowsOfBlocks() const { return this->wrapped[0].rows(); }
+    unsigned getRowsOfBlocks() const { return this->blockRows; }
 
     /**
      * @return the number of columns of each block
      */
-    unsigned getColumnsOfBlocks() const { return this->wrapped[0].columns(); }
+    unsigned getColumnsOfBlocks() const { return this->blockCols; }
 
-    MATERIALIZE_IMPL
+    /**
+     * Copies the values of all the blocks in a single buffer, waiting for them to be optimized: afterwards, this
+     * matrix is read from that buffer, without looking for the block of each cell.
+     * The blocks are kept, since they may be shared by other matrices.
+     */
+    void compact() const {
+        this->virtualWaitOptimized();
+        std::unique_lock<std::mutex> lock(this->state->mutex);
+        if (this->state->compacted) {
+            return;
+        }
+        auto buffer = std::make_shared<VectorMatrixData<T>>(this->rows(), this->columns());
+        this->materializeInParallel(buffer->rawData(), this->columns(), 0, 0, this->rows(), this->columns());
+        this->buffer = buffer;
+        this->state->hasBuffer = true;
+        this->state->compacted = true;
+    }
 
-    DiagonalMatrixMD<T, MD> copy() const {
-        return ConcatenationMD<T, MD>(this->copyWrapped());
+    /**
+     * @return true if the values are read from a single buffer (see <code>compact()</code>)
+     */
+    bool isCompacted() const {
+        return this->state->compacted;
+    }
+
+    /**
+     * Calls f(row, col, block) for each block, in row-major order, where (row, col) is the position of its first
+     * cell and block a <code>VectorMatrixData</code> sharing its values (or a copy of them, if the block does not
+     * store them in a buffer). Waits for the blocks to be optimized.
+     */
+    template<class F>
+    void forEachBlockView(F f) const {
+        this->virtualWaitOptimized();
+        for (unsigned blockRow = 0, i = 0; blockRow < this->getNumberOfRowBlocks(); blockRow++) {
+            for (unsigned blockCol = 0; blockCol < this->numberOfColumnBlocks; blockCol++, i++) {
+                unsigned row = blockRow * this->blockRows;
+                unsigned col = blockCol * this->blockCols;
+                if (this->state->compacted) {
+                    f(row, col, this->buffer->submatrixView(row, col, this->blockRows, this->blockCols));
+                    continue;
+                }
+                auto view = this->wrapped[i].virtualGetOptimized()->virtualGetStridedView();
+                if (view != nullptr) {
+                    f(row, col, *view);
+                } else {
+                    f(row, col, this->wrapped[i].virtualMaterialize(0, 0, this->blockRows, this->blockCols));
+                }
+            }
+        }
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        if (this->state->compacted) {
+            this->buffer->virtualMaterializeInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+            return;
+        }
+        this->forEachBlock(rowOffset, colOffset, rows, columns,
+                           [&](const MD &block, unsigned destinationRow, unsigned destinationCol,
+                               unsigned blockRow, unsigned blockCol, unsigned blockRows, unsigned blockCols) {
+                               block.virtualMaterializeInto(destination + (size_t) destinationRow * destinationStride + destinationCol,
+                                                            destinationStride, blockRow, blockCol, blockRows, blockCols);
+                           });
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        if (this->state->compacted) {
+            this->buffer->virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+            return;
+        }
+        this->forEachBlock(rowOffset, colOffset, rows, columns,
+                           [&](const MD &block, unsigned destinationRow, unsigned destinationCol,
+                               unsigned blockRow, unsigned blockCol, unsigned blockRows, unsigned blockCols) {
+                               block.virtualAccumulateInto(destination + (size_t) destinationRow * destinationStride + destinationCol,
+                                                           destinationStride, blockRow, blockCol, blockRows, blockCols);
+                           });
+    }
+
+    std::unique_ptr<VectorMatrixData<T>> virtualGetStridedView() const override {
+        if (this->state->compacted) {
+            return std::make_unique<VectorMatrixData<T>>(*this->buffer);
+        }
+        return nullptr;
+    }
+
+    void virtualWaitOptimized() const override {
+        MultiMatrixWrapper<T, MD>::virtualWaitOptimized();
+        this->blocksOptimized();
+    }
+
+    void virtualWhenOptimized(std::function<void()> callback) const override {
+        std::shared_ptr<CompactState> state = this->state;
+        MatrixData<T>::whenAllOptimized(this->virtualGetChildren(), [state, callback] {
+            blocksOptimized(*state);
+            callback();
+        });
+    }
+
+    ConcatenationMD<T, MD> copy() const {
+        return ConcatenationMD<T, MD>(this->copyWrapped(), this->rows(), this->columns());
     }
 
 private:
 
+    void blocksOptimized() const {
+        blocksOptimized(*this->state);
+    }
+
+    /**
+     * Once the blocks have written their values in the buffer given to the constructor, it can be read directly
+     */
+    static void blocksOptimized(CompactState &state) {
+        std::unique_lock<std::mutex> lock(state.mutex);
+        if (state.hasBuffer) {
+            state.compacted = true;
+        }
+    }
+
+    /**
+     * Calls f(block, destinationRow, destinationCol, blockRow, blockCol, rows, columns) for each block intersecting
+     * the given region, where the first two coordinates are relative to the region and the next two to the block
+     */
+    template<class F>
+    void forEachBlock(unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns, F f) const {
+        if (rows == 0 || columns == 0) {
+            return;
+        }
+        unsigned blockRows = this->blockRows;
+        unsigned blockCols = this->blockCols;
+        for (unsigned blockRow = rowOffset / blockRows; blockRow * blockRows < rowOffset + rows; blockRow++) {
+            unsigned rowStart = std::max(rowOffset, blockRow * blockRows);
+            unsigned rowEnd = std::min(rowOffset + rows, (blockRow + 1) * blockRows);
+            for (unsigned blockCol = colOffset / blockCols; blockCol * blockCols < colOffset + columns; blockCol++) {
+                unsigned colStart = std::max(colOffset, blockCol * blockCols);
+                unsigned colEnd = std::min(colOffset + columns, (blockCol + 1) * blockCols);
+                f(this->wrapped[blockRow * this->numberOfColumnBlocks + blockCol], rowStart - rowOffset, colStart - colOffset,
+                  rowStart - blockRow * blockRows, colStart - blockCol * blockCols, rowEnd - rowStart, colEnd - colStart);
+            }
+        }
+    }
+
     T doGet(unsigned row, unsigned col) const {
-        unsigned blockRows = this->getRowsOfBlocks();
-        unsigned blockCols = this->getColumnsOfBlocks();
-        unsigned blockRowIndex = row / blockRows;
-        unsigned blockColIndex = col / blockCols;
-        unsigned blockIndex = blockRowIndex * this->getNumberOfColumnBlocks() + blockColIndex;
-        return this->wrapped[blockIndex].get(row % blockRows, col % blockCols);
+        if (this->state->compacted) {
+            //Through a const reference: the non-const rawData() is the copy-on-write path, for writing
+            return static_cast<const VectorMatrixData<T> &>(*this->buffer).rawData()[(size_t) row * this->columns() + col];
+        }
+        unsigned blockRowIndex = row / this->blockRows;
+        unsigned blockColIndex = col / this->blockCols;
+        return this->wrapped[blockRowIndex * this->numberOfColumnBlocks + blockColIndex].get(row - blockRowIndex * this->blockRows,
+                                                                                            col - blockColIndex * this->blockCols);
     }
 
 };
@@ -434,7 +1079,21 @@ public:
     ResizerMD(MD wrapped, unsigned rows, unsigned columns) : SingleMatrixWrapper<T, MD>(wrapped, rows, columns) {
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        //The region is split in the part covered by the wrapped matrix, and the zeros around it
+        unsigned innerRows = std::min(rowOffset + rows, std::max(rowOffset, this->wrapped.rows())) - rowOffset;
+        unsigned innerCols = std::min(colOffset + columns, std::max(colOffset, this->wrapped.columns())) - colOffset;
+        if (innerRows > 0 && innerCols > 0) {
+            this->wrapped.virtualMaterializeInto(destination, destinationStride, rowOffset, colOffset, innerRows, innerCols);
+        }
+        for (unsigned r = 0; r < rows; r++) {
+            unsigned zeroFrom = r < innerRows ? innerCols : 0;
+            std::fill_n(destination + (size_t) r * destinationStride + zeroFrom, columns - zeroFrom, T(0));
+        }
+    }
 
     ResizerMD<T, MD> copy() const {
         return ResizerMD<T, MD>(this->wrapped.copy(), this->rows(), this->columns());
@@ -465,12 +1124,32 @@ public:
         this->wrapped.virtualWaitOptimized();
     }
 
-    MATERIALIZE_IMPL
+    void virtualWhenOptimized(std::function<void()> callback) const override {
+        this->wrapped.virtualWhenOptimized(callback);
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        const auto source = this->wrapped.virtualMaterialize(rowOffset, colOffset, rows, columns);
+        for (unsigned r = 0; r < rows; r++) {
+            auto *sourceRow = source.rawData() + (size_t) r * columns;
+            T *destinationRow = destination + (size_t) r * destinationStride;
+            for (unsigned c = 0; c < columns; c++) {
+                destinationRow[c] = (T) sourceRow[c];
+            }
+        }
+    }
 
     MatrixCaster<T, MD> copy() const {
         return MatrixCaster<T, MD>(this->wrapped);
     }
 
+    const MD &getWrapped() const {
+        return this->wrapped;
+    }
+
 public:
 
     void optimize() const override {
@@ -13,15 +13,32 @@
 #include <thread>
 #include "MatrixUtils.h"
 #include "Sum.h"
-
-//Using long, blocks of 128k will be 128x128
-unsigned OPTIMAL_BLOCK_SIZE = 128 * 1024;
+#include "Gemm.h"
+#include "Autotuner.h"
+#include "SparseMatrixData.h"
 
 template<typename T>
 class OptimizedMultiplyMD;
 
+/**
+ * Order in which a chain of multiplications is performed
+ */
+struct MultiplicationPlan {
+    std::string order; //e.g. ((M0 x M1) x M2)
+    double estimatedFlops;
+};
+
 template<typename T>
-class BaseMultiplyMD;
+class BlockReductionMD;
+
+/**
+ * Structure of an operand of a multiplication, used to choose how it is performed
+ */
+enum class MatrixStructure {
+    DENSE,
+    SPARSE,
+    DIAGONAL
+};
 
 /**
  * Implementation of <code>MatrixData</code> that exposes the multiplication of the two given matrices
@@ -32,28 +49,44 @@ class MultiplyMD : public OptimizableMD<T, OptimizedMultiplyMD<T>> {
 
 private:
     /**
-     * Needed to keep the pointers!
-     * Using a deque, since it allows members without copy/move constructors
+     * The matrices referred by the optimized matrix: shared by the copies of this object, and kept alive as long as it
      */
-    mutable std::deque<OptimizedMultiplyMD<T>> nodeReferences;
-    MD1 left;
-    MD2 right;
+    struct Operands {
+        MD1 left;
+        MD2 right;
+        /**
+         * Needed to keep the pointers!
+         * Using a deque, since it allows members without copy/move constructors
+         */
+        std::deque<OptimizedMultiplyMD<T>> nodeReferences;
+
+        Operands(MD1 left, MD2 right) : left(left), right(right) {}
+    };
+
+    std::shared_ptr<Operands> operands;
+    //Memory reserved by the products of the chain, see MemoryBudget
+    std::shared_ptr<MemoryUsage> usage = std::make_shared<MemoryUsage>();
 
     template<typename U, class MD3, class MD4> friend
     class MultiplyMD;
 
 public:
 
-    MultiplyMD(MD1 left, MD2 right) : OptimizableMD<T, OptimizedMultiplyMD<T>>(left.rows(), right.columns()), left(left), right(right) {
+    MultiplyMD(MD1 left, MD2 right) : OptimizableMD<T, OptimizedMultiplyMD<T>>(left.rows(), right.columns()),
+                                      operands(std::make_shared<Operands>(left, right)) {
         if (left.columns() != right.rows()) {
             Utils::error("Multiplication should be performed on compatible matrices");
         }
+        this->keepWithOptimized(this->operands);
     }
 
-    MultiplyMD(const MultiplyMD<T, MD1, MD2> &another) : OptimizableMD<T, OptimizedMultiplyMD<T>>(another), left(another.left), right(another.right) {
+    //The copies share the operands and the optimized matrix, so a product is never computed twice
+    MultiplyMD(const MultiplyMD<T, MD1, MD2> &another) : OptimizableMD<T, OptimizedMultiplyMD<T>>(another),
+                                                         operands(another.operands), usage(another.usage) {
     }
 
-    MultiplyMD(MultiplyMD<T, MD1, MD2> &&another) noexcept : OptimizableMD<T, OptimizedMultiplyMD<T>>(another), left(another.left), right(another.right) {
+    MultiplyMD(MultiplyMD<T, MD1, MD2> &&another) noexcept : OptimizableMD<T, OptimizedMultiplyMD<T>>(std::move(another)),
+                                                             operands(another.operands), usage(another.usage) {
     }
 
     virtual ~MultiplyMD() {
@@ -62,11 +95,24 @@ public:
     }
 
     std::vector<const MatrixData<T> *> virtualGetChildren() const override {
-        return {&this->left, &this->right};
+        return {&this->operands->left, &this->operands->right};
     }
 
+    /**
+     * Once the product has been started it is shared, since it has already read the values of the operands
+     */
     MultiplyMD<T, MD1, MD2> copy() const {
-        return MultiplyMD<T, MD1, MD2>(this->left.copy(), this->right.copy());
+        if (this->isOptimizationStarted()) {
+            return *this;
+        }
+        return MultiplyMD<T, MD1, MD2>(this->operands->left.copy(), this->operands->right.copy());
+    }
+
+    /**
+     * @return the memory reserved by the products while evaluating this chain, and its peak
+     */
+    std::shared_ptr<const MemoryUsage> getMemoryUsage() const {
+        return this->usage;
     }
 
 protected:
@@ -75,60 +121,297 @@ protected:
      * Adds it child to the multiplication chain
      */
     void addToMultiplicationChain(std::vector<const MatrixData<T> *> &multiplicationChain) const {
-        this->left.addToMultiplicationChain(multiplicationChain);
-        this->right.addToMultiplicationChain(multiplicationChain);
+        this->operands->left.addToMultiplicationChain(multiplicationChain);
+        this->operands->right.addToMultiplicationChain(multiplicationChain);
     }
 
     /**
-     * This method optimizes the multiplication tree, by doing first the multiplication that reduces the most
-     * the number of dimensions
+     * This method optimizes the multiplication tree, by performing the multiplications in the order
+     * that minimizes the estimated number of operations
      */
     std::unique_ptr<OptimizedMultiplyMD<T>> virtualCreateOptimizedMatrix() const override {
         //Step 1: getting the chain of multiplications to perform
         std::vector<const MatrixData<T> *> multiplicationChain;
         addToMultiplicationChain(multiplicationChain);
-        //Step 3: execute the multiplications in an efficient order, until a single matrix is left
-        while (multiplicationChain.size() > 1) {
-            //Step 3a: find the multiplication that reduces the multiplication the most
-            unsigned bestIndex = 0;
-            for (unsigned i = 0; i < multiplicationChain.size() - 1; i++) {
-                if (multiplicationChain[i]->columns() > multiplicationChain[bestIndex]->columns()) {
-                    bestIndex = i;
+        //Step 2: finding the optimal parenthesization
+        std::vector<std::vector<unsigned>> split;
+        solveChainOrder(multiplicationChain, split);
+        //Step 3: creating the multiplications in that order.
+        //The result is a OptimizedMultiplyMD, since the chain has at least two matrices.
+        auto *optimized = static_cast<const OptimizedMultiplyMD<T> *>(
+                createMultiplications(multiplicationChain, split, 0, multiplicationChain.size() - 1));
+        return std::make_unique<OptimizedMultiplyMD<T>>(*optimized);
+    }
+
+private:
+
+    /**
+     * Classic dynamic programming solution of the matrix chain ordering problem.
+     * The cost of each multiplication is the one estimated by <code>OptimizedMultiplyMD</code>, which takes into
+     * account the padding of the blocks, or the number of values visited when an operand is sparse or diagonal.
+     * The product of two sparse matrices is sparse, and its number of non-zeros is estimated assuming they are
+     * uniformly distributed; multiplying by a diagonal matrix keeps the structure of the other operand.
+     * @param split will contain, for each sub-chain i..j, the index k such that (i..k) x (k+1..j) is optimal
+     * @return the estimated number of floating point operations of the whole chain
+     */
+    static double solveChainOrder(const std::vector<const MatrixData<T> *> &chain, std::vector<std::vector<unsigned>> &split) {
+        unsigned n = chain.size();
+        std::vector<std::vector<double>> cost(n, std::vector<double>(n, 0));
+        std::vector<std::vector<double>> nonZeros(n, std::vector<double>(n, 0));
+        std::vector<std::vector<MatrixStructure>> structure(n, std::vector<MatrixStructure>(n, MatrixStructure::DENSE));
+        split.assign(n, std::vector<unsigned>(n, 0));
+        for (unsigned i = 0; i < n; i++) {
+            if (chain[i]->virtualGetDiagonalVector() != nullptr) {
+                structure[i][i] = MatrixStructure::DIAGONAL;
+                nonZeros[i][i] = chain[i]->rows();
+            } else {
+                structure[i][i] = SparseMultiplication<T>::isSparse(chain[i]) ? MatrixStructure::SPARSE : MatrixStructure::DENSE;
+                nonZeros[i][i] = SparseMultiplication<T>::nonZeros(chain[i]);
+            }
+        }
+        for (unsigned length = 2; length <= n; length++) {
+            for (unsigned i = 0; i + length <= n; i++) {
+                unsigned j = i + length - 1;
+                cost[i][j] = -1;
+                for (unsigned k = i; k < j; k++) {
+                    double c = cost[i][k] + cost[k + 1][j] +
+                               estimateFlops(chain[i]->rows(), chain[k]->columns(), chain[j]->columns(),
+                                             structure[i][k], nonZeros[i][k], structure[k + 1][j], nonZeros[k + 1][j]);
+                    if (cost[i][j] < 0 || c < cost[i][j]) {
+                        cost[i][j] = c;
+                        split[i][j] = k;
+                    }
+                }
+                unsigned k = split[i][j];
+                double cells = (double) chain[i]->rows() * chain[j]->columns();
+                if (structure[i][k] == MatrixStructure::DIAGONAL) {
+                    structure[i][j] = structure[k + 1][j];
+                    nonZeros[i][j] = nonZeros[k + 1][j];
+                } else if (structure[k + 1][j] == MatrixStructure::DIAGONAL) {
+                    structure[i][j] = structure[i][k];
+                    nonZeros[i][j] = nonZeros[i][k];
+                } else if (structure[i][k] == MatrixStructure::SPARSE && structure[k + 1][j] == MatrixStructure::SPARSE) {
+                    structure[i][j] = MatrixStructure::SPARSE;
+                    nonZeros[i][j] = std::min(cells, nonZeros[i][k] * nonZeros[k + 1][j] / chain[k]->columns());
+                } else {
+                    structure[i][j] = MatrixStructure::DENSE;
+                    nonZeros[i][j] = cells;
                 }
             }
-            const MatrixData<T> *leftMatrix = multiplicationChain[bestIndex];
-            const MatrixData<T> *rightMatrix = multiplicationChain[bestIndex + 1];
+        }
+        return cost[0][n - 1];
+    }
 
-            //Step 3b: replacing the two matrices in the chain with the computed product
-            //Creating the multiplication inside nodeReferences
-            nodeReferences.emplace_back(leftMatrix, rightMatrix);
-            //Replacing the two matrices with the multiplication
-            multiplicationChain.erase(multiplicationChain.begin() + bestIndex + 1);
-            multiplicationChain[bestIndex] = &nodeReferences.back();
+    static double estimateFlops(unsigned rows, unsigned inner, unsigned columns,
+                                MatrixStructure left, double leftNonZeros, MatrixStructure right, double rightNonZeros) {
+        if (left == MatrixStructure::DIAGONAL) {
+            //Each value of the other operand is scaled
+            return rightNonZeros;
+        } else if (right == MatrixStructure::DIAGONAL) {
+            return leftNonZeros;
+        } else if (left == MatrixStructure::SPARSE && right == MatrixStructure::SPARSE) {
+            //Each non-zero of the left matrix meets the non-zeros of a row of the right one
+            return 2.0 * leftNonZeros * rightNonZeros / std::max(1u, inner);
+        } else if (left == MatrixStructure::SPARSE) {
+            return 2.0 * leftNonZeros * columns;
+        } else if (right == MatrixStructure::SPARSE) {
+            return 2.0 * rightNonZeros * rows;
         }
+        return OptimizedMultiplyMD<T>::estimateFlops(rows, inner, columns);
+    }
 
-        //Step 4: the last item in the chain is the multiplication result.
-        // It is a OptimizedMultiplyMD, since it comes from nodeReferences.
-        auto *optimized = static_cast<const OptimizedMultiplyMD<T> *>(multiplicationChain[0]);
-        return std::make_unique<OptimizedMultiplyMD<T>>(*optimized);
+    /**
+     * Creates inside nodeReferences the multiplications of the sub-chain i..j
+     * @return the matrix holding the product of the sub-chain
+     */
+    const MatrixData<T> *createMultiplications(const std::vector<const MatrixData<T> *> &chain,
+                                               const std::vector<std::vector<unsigned>> &split, unsigned i, unsigned j) const {
+        if (i == j) {
+            return chain[i];
+        }
+        const MatrixData<T> *leftMatrix = createMultiplications(chain, split, i, split[i][j]);
+        const MatrixData<T> *rightMatrix = createMultiplications(chain, split, split[i][j] + 1, j);
+        this->operands->nodeReferences.emplace_back(leftMatrix, rightMatrix, this->usage);
+        return &this->operands->nodeReferences.back();
+    }
+
+    static std::string describeOrder(const std::vector<std::vector<unsigned>> &split, unsigned i, unsigned j) {
+        if (i == j) {
+            return "M" + std::to_string(i);
+        }
+        return "(" + describeOrder(split, i, split[i][j]) + " x " + describeOrder(split, split[i][j] + 1, j) + ")";
+    }
+
+public:
+
+    /**
+     * Computes the order that will be used to perform the multiplication, without performing it.
+     * The matrices of the chain are named M0, M1... from left to right.
+     */
+    MultiplicationPlan plan() const {
+        std::vector<const MatrixData<T> *> multiplicationChain;
+        addToMultiplicationChain(multiplicationChain);
+        std::vector<std::vector<unsigned>> split;
+        double flops = solveChainOrder(multiplicationChain, split);
+        return {describeOrder(split, 0, multiplicationChain.size() - 1), flops};
+    }
+};
+
+/**
+ * Multiplications where at least one of the operands is a diagonal matrix (see
+ * <code>MatrixData::virtualGetDiagonalVector()</code>): they are performed by scaling the rows or the columns of the
+ * other operand, without ever materializing the diagonal matrix. Sparse operands stay sparse, and the product of
+ * two diagonal matrices is still diagonal.
+ * @tparam T type of the data
+ */
+template<typename T>
+class DiagonalMultiplication {
+public:
+
+    /**
+     * @param rows, columns size of the product: only that part of the operands is read, since they can be larger
+     * (e.g. the result of a block product, padded to its grid)
+     * @return the product, or nullptr if neither of the operands is diagonal
+     */
+    static std::unique_ptr<MatrixData<T>> multiply(const MatrixData<T> *left, const MatrixData<T> *right,
+                                                   unsigned rows, unsigned columns) {
+        const MatrixData<T> *leftDiagonal = left->virtualGetDiagonalVector();
+        const MatrixData<T> *rightDiagonal = right->virtualGetDiagonalVector();
+        if (leftDiagonal == nullptr && rightDiagonal == nullptr) {
+            return nullptr;
+        }
+        if (leftDiagonal != nullptr && rightDiagonal != nullptr) {
+            VectorMatrixData<T> product = leftDiagonal->virtualMaterialize(0, 0, rows, 1);
+            const VectorMatrixData<T> other = rightDiagonal->virtualMaterialize(0, 0, rows, 1);
+            for (unsigned i = 0; i < product.rows(); i++) {
+                product.rawData()[i] *= other.rawData()[i];
+            }
+            return std::make_unique<DiagonalMatrixMD<T, VectorMatrixData<T>>>(product);
+        }
+        bool scaleRows = leftDiagonal != nullptr;
+        const MatrixData<T> *other = scaleRows ? right : left;
+        const VectorMatrixData<T> diagonal = (scaleRows ? leftDiagonal : rightDiagonal)->virtualMaterialize(0, 0, scaleRows ? rows : columns, 1);
+        const T *d = diagonal.rawData();
+
+        if (auto csr = dynamic_cast<const CsrMatrixData<T> *>(other)) {
+            return std::make_unique<CsrMatrixData<T>>(scaleCompressed(*csr, d, scaleRows));
+        } else if (auto csc = dynamic_cast<const CscMatrixData<T> *>(other)) {
+            return std::make_unique<CscMatrixData<T>>(scaleCompressed(*csc, d, !scaleRows));
+        }
+        //The materialized copy of the other operand becomes the result
+        auto ret = std::make_unique<VectorMatrixData<T>>(other->virtualMaterialize(0, 0, rows, columns));
+        T *values = ret->rawData();
+        for (unsigned r = 0; r < rows; r++) {
+            T *row = values + (size_t) r * columns;
+            if (scaleRows) {
+                T factor = d[r];
+                for (unsigned c = 0; c < columns; c++) {
+                    row[c] *= factor;
+                }
+            } else {
+                for (unsigned c = 0; c < columns; c++) {
+                    row[c] *= d[c];
+                }
+            }
+        }
+        return ret;
+    }
+
+private:
+
+    /**
+     * Multiplies each stored value by the factor of its outer line (scaleOuter) or of its inner index
+     */
+    template<bool BY_ROWS>
+    static CompressedMatrixData<T, BY_ROWS> scaleCompressed(const CompressedMatrixData<T, BY_ROWS> &matrix, const T *factors, bool scaleOuter) {
+        const std::vector<unsigned> &pointers = matrix.getPointers();
+        const std::vector<unsigned> &indices = matrix.getIndices();
+        std::vector<T> values = matrix.getValues();
+        for (unsigned i = 0; i < matrix.outerSize(); i++) {
+            for (unsigned p = pointers[i]; p < pointers[i + 1]; p++) {
+                values[p] *= factors[scaleOuter ? i : indices[p]];
+            }
+        }
+        return CompressedMatrixData<T, BY_ROWS>(matrix.rows(), matrix.columns(), pointers, indices, std::move(values));
+    }
+};
+
+/**
+ * Products of a matrix by a column vector (A * x) or of a row vector by a matrix (x * A), computed by
+ * <code>Gemv</code> instead of dividing the operands in blocks: the vector would be padded to the width of a block,
+ * while this way the matrix is read once, in place, and the rows of the result are split among the threads of the pool.
+ * @tparam T type of the data
+ */
+template<typename T>
+class VectorMultiplication {
+public:
+
+    /**
+     * @return true if a product with the given result is computed by this class
+     */
+    static bool isVectorProduct(unsigned rows, unsigned columns) {
+        return rows == 1 || columns == 1;
+    }
+
+    /**
+     * @return the product, or nullptr if the result is not a vector
+     */
+    static std::unique_ptr<MatrixData<T>> multiply(const MatrixData<T> *left, const MatrixData<T> *right) {
+        if (right->columns() == 1) {
+            return std::make_unique<VectorMatrixData<T>>(multiplyByVector(left, right, false));
+        } else if (left->rows() == 1) {
+            //x * A is the transposed of A^T * x
+            return std::make_unique<VectorMatrixData<T>>(multiplyByVector(right, left, true).transposedView());
+        }
+        return nullptr;
+    }
+
+private:
+
+    /**
+     * @return the column vector matrix * vector, or matrix^T * vector if transposed
+     */
+    static VectorMatrixData<T> multiplyByVector(const MatrixData<T> *matrix, const MatrixData<T> *vector, bool transposed) {
+        //Values already in a buffer are read in place, with any layout
+        std::unique_ptr<VectorMatrixData<T>> view = matrix->virtualGetStridedView();
+        if (view == nullptr) {
+            view = std::make_unique<VectorMatrixData<T>>(matrix->virtualMaterialize(0, 0, matrix->rows(), matrix->columns()));
+        }
+        const VectorMatrixData<T> a = transposed ? view->transposedView() : *view;
+        //A vector is contiguous, whether it is a row or a column
+        const VectorMatrixData<T> x = vector->virtualMaterialize(0, 0, vector->rows(), vector->columns());
+        VectorMatrixData<T> ret(a.rows(), 1);
+        const T *values = a.rawData();
+        size_t rowStride = a.getRowStride(), colStride = a.getColStride();
+        const T *xValues = x.rawData();
+        T *y = ret.rawData();
+        ThreadPool::shared().parallelFor(0, a.rows(), a.columns(), [&](unsigned first, unsigned last) {
+            Gemv<T>::multiply(last - first, a.columns(), values + first * rowStride, rowStride, colStride, xValues, y + first);
+        });
+        return ret;
     }
 };
 
 /**
  * This class is used only internally on MultiplyMD, to keep the optimal operation tree.
+ * Dense operands are multiplied by blocks, and the result is a <code>ConcatenationMD</code> of the blocks; when an
+ * operand is diagonal or sparse the result is computed by <code>DiagonalMultiplication</code> or
+ * <code>SparseMultiplication</code>, and when the result is a vector by <code>VectorMultiplication</code>.
  */
 template<typename T>
-class OptimizedMultiplyMD : public OptimizableMD<T, ConcatenationMD<T, MultiSum<T, BaseMultiplyMD<T>>>> {
+class OptimizedMultiplyMD : public OptimizableMD<T, MatrixData<T>> {
 private:
     const MatrixData<T> *left, *right;
+    //Where the memory of the blocks is accounted, shared by the whole chain
+    std::shared_ptr<MemoryUsage> usage;
 public:
-    OptimizedMultiplyMD(const MatrixData<T> *left, const MatrixData<T> *right)
-        : OptimizableMD<T, ConcatenationMD<T, MultiSum<T, BaseMultiplyMD<T>>>>(left->rows(), right->columns()),
-    left(left), right(right) {}
+    OptimizedMultiplyMD(const MatrixData<T> *left, const MatrixData<T> *right, std::shared_ptr<MemoryUsage> usage = nullptr)
+        : OptimizableMD<T, MatrixData<T>>(left->rows(), right->columns()),
+    left(left), right(right), usage(usage) {}
 
     OptimizedMultiplyMD(const OptimizedMultiplyMD<T> &another) :
-        OptimizableMD<T, ConcatenationMD<T, MultiSum<T, BaseMultiplyMD<T>>>>(another),
-    left(another.left), right(another.right) {}
+        OptimizableMD<T, MatrixData<T>>(another),
+    left(another.left), right(another.right), usage(another.usage) {}
 
     //No move constructor
     OptimizedMultiplyMD(OptimizedMultiplyMD<T> &&another) noexcept = delete;
@@ -137,45 +420,169 @@ public:
         return {this->left, this->right};
     }
 
+    /**
+     * @return the number of operations performed to multiply a (rows x inner) matrix by a (inner x columns) one,
+     * including the ones spent on the padding of the blocks
+     */
+    static double estimateFlops(unsigned rows, unsigned inner, unsigned columns) {
+        if (VectorMultiplication<T>::isVectorProduct(rows, columns)) {
+            return 2.0 * rows * inner * columns;
+        }
+        unsigned numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB;
+        computeGrid(rows, inner, columns, numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB);
+        return 2.0 * numberOfGridRowsA * rowsOfGridA * numberOfGridColsA * colsOfGridA * numberOfGridColsB * colsOfGridB;
+    }
+
 protected:
 
-    std::unique_ptr<ConcatenationMD<T, MultiSum<T, BaseMultiplyMD<T>>>> virtualCreateOptimizedMatrix() const override {
-        auto optimalMultiplicationSize = (unsigned) sqrt(OPTIMAL_BLOCK_SIZE / (double) sizeof(T));
+    /**
+     * The operands must be computed first, to know whether they are sparse
+     */
+    std::vector<const MatrixData<T> *> virtualGetDependencies() const override {
+        return {this->left, this->right};
+    }
+
+    /**
+     * The buffer of the result, and the copies of the operands read by the blocks, which are freed once all the
+     * blocks have been computed. Called once the operands have been computed.
+     */
+    size_t virtualGetReservedBytes() const override {
+        const MatrixData<T> *leftValues = this->left->virtualGetOptimized();
+        const MatrixData<T> *rightValues = this->right->virtualGetOptimized();
+        size_t bytes = this->resultBytes(leftValues, rightValues);
+        if (this->isBlockProduct(leftValues, rightValues)) {
+            bytes += copiedBytes(leftValues) + copiedBytes(rightValues);
+        }
+        return bytes;
+    }
+
+    size_t virtualGetKeptBytes() const override {
+        return this->resultBytes(this->left->virtualGetOptimized(), this->right->virtualGetOptimized());
+    }
 
+    std::shared_ptr<MemoryUsage> virtualGetMemoryUsage() const override {
+        return this->usage;
+    }
+
+    std::unique_ptr<MatrixData<T>> virtualCreateOptimizedMatrix() const override {
+        std::unique_ptr<MatrixData<T>> leftHolder, rightHolder;
+        const MatrixData<T> *leftValues = trimmedValues(this->left, leftHolder);
+        const MatrixData<T> *rightValues = trimmedValues(this->right, rightHolder);
+        auto diagonalResult = DiagonalMultiplication<T>::multiply(leftValues, rightValues, this->rows(), this->columns());
+        if (diagonalResult != nullptr) {
+            return diagonalResult;
+        }
+        auto sparseResult = SparseMultiplication<T>::multiply(leftValues, rightValues);
+        if (sparseResult != nullptr) {
+            return sparseResult;
+        }
+        auto vectorResult = VectorMultiplication<T>::multiply(leftValues, rightValues);
+        if (vectorResult != nullptr) {
+            return vectorResult;
+        }
         //E.g. A Matrix 202x302 will be divided in 3x4 blocks, of size 68x76
-        unsigned numberOfGridRowsA = Utils::ceilDiv(this->left->rows(), optimalMultiplicationSize);//e.g. 3
-        unsigned rowsOfGridA = Utils::ceilDiv(this->left->rows(), numberOfGridRowsA);//e.g. 68
-        unsigned numberOfGridColsA = Utils::ceilDiv(this->left->columns(), optimalMultiplicationSize);//e.g. 4
-        unsigned colsOfGridA = Utils::ceilDiv(this->left->columns(), numberOfGridColsA);//e.g. 76
         //Now that I've decided the blocks of A, I can comute the blocks of B.
         //For example, if B is 302x404, it will be divided in 4x5 blocks of size 76x81
+        unsigned numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB;
+        computeGrid(this->left->rows(), this->left->columns(), this->right->columns(),
+                    numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB);
         unsigned numberOfGridRowsB = numberOfGridColsA;//4
-        unsigned rowsOfGridB = colsOfGridA;//76
-        unsigned numberOfGridColsB = Utils::ceilDiv(this->right->columns(), optimalMultiplicationSize);// e.g. 5
-        unsigned colsOfGridB = Utils::ceilDiv(this->right->columns(), numberOfGridColsB);//e.g. 81
         //Now we divide the matrices in blocks
         auto blocksOfA = this->divideInBlocks(this->left, numberOfGridRowsA, numberOfGridColsA);
         auto blocksOfB = this->divideInBlocks(this->right, numberOfGridRowsB, numberOfGridColsB);
 
-        //Now the result C is a matrix 202x404, and has 3x5 blocks of size 68x81
-        std::deque<MultiSum<T, BaseMultiplyMD<T>>> resultingBlocks;
+        //Now the result C is a matrix 202x404, and has 3x5 blocks of size 68x81.
+        //Each block is computed in its position of a single buffer, so the result is read without looking for the blocks
+        auto result = std::make_shared<VectorMatrixData<T>>(numberOfGridRowsA * rowsOfGridA, numberOfGridColsB * colsOfGridB);
+        std::deque<BlockReductionMD<T>> resultingBlocks;
         for (unsigned r = 0; r < numberOfGridRowsA; r++) {
             for (unsigned c = 0; c < numberOfGridColsB; c++) {
-                std::deque<BaseMultiplyMD<T>> toMultiply;
+                std::vector<typename BlockReductionMD<T>::Operands> toMultiply;
                 for (unsigned k = 0; k < numberOfGridRowsB; k++) {
                     toMultiply.emplace_back(blocksOfA[r * numberOfGridColsA + k], blocksOfB[k * numberOfGridColsB + c]);
                 }
-            resultingBlocks.emplace_back(toMultiply);
+            resultingBlocks.emplace_back(toMultiply, result->submatrixView(r * rowsOfGridA, c * colsOfGridB, rowsOfGridA, colsOfGridB));
             }
         }
     //optimized is LARGER or equal to this matrix, but that's not a problem
-    return std::make_unique<ConcatenationMD<T, MultiSum<T, BaseMultiplyMD<T>>>>(
-    resultingBlocks, numberOfGridRowsA * rowsOfGridA, numberOfGridColsB * colsOfGridB
+    return std::make_unique<ConcatenationMD<T, BlockReductionMD<T>>>(
+    resultingBlocks, result->rows(), result->columns(), result
     );
     }
 
 private:
 
+/**
+ * @return whether the product is computed by blocks, i.e. it is not handled by DiagonalMultiplication,
+ * SparseMultiplication or VectorMultiplication
+ */
+bool isBlockProduct(const MatrixData<T> *leftValues, const MatrixData<T> *rightValues) const {
+    return leftValues->virtualGetDiagonalVector() == nullptr && rightValues->virtualGetDiagonalVector() == nullptr &&
+           !SparseMultiplication<T>::isSparse(leftValues) && !SparseMultiplication<T>::isSparse(rightValues) &&
+           !VectorMultiplication<T>::isVectorProduct(this->rows(), this->columns());
+}
+
+/**
+ * @return the bytes of the buffer of the result, including the padding of the blocks. 0 for the product of two sparse
+ * matrices, whose number of non-zeros is not known in advance.
+ */
+size_t resultBytes(const MatrixData<T> *leftValues, const MatrixData<T> *rightValues) const {
+    if (SparseMultiplication<T>::isSparse(leftValues) && SparseMultiplication<T>::isSparse(rightValues)) {
+        return 0;
+    }
+    if (!this->isBlockProduct(leftValues, rightValues)) {
+        return (size_t) this->rows() * this->columns() * sizeof(T);
+    }
+    unsigned numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB;
+    computeGrid(this->left->rows(), this->left->columns(), this->right->columns(),
+                numberOfGridRowsA, rowsOfGridA, numberOfGridColsA, colsOfGridA, numberOfGridColsB, colsOfGridB);
+    return (size_t) numberOfGridRowsA * rowsOfGridA * numberOfGridColsB * colsOfGridB * sizeof(T);
+}
+
+/**
+ * @return the bytes copied by the MaterializerMD of the blocks of the given operand: 0 if its values are already in a buffer
+ */
+static size_t copiedBytes(const MatrixData<T> *values) {
+    if (values->virtualGetStridedView() != nullptr) {
+        return 0;
+    }
+    return (size_t) values->rows() * values->columns() * sizeof(T);
+}
+
+/**
+ * @return the optimized values of the operand, with exactly its size: the result of a block product is padded to
+ * its grid, and the padding must not be read as values. The trimmed copy, if any, is kept in holder.
+ */
+static const MatrixData<T> *trimmedValues(const MatrixData<T> *operand, std::unique_ptr<MatrixData<T>> &holder) {
+    const MatrixData<T> *values = operand->virtualGetOptimized();
+    if (values->rows() == operand->rows() && values->columns() == operand->columns()) {
+        return values;
+    }
+    auto view = values->virtualGetStridedView();
+    if (view != nullptr) {
+        holder = std::make_unique<VectorMatrixData<T>>(view->submatrixView(0, 0, operand->rows(), operand->columns()));
+    } else {
+        holder = std::make_unique<VectorMatrixData<T>>(values->virtualMaterialize(0, 0, operand->rows(), operand->columns()));
+    }
+    return holder.get();
+}
+
+/**
+ * Computes how the two matrices are divided in blocks.
+ * The blocks are at most mc x kc for A and kc x nc for B, as chosen by the Autotuner.
+ */
+static void computeGrid(unsigned rows, unsigned inner, unsigned columns,
+                        unsigned &numberOfGridRowsA, unsigned &rowsOfGridA, unsigned &numberOfGridColsA, unsigned &colsOfGridA,
+                        unsigned &numberOfGridColsB, unsigned &colsOfGridB) {
+    const GemmBlocking &blocking = Autotuner::blocking<T>();
+    numberOfGridRowsA = Utils::ceilDiv(rows, blocking.mc);//e.g. 3
+    rowsOfGridA = Utils::ceilDiv(rows, numberOfGridRowsA);//e.g. 68
+    numberOfGridColsA = Utils::ceilDiv(inner, blocking.kc);//e.g. 4
+    colsOfGridA = Utils::ceilDiv(inner, numberOfGridColsA);//e.g. 76
+    numberOfGridColsB = Utils::ceilDiv(columns, blocking.nc);// e.g. 5
+    colsOfGridB = Utils::ceilDiv(columns, numberOfGridColsB);//e.g. 81
+}
+
 std::vector<std::shared_ptr<ResizerMD<T, MaterializerMD<T>>>>
 divideInBlocks(const MatrixData<T> *matrix, unsigned numberOfGridRows, unsigned numberOfGridCols) const {
     //e.g. matrix is 202x302;
@@ -203,46 +610,73 @@ divideInBlocks(const MatrixData<T> *matrix, unsigned numberOfGridRows, unsigned
 
 };
 
+/**
+ * Block of the result of a product, i.e. the sum of the products of a row of blocks of A by a column of blocks of B.
+ * Each product is accumulated by <code>Gemm</code> directly into a single tile (C += A_ik * B_kj), reading the blocks
+ * in place, so no partial product is ever stored. The tile is a part of the buffer of the product, which is accounted
+ * in <code>MemoryBudget::shared()</code> by <code>OptimizedMultiplyMD</code>.
+ */
 template<typename T>
-class BaseMultiplyMD : public OptimizableMD<T, VectorMatrixData<T>> {
+class BlockReductionMD : public OptimizableMD<T, VectorMatrixData<T>> {
+public:
+    typedef std::pair<std::shared_ptr<ResizerMD<T, MaterializerMD<T>>>, std::shared_ptr<ResizerMD<T, MaterializerMD<T>>>> Operands;
+
 private:
-mutable std::shared_ptr<ResizerMD<T, MaterializerMD<T>>> left, right;
+    mutable std::vector<Operands> operands;
+    //Where the values are written, e.g. a part of the buffer of the whole product
+    VectorMatrixData<T> tile;
+
 public:
-BaseMultiplyMD(std::shared_ptr<ResizerMD<T, MaterializerMD<T>>> left, std::shared_ptr<ResizerMD<T, MaterializerMD<T>>> right)
-: OptimizableMD<T, VectorMatrixData<T>>(left->rows(), right->columns()), left(left), right(right) {
-}
+    /**
+     * @param tile row-major zero-initialized matrix where the block is computed
+     */
+    BlockReductionMD(std::vector<Operands> operands, VectorMatrixData<T> tile) :
+            OptimizableMD<T, VectorMatrixData<T>>(tile.rows(), tile.columns()),
+            operands(std::move(operands)), tile(tile) {
+        if (this->tile.getColStride() != 1) {
+            Utils::error("The tile must be row-major");
+        }
+        for (auto &pair : this->operands) {
+            if (pair.first->rows() != this->rows() || pair.second->columns() != this->columns()) {
+                Utils::error("All the products must be of the same size!");
+            }
+        }
+    }
 
-//I cannot return left or right, since I could leak an object that will be deleted in the future
-std::vector<const MatrixData<T> *> virtualGetChildren() const override {
-//return {this->left.get(), this->right.get()};
-return std::vector<const MatrixData<T> *>();
-}
+    BlockReductionMD(const BlockReductionMD<T> &another) :
+            OptimizableMD<T, VectorMatrixData<T>>(another), operands(another.operands), tile(another.tile) {
+    }
+
+    //The blocks of the operands are shared with other blocks of the result, so they are not leaked
+    std::vector<const MatrixData<T> *> virtualGetChildren() const override {
+        return std::vector<const MatrixData<T> *>();
+    }
 
 protected:
 
-std::unique_ptr<VectorMatrixData<T>> virtualCreateOptimizedMatrix() const override {
-//Since OptimizableMD doesn't call optimize on children automatically, I do it here
-this->left->optimize();
-this->right->optimize();
-
-//Keeping the references to left and right, to save some time when calling get()
-ResizerMD<T, MaterializerMD<T>> *ll = this->left.get();
-ResizerMD<T, MaterializerMD<T>> *rr = this->right.get();
-std::unique_ptr<VectorMatrixData<T>> ret = std::make_unique<VectorMatrixData<T>>(ll->rows(), rr->columns());
-for (unsigned int r = 0; r < ret->rows(); r++) {
-for (unsigned int c = 0; c < ret->columns(); c++) {
-T sum = 0;
-for (unsigned j = 0; j < ll->columns(); j++) {
-sum += ll->get(r, j) * rr->get(j, c);
-}
-ret->set(r, c, sum);
-}
-}
+    std::vector<const MatrixData<T> *> virtualGetDependencies() const override {
+        std::vector<const MatrixData<T> *> ret;
+        for (auto &pair : this->operands) {
+            ret.push_back(pair.first.get());
+            ret.push_back(pair.second.get());
+        }
+        return ret;
+    }
 
-//Freeing memory
-this->left.reset();
-this->right.reset();
-return ret;
-}
+    std::unique_ptr<VectorMatrixData<T>> virtualCreateOptimizedMatrix() const override {
+        //The padding of the blocks is only zeros, so it is skipped
+        auto ret = std::make_unique<VectorMatrixData<T>>(this->tile);
+        for (auto &pair : this->operands) {
+            auto a = static_cast<const VectorMatrixData<T> *>(pair.first->getWrapped().virtualGetOptimized());
+            auto b = static_cast<const VectorMatrixData<T> *>(pair.second->getWrapped().virtualGetOptimized());
+            Gemm<T>::multiplyAdd(a->rows(), b->columns(), std::min(a->columns(), b->rows()),
+                                 a->rawData(), a->getRowStride(), a->getColStride(), b->rawData(), b->getRowStride(), b->getColStride(),
+                                 ret->rawData(), ret->getRowStride(), Autotuner::blocking<T>());
+        }
+        //Freeing memory
+        this->operands.clear();
+        return ret;
+    }
 };
+
 #endif //MATRIXTEMPLATE_MULTIPLICATION_H
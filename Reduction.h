@@ -0,0 +1,503 @@
+#ifndef MATRIXTEMPLATE_REDUCTION_H
+#define MATRIXTEMPLATE_REDUCTION_H
+
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "MultipleMethod.h"
+
+/*
+ * Reductions of a whole matrix, of each row or of each column.
+ * The values are read in place when the matrix (or the result it has been optimized into) is stored in a buffer,
+ * otherwise a strip of rows at a time is materialized in a small buffer, so lazy views are never copied entirely.
+ * The rows are split in a number of chunks that depends only on the size of the matrix, reduced in parallel with
+ * <code>Simd</code> registers and combined in order: the result does not depend on the number of threads.
+ *
+ * A reduction is a struct with identity(), a function of the accumulated value and a new one (on scalars with
+ * operator(), on registers with vector()), and combine() / combineVector() to merge two accumulated values.
+ * The values are accumulated in its type Accumulator: when it is not the type of the values (e.g. the sum of an int
+ * matrix in a double, which does not overflow) VECTORIZED is false, and only the scalar functions are used.
+ */
+
+/**
+ * Sum of the values
+ * @tparam A type of the sum
+ */
+template<typename T, typename A = T>
+struct SumReduction {
+    typedef Simd<T> S;
+    typedef A Accumulator;
+    static const bool VECTORIZED = std::is_same<T, A>::value;
+
+    A identity() const { return A(0); }
+
+    A operator()(A accumulated, T value) const { return accumulated + (A) value; }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const { return S::add(accumulated, value); }
+
+    A combine(A a, A b) const { return a + b; }
+
+    typename S::Vector combineVector(typename S::Vector a, typename S::Vector b) const { return S::add(a, b); }
+};
+
+/**
+ * Sum of the squares of the values
+ * @tparam A type of the sum, in which the squares are computed
+ */
+template<typename T, typename A = T>
+struct SquaresReduction : public SumReduction<T, A> {
+    typedef Simd<T> S;
+
+    A operator()(A accumulated, T value) const { return accumulated + (A) value * (A) value; }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const {
+        return S::multiplyAdd(value, value, accumulated);
+    }
+};
+
+/**
+ * Sum of the absolute values
+ */
+template<typename T>
+struct AbsSumReduction : public SumReduction<T> {
+    typedef Simd<T> S;
+
+    T operator()(T accumulated, T value) const { return accumulated + absolute(value); }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const {
+        return S::add(accumulated, absoluteVector(value));
+    }
+
+    static T absolute(T value) {
+        return value < T(0) ? T(-value) : value;
+    }
+
+    static typename S::Vector absoluteVector(typename S::Vector value) {
+        return std::is_signed<T>::value ? S::max(value, S::subtract(S::zero(), value)) : value;
+    }
+};
+
+/**
+ * Minimum value
+ */
+template<typename T>
+struct MinReduction {
+    typedef Simd<T> S;
+    typedef T Accumulator;
+    static const bool VECTORIZED = true;
+
+    T identity() const {
+        return std::numeric_limits<T>::has_infinity ? std::numeric_limits<T>::infinity() : std::numeric_limits<T>::max();
+    }
+
+    T operator()(T accumulated, T value) const { return value < accumulated ? value : accumulated; }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const { return S::min(accumulated, value); }
+
+    T combine(T a, T b) const { return (*this)(a, b); }
+
+    typename S::Vector combineVector(typename S::Vector a, typename S::Vector b) const { return S::min(a, b); }
+};
+
+/**
+ * Maximum value
+ */
+template<typename T>
+struct MaxReduction {
+    typedef Simd<T> S;
+    typedef T Accumulator;
+    static const bool VECTORIZED = true;
+
+    T identity() const {
+        return std::numeric_limits<T>::has_infinity ? -std::numeric_limits<T>::infinity() : std::numeric_limits<T>::lowest();
+    }
+
+    T operator()(T accumulated, T value) const { return accumulated < value ? value : accumulated; }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const { return S::max(accumulated, value); }
+
+    T combine(T a, T b) const { return (*this)(a, b); }
+
+    typename S::Vector combineVector(typename S::Vector a, typename S::Vector b) const { return S::max(a, b); }
+};
+
+/**
+ * Maximum absolute value
+ */
+template<typename T>
+struct AbsMaxReduction : public MaxReduction<T> {
+    typedef Simd<T> S;
+
+    T identity() const { return T(0); }
+
+    T operator()(T accumulated, T value) const { return MaxReduction<T>::operator()(accumulated, AbsSumReduction<T>::absolute(value)); }
+
+    typename S::Vector vector(typename S::Vector accumulated, typename S::Vector value) const {
+        return S::max(accumulated, AbsSumReduction<T>::absoluteVector(value));
+    }
+};
+
+/**
+ * A cell of a matrix, and its value
+ */
+template<typename T>
+struct MatrixPosition {
+    unsigned row, col;
+    T value;
+};
+
+/**
+ * Evaluation of the reductions above on a <code>MatrixData</code>
+ * @tparam T type of the data
+ */
+template<typename T>
+class Reduction {
+public:
+    //Type of the results that are not integers even for an integer matrix, e.g. the mean
+    typedef decltype(std::sqrt(T())) Real;
+
+    /**
+     * @return all the values of the matrix reduced to one
+     */
+    template<class Op>
+    static typename Op::Accumulator all(const MatrixData<T> &matrix, const Op &op) {
+        typedef typename Op::Accumulator A;
+        //The order of the values does not matter, so a column-major buffer is read as its row-major transpose
+        Source source(matrix, true);
+        std::vector<A> partials(source.chunks(), op.identity());
+        source.forEachStrip([&](unsigned chunk, unsigned, const T *values, size_t stride, unsigned height) {
+            A accumulated = partials[chunk];
+            for (unsigned r = 0; r < height; r++) {
+                accumulated = op.combine(accumulated, reduceRow(values + r * stride, source.columns(), op));
+            }
+            partials[chunk] = accumulated;
+        });
+        A ret = op.identity();
+        for (A partial : partials) {
+            ret = op.combine(ret, partial);
+        }
+        return ret;
+    }
+
+    /**
+     * @return a vector with each row reduced to one value
+     */
+    template<class Op>
+    static VectorMatrixData<typename Op::Accumulator> rows(const MatrixData<T> &matrix, const Op &op) {
+        //The rows of a column-major buffer are reduced as the columns of its transpose
+        Source source(matrix, true);
+        return source.isTransposed() ? source.reduceColumns(op).transposedView() : source.reduceRows(op);
+    }
+
+    /**
+     * @return a covector with each column reduced to one value
+     */
+    template<class Op>
+    static VectorMatrixData<typename Op::Accumulator> columns(const MatrixData<T> &matrix, const Op &op) {
+        Source source(matrix, true);
+        return source.isTransposed() ? source.reduceRows(op).transposedView() : source.reduceColumns(op);
+    }
+
+    /**
+     * @return the first position of the minimum value, in row-major order
+     */
+    static MatrixPosition<T> argMin(const MatrixData<T> &matrix) {
+        return find(matrix, MinReduction<T>());
+    }
+
+    /**
+     * @return the first position of the maximum value, in row-major order
+     */
+    static MatrixPosition<T> argMax(const MatrixData<T> &matrix) {
+        return find(matrix, MaxReduction<T>());
+    }
+
+    /**
+     * @return the sum of the values on the diagonal of a squared matrix
+     */
+    static T trace(const MatrixData<T> &matrix) {
+        if (matrix.rows() != matrix.columns()) {
+            Utils::error("trace() can only be called on squared matrices");
+        }
+        matrix.virtualOptimize();
+        const MatrixData<T> *optimized = matrix.virtualGetOptimized();
+        std::unique_ptr<const VectorMatrixData<T>> view = optimized->virtualGetStridedView();
+        T ret = T(0);
+        if (view != nullptr) {
+            size_t step = view->getRowStride() + view->getColStride();
+            for (unsigned i = 0; i < matrix.rows(); i++) {
+                ret += view->rawData()[i * step];
+            }
+        } else {
+            //Only the cells of the diagonal are computed
+            for (unsigned i = 0; i < matrix.rows(); i++) {
+                T value;
+                optimized->virtualMaterializeInto(&value, 1, i, i, 1, 1);
+                ret += value;
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * @return a matrix of the same size with f applied to each value, e.g. to turn sums into means
+     */
+    template<typename V, class F>
+    static VectorMatrixData<Real> map(const VectorMatrixData<V> &values, F f) {
+        VectorMatrixData<Real> ret(values.rows(), values.columns());
+        for (unsigned r = 0; r < values.rows(); r++) {
+            for (unsigned c = 0; c < values.columns(); c++) {
+                ret.rawData()[(size_t) r * ret.getRowStride() + c * ret.getColStride()] =
+                        f(values.rawData()[(size_t) r * values.getRowStride() + c * values.getColStride()]);
+            }
+        }
+        return ret;
+    }
+
+private:
+    //Chunks of rows reduced independently: enough for any pool, few enough to combine their results quickly
+    static const unsigned MAX_CHUNKS = 64;
+
+    /**
+     * The values of a matrix, read a strip of rows at a time
+     */
+    class Source {
+    private:
+        const MatrixData<T> *matrix;
+        std::unique_ptr<const VectorMatrixData<T>> view;
+        bool transposed = false;
+        unsigned _rows, _columns, chunkRows;
+
+    public:
+        /**
+         * @param transposable whether a column-major buffer can be read in place by rows of its transpose,
+         * i.e. whether the caller handles isTransposed()
+         */
+        Source(const MatrixData<T> &matrix, bool transposable) : _rows(matrix.rows()), _columns(matrix.columns()) {
+            //A product is computed only once, and then read in place
+            matrix.virtualOptimize();
+            this->matrix = matrix.virtualGetOptimized();
+            this->view = this->matrix->virtualGetStridedView();
+            if (this->view != nullptr && this->view->getColStride() != 1 && this->_columns > 1) {
+                if (transposable && this->view->getRowStride() == 1) {
+                    this->view = std::make_unique<VectorMatrixData<T>>(this->view->transposedView());
+                    this->transposed = true;
+                    std::swap(this->_rows, this->_columns);
+                } else {
+                    this->view = nullptr;
+                }
+            }
+            unsigned stripRows = Utils::rowsPerStrip(this->_columns, sizeof(T));
+            this->chunkRows = std::max(stripRows, Utils::ceilDiv(std::max(this->_rows, 1u), MAX_CHUNKS));
+        }
+
+        /**
+         * @return whether the rows of this source are the columns of the matrix
+         */
+        bool isTransposed() const {
+            return this->transposed;
+        }
+
+        unsigned rows() const {
+            return this->_rows;
+        }
+
+        unsigned columns() const {
+            return this->_columns;
+        }
+
+        unsigned chunks() const {
+            return this->_rows == 0 ? 0 : Utils::ceilDiv(this->_rows, this->chunkRows);
+        }
+
+        /**
+         * Calls body(chunk, firstRow, values, rowStride, height) on consecutive strips of rows covering each chunk,
+         * with the chunks in parallel. The strips of a chunk are given in order, by the same thread.
+         */
+        template<class F>
+        void forEachStrip(F body) const {
+            unsigned columns = this->_columns;
+            ThreadPool::shared().parallelFor(0, this->chunks(), (size_t) this->chunkRows * columns, [&](unsigned first, unsigned last) {
+                std::vector<T> strip;
+                for (unsigned chunk = first; chunk < last; chunk++) {
+                    unsigned begin = chunk * this->chunkRows;
+                    unsigned end = std::min(this->_rows, begin + this->chunkRows);
+                    if (this->view != nullptr) {
+                        size_t stride = this->view->getRowStride();
+                        body(chunk, begin, this->view->rawData() + begin * stride, stride, end - begin);
+                        continue;
+                    }
+                    unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+                    strip.resize((size_t) std::min(stripRows, end - begin) * columns);
+                    for (unsigned row = begin; row < end; row += stripRows) {
+                        unsigned height = std::min(stripRows, end - row);
+                        this->matrix->virtualMaterializeInto(strip.data(), columns, row, 0, height, columns);
+                        body(chunk, row, strip.data(), columns, height);
+                    }
+                }
+            });
+        }
+
+        /**
+         * @return a vector with the reduction of each row of this source
+         */
+        template<class Op>
+        VectorMatrixData<typename Op::Accumulator> reduceRows(const Op &op) const {
+            VectorMatrixData<typename Op::Accumulator> ret(this->_rows, 1);
+            typename Op::Accumulator *destination = ret.rawData();
+            this->forEachStrip([&](unsigned, unsigned row, const T *values, size_t stride, unsigned height) {
+                for (unsigned r = 0; r < height; r++) {
+                    destination[row + r] = reduceRow(values + r * stride, this->_columns, op);
+                }
+            });
+            return ret;
+        }
+
+        /**
+         * @return a covector with the reduction of each column of this source
+         */
+        template<class Op>
+        VectorMatrixData<typename Op::Accumulator> reduceColumns(const Op &op) const {
+            typedef typename Op::Accumulator A;
+            size_t columns = this->_columns;
+            std::vector<A> partials(this->chunks() * columns, op.identity());
+            this->forEachStrip([&](unsigned chunk, unsigned, const T *values, size_t stride, unsigned height) {
+                A *accumulated = partials.data() + chunk * columns;
+                for (unsigned r = 0; r < height; r++) {
+                    accumulate(accumulated, values + r * stride, columns, op, std::integral_constant<bool, Op::VECTORIZED>());
+                }
+            });
+            VectorMatrixData<A> ret(1, this->_columns);
+            A *destination = ret.rawData();
+            std::fill(destination, destination + columns, op.identity());
+            for (unsigned chunk = 0; chunk < this->chunks(); chunk++) {
+                const A *partial = partials.data() + chunk * columns;
+                for (size_t i = 0; i < columns; i++) {
+                    destination[i] = op.combine(destination[i], partial[i]);
+                }
+            }
+            return ret;
+        }
+
+    private:
+        /**
+         * accumulated[i] = op(accumulated[i], values[i])
+         */
+        template<class Op>
+        static void accumulate(T *accumulated, const T *values, size_t n, const Op &op, std::true_type) {
+            typedef Simd<T> S;
+            size_t i = 0;
+            for (; i + S::WIDTH <= n; i += S::WIDTH) {
+                S::store(accumulated + i, op.vector(S::load(accumulated + i), S::load(values + i)));
+            }
+            for (; i < n; i++) {
+                accumulated[i] = op(accumulated[i], values[i]);
+            }
+        }
+
+        template<class Op>
+        static void accumulate(typename Op::Accumulator *accumulated, const T *values, size_t n, const Op &op, std::false_type) {
+            for (size_t i = 0; i < n; i++) {
+                accumulated[i] = op(accumulated[i], values[i]);
+            }
+        }
+    };
+
+    /**
+     * @return the reduction of n contiguous values
+     */
+    template<class Op>
+    static typename Op::Accumulator reduceRow(const T *values, size_t n, const Op &op) {
+        return reduceRow(values, n, op, std::integral_constant<bool, Op::VECTORIZED>());
+    }
+
+    /**
+     * Vectorized version, with independent registers to hide the latency of the operation
+     */
+    template<class Op>
+    static T reduceRow(const T *values, size_t n, const Op &op, std::true_type) {
+        typedef Simd<T> S;
+        size_t i = 0;
+        T ret = op.identity();
+        if (n >= S::WIDTH) {
+            typename S::Vector identity = S::broadcast(op.identity());
+            typename S::Vector a0 = identity, a1 = identity, a2 = identity, a3 = identity;
+            for (; i + 4 * S::WIDTH <= n; i += 4 * S::WIDTH) {
+                a0 = op.vector(a0, S::load(values + i));
+                a1 = op.vector(a1, S::load(values + i + S::WIDTH));
+                a2 = op.vector(a2, S::load(values + i + 2 * S::WIDTH));
+                a3 = op.vector(a3, S::load(values + i + 3 * S::WIDTH));
+            }
+            for (; i + S::WIDTH <= n; i += S::WIDTH) {
+                a0 = op.vector(a0, S::load(values + i));
+            }
+            a0 = op.combineVector(op.combineVector(a0, a1), op.combineVector(a2, a3));
+            T lanes[S::WIDTH];
+            S::store(lanes, a0);
+            for (unsigned lane = 0; lane < S::WIDTH; lane++) {
+                ret = op.combine(ret, lanes[lane]);
+            }
+        }
+        for (; i < n; i++) {
+            ret = op(ret, values[i]);
+        }
+        return ret;
+    }
+
+    template<class Op>
+    static typename Op::Accumulator reduceRow(const T *values, size_t n, const Op &op, std::false_type) {
+        typename Op::Accumulator ret = op.identity();
+        for (size_t i = 0; i < n; i++) {
+            ret = op(ret, values[i]);
+        }
+        return ret;
+    }
+
+    /**
+     * @return the first position of the value selected by op (the minimum or the maximum)
+     */
+    template<class Op>
+    static MatrixPosition<T> find(const MatrixData<T> &matrix, const Op &op) {
+        if (matrix.rows() == 0 || matrix.columns() == 0) {
+            Utils::error("Cannot find a value in an empty matrix");
+        }
+        Source source(matrix, false);
+        struct Partial {
+            bool found;
+            MatrixPosition<T> position;
+        };
+        std::vector<Partial> partials(source.chunks(), Partial{false, {0, 0, T(0)}});
+        source.forEachStrip([&](unsigned chunk, unsigned row, const T *values, size_t stride, unsigned height) {
+            Partial &partial = partials[chunk];
+            for (unsigned r = 0; r < height; r++) {
+                const T *rowValues = values + r * stride;
+                T selected = reduceRow(rowValues, source.columns(), op);
+                //Each row is scanned again only when it improves the result, to find where the value is
+                if (partial.found && op(partial.position.value, selected) == partial.position.value) {
+                    continue;
+                }
+                for (unsigned col = 0; col < source.columns(); col++) {
+                    if (rowValues[col] == selected) {
+                        partial = Partial{true, {row + r, col, selected}};
+                        break;
+                    }
+                }
+            }
+        });
+        Partial ret{false, {0, 0, T(0)}};
+        for (const Partial &partial : partials) {
+            if (partial.found && (!ret.found || op(ret.position.value, partial.position.value) != ret.position.value)) {
+                ret = partial;
+            }
+        }
+        if (!ret.found) {
+            //Only NaN values
+            ret.position.value = matrix.get(0, 0);
+        }
+        return ret.position;
+    }
+};
+
+#endif //MATRIXTEMPLATE_REDUCTION_H
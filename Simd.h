@@ -0,0 +1,349 @@
+#ifndef MATRIXTEMPLATE_SIMD_H
+#define MATRIXTEMPLATE_SIMD_H
+
+#include <cstddef>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Thin wrapper around the vector registers available at compile time.
+ * The generic version works on a single scalar, so every kernel written on top of it has a scalar fallback
+ * and works with any type that supports <code>+</code> and <code>*</code>.
+ * All the loads and stores are unaligned.
+ * @tparam T type of the data
+ */
+template<typename T>
+struct Simd {
+    typedef T Vector;
+    static const unsigned WIDTH = 1;
+
+    static Vector zero() { return T(0); }
+
+    static Vector broadcast(T t) { return t; }
+
+    static Vector load(const T *p) { return *p; }
+
+    static void store(T *p, Vector v) { *p = v; }
+
+    static Vector add(Vector a, Vector b) { return a + b; }
+
+    static Vector subtract(Vector a, Vector b) { return a - b; }
+
+    static Vector min(Vector a, Vector b) { return b < a ? b : a; }
+
+    static Vector max(Vector a, Vector b) { return a < b ? b : a; }
+
+    static Vector multiply(Vector a, Vector b) { return a * b; }
+
+    /**
+     * @return a * b + c
+     */
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return a * b + c; }
+};
+
+#if defined(__AVX512F__)
+
+template<>
+struct Simd<float> {
+    typedef __m512 Vector;
+    static const unsigned WIDTH = 16;
+
+    static Vector zero() { return _mm512_setzero_ps(); }
+
+    static Vector broadcast(float t) { return _mm512_set1_ps(t); }
+
+    static Vector load(const float *p) { return _mm512_loadu_ps(p); }
+
+    static void store(float *p, Vector v) { _mm512_storeu_ps(p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm512_add_ps(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm512_sub_ps(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm512_min_ps(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm512_max_ps(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm512_mul_ps(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return _mm512_fmadd_ps(a, b, c); }
+};
+
+template<>
+struct Simd<double> {
+    typedef __m512d Vector;
+    static const unsigned WIDTH = 8;
+
+    static Vector zero() { return _mm512_setzero_pd(); }
+
+    static Vector broadcast(double t) { return _mm512_set1_pd(t); }
+
+    static Vector load(const double *p) { return _mm512_loadu_pd(p); }
+
+    static void store(double *p, Vector v) { _mm512_storeu_pd(p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm512_add_pd(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm512_sub_pd(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm512_min_pd(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm512_max_pd(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm512_mul_pd(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return _mm512_fmadd_pd(a, b, c); }
+};
+
+/**
+ * Integer lanes of 32 bits
+ */
+template<typename T>
+struct SimdInt32 {
+    typedef __m512i Vector;
+    static const unsigned WIDTH = 16;
+
+    static Vector zero() { return _mm512_setzero_si512(); }
+
+    static Vector broadcast(T t) { return _mm512_set1_epi32((int) t); }
+
+    static Vector load(const T *p) { return _mm512_loadu_si512((const void *) p); }
+
+    static void store(T *p, Vector v) { _mm512_storeu_si512((void *) p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm512_add_epi32(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm512_sub_epi32(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm512_min_epi32(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm512_max_epi32(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm512_mullo_epi32(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return add(multiply(a, b), c); }
+};
+
+#if defined(__AVX512DQ__)
+
+/**
+ * Integer lanes of 64 bits. The 64 bits multiplication is only available with AVX-512DQ.
+ */
+template<typename T>
+struct SimdInt64 {
+    typedef __m512i Vector;
+    static const unsigned WIDTH = 8;
+
+    static Vector zero() { return _mm512_setzero_si512(); }
+
+    static Vector broadcast(T t) { return _mm512_set1_epi64((long long) t); }
+
+    static Vector load(const T *p) { return _mm512_loadu_si512((const void *) p); }
+
+    static void store(T *p, Vector v) { _mm512_storeu_si512((void *) p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm512_add_epi64(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm512_sub_epi64(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm512_min_epi64(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm512_max_epi64(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm512_mullo_epi64(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return add(multiply(a, b), c); }
+};
+
+#define MATRIXTEMPLATE_SIMD_INT64
+
+#endif
+
+#elif defined(__AVX2__)
+
+template<>
+struct Simd<float> {
+    typedef __m256 Vector;
+    static const unsigned WIDTH = 8;
+
+    static Vector zero() { return _mm256_setzero_ps(); }
+
+    static Vector broadcast(float t) { return _mm256_set1_ps(t); }
+
+    static Vector load(const float *p) { return _mm256_loadu_ps(p); }
+
+    static void store(float *p, Vector v) { _mm256_storeu_ps(p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm256_min_ps(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm256_max_ps(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm256_mul_ps(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) {
+#if defined(__FMA__)
+        return _mm256_fmadd_ps(a, b, c);
+#else
+        return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+    }
+};
+
+template<>
+struct Simd<double> {
+    typedef __m256d Vector;
+    static const unsigned WIDTH = 4;
+
+    static Vector zero() { return _mm256_setzero_pd(); }
+
+    static Vector broadcast(double t) { return _mm256_set1_pd(t); }
+
+    static Vector load(const double *p) { return _mm256_loadu_pd(p); }
+
+    static void store(double *p, Vector v) { _mm256_storeu_pd(p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm256_add_pd(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm256_sub_pd(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm256_min_pd(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm256_max_pd(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm256_mul_pd(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) {
+#if defined(__FMA__)
+        return _mm256_fmadd_pd(a, b, c);
+#else
+        return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+    }
+};
+
+/**
+ * Integer lanes of 32 bits
+ */
+template<typename T>
+struct SimdInt32 {
+    typedef __m256i Vector;
+    static const unsigned WIDTH = 8;
+
+    static Vector zero() { return _mm256_setzero_si256(); }
+
+    static Vector broadcast(T t) { return _mm256_set1_epi32((int) t); }
+
+    static Vector load(const T *p) { return _mm256_loadu_si256((const __m256i *) p); }
+
+    static void store(T *p, Vector v) { _mm256_storeu_si256((__m256i *) p, v); }
+
+    static Vector add(Vector a, Vector b) { return _mm256_add_epi32(a, b); }
+
+    static Vector subtract(Vector a, Vector b) { return _mm256_sub_epi32(a, b); }
+
+    static Vector min(Vector a, Vector b) { return _mm256_min_epi32(a, b); }
+
+    static Vector max(Vector a, Vector b) { return _mm256_max_epi32(a, b); }
+
+    static Vector multiply(Vector a, Vector b) { return _mm256_mullo_epi32(a, b); }
+
+    static Vector multiplyAdd(Vector a, Vector b, Vector c) { return add(multiply(a, b), c); }
+};
+
+#endif
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+
+template<>
+struct Simd<int> : public SimdInt32<int> {
+};
+
+#endif
+
+#if defined(MATRIXTEMPLATE_SIMD_INT64)
+
+//AVX2 has no 64 bits multiplication, so long keeps the scalar version there
+template<>
+struct Simd<long> : public std::conditional<sizeof(long) == 8, SimdInt64<long>, SimdInt32<long>>::type {
+};
+
+template<>
+struct Simd<long long> : public SimdInt64<long long> {
+};
+
+#endif
+
+/**
+ * Loops over arrays written with <code>Simd</code>
+ * @tparam T type of the data
+ */
+template<typename T>
+struct SimdOps {
+    /**
+     * destination[i] += source[i]
+     */
+    static void add(T *destination, const T *source, size_t n) {
+        typedef Simd<T> S;
+        size_t i = 0;
+        for (; i + S::WIDTH <= n; i += S::WIDTH) {
+            S::store(destination + i, S::add(S::load(destination + i), S::load(source + i)));
+        }
+        for (; i < n; i++) {
+            destination[i] += source[i];
+        }
+    }
+
+    /**
+     * destination[i] += source[i] * factor
+     */
+    static void multiplyAdd(T *destination, const T *source, T factor, size_t n) {
+        typedef Simd<T> S;
+        typename S::Vector f = S::broadcast(factor);
+        size_t i = 0;
+        for (; i + S::WIDTH <= n; i += S::WIDTH) {
+            S::store(destination + i, S::multiplyAdd(S::load(source + i), f, S::load(destination + i)));
+        }
+        for (; i < n; i++) {
+            destination[i] += source[i] * factor;
+        }
+    }
+
+    /**
+     * @return the sum of a[i] * b[i]
+     */
+    static T dot(const T *a, const T *b, size_t n) {
+        typedef Simd<T> S;
+        typename S::Vector sum = S::zero();
+        size_t i = 0;
+        for (; i + S::WIDTH <= n; i += S::WIDTH) {
+            sum = S::multiplyAdd(S::load(a + i), S::load(b + i), sum);
+        }
+        T ret = horizontalSum(sum);
+        for (; i < n; i++) {
+            ret += a[i] * b[i];
+        }
+        return ret;
+    }
+
+    /**
+     * @return the sum of the lanes of a vector
+     */
+    static T horizontalSum(typename Simd<T>::Vector v) {
+        T lanes[Simd<T>::WIDTH];
+        Simd<T>::store(lanes, v);
+        T ret = lanes[0];
+        for (unsigned i = 1; i < Simd<T>::WIDTH; i++) {
+            ret += lanes[i];
+        }
+        return ret;
+    }
+};
+
+#endif //MATRIXTEMPLATE_SIMD_H
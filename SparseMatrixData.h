@@ -0,0 +1,491 @@
+#ifndef MATRIXTEMPLATE_SPARSEMATRIXDATA_H
+#define MATRIXTEMPLATE_SPARSEMATRIXDATA_H
+
+#include <algorithm>
+#include <memory>
+#include <tuple>
+#include <vector>
+#include "MultipleMethod.h"
+
+/**
+ * Compressed storage of the non-zero values: the values of the outer line i (a row for CSR, a column for CSC) are
+ * values[pointers[i]..pointers[i+1]), and their positions inside the line are in indices, sorted.
+ * @tparam T type of the data
+ */
+template<typename T>
+struct CompressedStorage {
+    std::vector<unsigned> pointers;
+    std::vector<unsigned> indices;
+    std::vector<T> values;
+};
+
+/**
+ * Implementation of <code>MatrixData</code> that only stores the non-zero values, compressed by rows (CSR) or by
+ * columns (CSC). Like <code>VectorMatrixData</code>, copies of the object share the values, while
+ * <code>copy()</code> duplicates them.
+ * Reading a cell costs a binary search inside its line, and setting a value that was zero moves all the following
+ * ones, so sparse matrices should be built with <code>fromTriplets()</code> or <code>fromDense()</code>.
+ *
+ * Multiplications with a sparse operand are performed by <code>SparseMultiplication</code>, only on the non-zeros.
+ * @tparam T type of the data
+ * @tparam BY_ROWS true for CSR, false for CSC
+ */
+template<typename T, bool BY_ROWS>
+class CompressedMatrixData : public MatrixData<T> {
+private:
+    template<typename U, bool B> friend
+    class CompressedMatrixData;
+
+    std::shared_ptr<CompressedStorage<T>> storage;
+
+    CompressedMatrixData(unsigned rows, unsigned columns, std::shared_ptr<CompressedStorage<T>> storage) :
+            MatrixData<T>(rows, columns), storage(storage) {
+    }
+
+public:
+
+    /**
+     * Creates a matrix filled with zeros
+     */
+    CompressedMatrixData(unsigned rows, unsigned columns) : MatrixData<T>(rows, columns), storage(std::make_shared<CompressedStorage<T>>()) {
+        this->storage->pointers.assign(this->outerSize() + 1, 0);
+    }
+
+    /**
+     * Creates a matrix from its compressed representation
+     */
+    CompressedMatrixData(unsigned rows, unsigned columns, std::vector<unsigned> pointers, std::vector<unsigned> indices, std::vector<T> values) :
+            CompressedMatrixData(rows, columns, std::make_shared<CompressedStorage<T>>()) {
+        if (pointers.size() != this->outerSize() + 1 || pointers[0] != 0 || pointers.back() != indices.size() ||
+            indices.size() != values.size()) {
+            Utils::error("Invalid compressed matrix");
+        }
+        for (unsigned i = 0; i < this->outerSize(); i++) {
+            if (pointers[i + 1] < pointers[i]) {
+                Utils::error("Invalid compressed matrix");
+            }
+            for (unsigned p = pointers[i]; p < pointers[i + 1]; p++) {
+                if (indices[p] >= this->innerSize() || (p > pointers[i] && indices[p] <= indices[p - 1])) {
+                    Utils::error("Invalid compressed matrix");
+                }
+            }
+        }
+        this->storage->pointers = std::move(pointers);
+        this->storage->indices = std::move(indices);
+        this->storage->values = std::move(values);
+    }
+
+    /**
+     * @param triplets (row, column, value) of the non-zero values, in any order. Duplicates are summed.
+     */
+    static CompressedMatrixData<T, BY_ROWS> fromTriplets(unsigned rows, unsigned columns, const std::vector<std::tuple<unsigned, unsigned, T>> &triplets) {
+        CompressedMatrixData<T, BY_ROWS> ret(rows, columns);
+        CompressedStorage<T> &s = *ret.storage;
+        //Counting sort on the outer line, then sorting each line
+        for (auto &triplet : triplets) {
+            if (std::get<0>(triplet) >= rows || std::get<1>(triplet) >= columns) {
+                Utils::error("Illegal bounds");
+            }
+            s.pointers[outer(std::get<0>(triplet), std::get<1>(triplet)) + 1]++;
+        }
+        for (unsigned i = 0; i < ret.outerSize(); i++) {
+            s.pointers[i + 1] += s.pointers[i];
+        }
+        std::vector<std::pair<unsigned, T>> entries(triplets.size());
+        std::vector<unsigned> next(s.pointers.begin(), s.pointers.end() - 1);
+        for (auto &triplet : triplets) {
+            unsigned row = std::get<0>(triplet), col = std::get<1>(triplet);
+            entries[next[outer(row, col)]++] = {inner(row, col), std::get<2>(triplet)};
+        }
+        std::vector<unsigned> pointers(1, 0);
+        for (unsigned i = 0; i < ret.outerSize(); i++) {
+            std::sort(entries.begin() + s.pointers[i], entries.begin() + s.pointers[i + 1],
+                      [](const std::pair<unsigned, T> &a, const std::pair<unsigned, T> &b) { return a.first < b.first; });
+            for (unsigned p = s.pointers[i]; p < s.pointers[i + 1]; p++) {
+                if (p > s.pointers[i] && entries[p].first == s.indices.back()) {
+                    s.values.back() += entries[p].second;
+                } else {
+                    s.indices.push_back(entries[p].first);
+                    s.values.push_back(entries[p].second);
+                }
+            }
+            pointers.push_back(s.indices.size());
+        }
+        s.pointers = std::move(pointers);
+        return ret;
+    }
+
+    /**
+     * @return the non-zero values of the given matrix, read a strip of rows at a time
+     */
+    static CompressedMatrixData<T, BY_ROWS> fromDense(const MatrixData<T> &matrix) {
+        std::vector<std::tuple<unsigned, unsigned, T>> triplets;
+        unsigned stripRows = Utils::rowsPerStrip(matrix.columns(), sizeof(T));
+        std::vector<T> strip((size_t) std::min(stripRows, matrix.rows()) * matrix.columns());
+        for (unsigned s = 0; s < matrix.rows(); s += stripRows) {
+            unsigned height = std::min(stripRows, matrix.rows() - s);
+            matrix.virtualMaterializeInto(strip.data(), matrix.columns(), s, 0, height, matrix.columns());
+            for (unsigned r = 0; r < height; r++) {
+                for (unsigned c = 0; c < matrix.columns(); c++) {
+                    T value = strip[(size_t) r * matrix.columns() + c];
+                    if (value != T(0)) {
+                        triplets.emplace_back(s + r, c, value);
+                    }
+                }
+            }
+        }
+        return fromTriplets(matrix.rows(), matrix.columns(), triplets);
+    }
+
+    /**
+     * @return the number of stored values
+     */
+    size_t nonZeros() const {
+        return this->storage->values.size();
+    }
+
+    /**
+     * @return the number of lines: rows for CSR, columns for CSC
+     */
+    unsigned outerSize() const {
+        return BY_ROWS ? this->rows() : this->columns();
+    }
+
+    /**
+     * @return the length of each line: columns for CSR, rows for CSC
+     */
+    unsigned innerSize() const {
+        return BY_ROWS ? this->columns() : this->rows();
+    }
+
+    const std::vector<unsigned> &getPointers() const {
+        return this->storage->pointers;
+    }
+
+    const std::vector<unsigned> &getIndices() const {
+        return this->storage->indices;
+    }
+
+    const std::vector<T> &getValues() const {
+        return this->storage->values;
+    }
+
+    /**
+     * @return the same matrix, compressed by rows
+     */
+    CompressedMatrixData<T, true> toCsr() const {
+        return this->template convert<true>();
+    }
+
+    /**
+     * @return the same matrix, compressed by columns
+     */
+    CompressedMatrixData<T, false> toCsc() const {
+        return this->template convert<false>();
+    }
+
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        for (unsigned r = 0; r < rows; r++) {
+            std::fill_n(destination + (size_t) r * destinationStride, columns, T(0));
+        }
+        this->virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        unsigned outerOffset = BY_ROWS ? rowOffset : colOffset, outerCount = BY_ROWS ? rows : columns;
+        unsigned innerOffset = BY_ROWS ? colOffset : rowOffset, innerCount = BY_ROWS ? columns : rows;
+        const CompressedStorage<T> &s = *this->storage;
+        for (unsigned i = 0; i < outerCount; i++) {
+            auto begin = s.indices.begin() + s.pointers[outerOffset + i], end = s.indices.begin() + s.pointers[outerOffset + i + 1];
+            for (auto it = std::lower_bound(begin, end, innerOffset); it < end && *it < innerOffset + innerCount; it++) {
+                unsigned j = *it - innerOffset;
+                T value = s.values[it - s.indices.begin()];
+                destination[BY_ROWS ? (size_t) i * destinationStride + j : (size_t) j * destinationStride + i] += value;
+            }
+        }
+    }
+
+    void set(unsigned row, unsigned col, T t) {
+        CompressedStorage<T> &s = *this->storage;
+        unsigned line = outer(row, col), position = inner(row, col);
+        auto begin = s.indices.begin() + s.pointers[line], end = s.indices.begin() + s.pointers[line + 1];
+        auto it = std::lower_bound(begin, end, position);
+        size_t p = it - s.indices.begin();
+        if (it < end && *it == position) {
+            s.values[p] = t;
+        } else if (t != T(0)) {
+            s.indices.insert(it, position);
+            s.values.insert(s.values.begin() + p, t);
+            for (unsigned i = line + 1; i < s.pointers.size(); i++) {
+                s.pointers[i]++;
+            }
+        }
+    }
+
+    CompressedMatrixData<T, BY_ROWS> copy() const {
+        return CompressedMatrixData<T, BY_ROWS>(this->rows(), this->columns(), std::make_shared<CompressedStorage<T>>(*this->storage));
+    }
+
+private:
+
+    static unsigned outer(unsigned row, unsigned col) {
+        return BY_ROWS ? row : col;
+    }
+
+    static unsigned inner(unsigned row, unsigned col) {
+        return BY_ROWS ? col : row;
+    }
+
+    /**
+     * Changes the compression, with a counting sort on the inner indices
+     */
+    template<bool OTHER>
+    typename std::enable_if<OTHER == BY_ROWS, CompressedMatrixData<T, OTHER>>::type convert() const {
+        return *this;
+    }
+
+    template<bool OTHER>
+    typename std::enable_if<OTHER != BY_ROWS, CompressedMatrixData<T, OTHER>>::type convert() const {
+        CompressedMatrixData<T, OTHER> ret(this->rows(), this->columns());
+        const CompressedStorage<T> &s = *this->storage;
+        CompressedStorage<T> &d = *ret.storage;
+        for (unsigned index : s.indices) {
+            d.pointers[index + 1]++;
+        }
+        for (unsigned i = 0; i < this->innerSize(); i++) {
+            d.pointers[i + 1] += d.pointers[i];
+        }
+        d.indices.resize(s.indices.size());
+        d.values.resize(s.values.size());
+        std::vector<unsigned> next(d.pointers.begin(), d.pointers.end() - 1);
+        //Visiting the lines in order, the new lines are already sorted
+        for (unsigned i = 0; i < this->outerSize(); i++) {
+            for (unsigned p = s.pointers[i]; p < s.pointers[i + 1]; p++) {
+                unsigned q = next[s.indices[p]]++;
+                d.indices[q] = i;
+                d.values[q] = s.values[p];
+            }
+        }
+        return ret;
+    }
+
+    T doGet(unsigned row, unsigned col) const {
+        const CompressedStorage<T> &s = *this->storage;
+        unsigned line = outer(row, col), position = inner(row, col);
+        auto begin = s.indices.begin() + s.pointers[line], end = s.indices.begin() + s.pointers[line + 1];
+        auto it = std::lower_bound(begin, end, position);
+        return it < end && *it == position ? s.values[it - s.indices.begin()] : T(0);
+    }
+};
+
+template<typename T>
+using CsrMatrixData = CompressedMatrixData<T, true>;
+
+template<typename T>
+using CscMatrixData = CompressedMatrixData<T, false>;
+
+/**
+ * Multiplications where at least one of the operands is sparse. Only the non-zero values are visited:
+ * sparse x dense and dense x sparse produce a dense <code>VectorMatrixData</code>, while sparse x sparse produces
+ * a <code>CsrMatrixData</code>, using Gustavson's algorithm.
+ * @tparam T type of the data
+ */
+template<typename T>
+class SparseMultiplication {
+public:
+
+    static bool isSparse(const MatrixData<T> *matrix) {
+        return dynamic_cast<const CsrMatrixData<T> *>(matrix) != nullptr || dynamic_cast<const CscMatrixData<T> *>(matrix) != nullptr;
+    }
+
+    /**
+     * @return the number of non-zero values of the given matrix, or all its cells if it is not sparse
+     */
+    static double nonZeros(const MatrixData<T> *matrix) {
+        if (auto csr = dynamic_cast<const CsrMatrixData<T> *>(matrix)) {
+            return csr->nonZeros();
+        } else if (auto csc = dynamic_cast<const CscMatrixData<T> *>(matrix)) {
+            return csc->nonZeros();
+        }
+        return (double) matrix->rows() * matrix->columns();
+    }
+
+    /**
+     * @return the product, or nullptr if neither of the operands is sparse
+     */
+    static std::unique_ptr<MatrixData<T>> multiply(const MatrixData<T> *left, const MatrixData<T> *right) {
+        auto leftCsr = dynamic_cast<const CsrMatrixData<T> *>(left);
+        auto leftCsc = dynamic_cast<const CscMatrixData<T> *>(left);
+        auto rightCsr = dynamic_cast<const CsrMatrixData<T> *>(right);
+        auto rightCsc = dynamic_cast<const CscMatrixData<T> *>(right);
+        bool leftSparse = leftCsr != nullptr || leftCsc != nullptr, rightSparse = rightCsr != nullptr || rightCsc != nullptr;
+        if (leftSparse && rightSparse) {
+            return std::make_unique<CsrMatrixData<T>>(sparseTimesSparse(leftCsr != nullptr ? *leftCsr : leftCsc->toCsr(),
+                                                                        rightCsr != nullptr ? *rightCsr : rightCsc->toCsr()));
+        } else if (!leftSparse && !rightSparse) {
+            return nullptr;
+        }
+        auto ret = std::make_unique<VectorMatrixData<T>>(left->rows(), right->columns());
+        if (leftSparse) {
+            VectorMatrixData<T> holder(0, 0);
+            const T *b = dense(right, holder);
+            if (leftCsr != nullptr) {
+                csrTimesDense(*leftCsr, b, right->columns(), ret->rawData());
+            } else {
+                cscTimesDense(*leftCsc, b, right->columns(), ret->rawData());
+            }
+        } else {
+            VectorMatrixData<T> holder(0, 0);
+            const T *a = dense(left, holder);
+            if (rightCsr != nullptr) {
+                denseTimesCsr(a, left->rows(), *rightCsr, ret->rawData());
+            } else {
+                denseTimesCsc(a, left->rows(), *rightCsc, ret->rawData());
+            }
+        }
+        return ret;
+    }
+
+private:
+
+    /**
+     * @return the row-major values of the given matrix, copying them in holder only if they are not already available
+     */
+    static const T *dense(const MatrixData<T> *matrix, VectorMatrixData<T> &holder) {
+        auto vector = dynamic_cast<const VectorMatrixData<T> *>(matrix);
+        if (vector != nullptr && vector->getLayout() == MatrixLayout::ROW_MAJOR) {
+            return vector->rawData();
+        }
+        holder = matrix->virtualMaterialize(0, 0, matrix->rows(), matrix->columns());
+        return static_cast<const VectorMatrixData<T> &>(holder).rawData();
+    }
+
+    /**
+     * C[i,:] += A[i,k] * B[k,:]. When B is a vector, each row of C is a dot product (SpMV).
+     */
+    static void csrTimesDense(const CsrMatrixData<T> &a, const T *b, unsigned n, T *c) {
+        auto &pointers = a.getPointers();
+        auto &indices = a.getIndices();
+        auto &values = a.getValues();
+        for (unsigned i = 0; i < a.rows(); i++) {
+            if (n == 1) {
+                T sum = 0;
+                for (unsigned p = pointers[i]; p < pointers[i + 1]; p++) {
+                    sum += values[p] * b[indices[p]];
+                }
+                c[i] = sum;
+                continue;
+            }
+            T *row = c + (size_t) i * n;
+            for (unsigned p = pointers[i]; p < pointers[i + 1]; p++) {
+                const T *other = b + (size_t) indices[p] * n;
+                T value = values[p];
+                for (unsigned j = 0; j < n; j++) {
+                    row[j] += value * other[j];
+                }
+            }
+        }
+    }
+
+    /**
+     * C[i,:] += A[i,k] * B[k,:], visiting A by columns
+     */
+    static void cscTimesDense(const CscMatrixData<T> &a, const T *b, unsigned n, T *c) {
+        auto &pointers = a.getPointers();
+        auto &indices = a.getIndices();
+        auto &values = a.getValues();
+        for (unsigned k = 0; k < a.columns(); k++) {
+            const T *other = b + (size_t) k * n;
+            for (unsigned p = pointers[k]; p < pointers[k + 1]; p++) {
+                T *row = c + (size_t) indices[p] * n;
+                T value = values[p];
+                for (unsigned j = 0; j < n; j++) {
+                    row[j] += value * other[j];
+                }
+            }
+        }
+    }
+
+    /**
+     * C[i,:] += A[i,k] * B[k,:], visiting only the non-zeros of the rows of B
+     */
+    static void denseTimesCsr(const T *a, unsigned m, const CsrMatrixData<T> &b, T *c) {
+        auto &pointers = b.getPointers();
+        auto &indices = b.getIndices();
+        auto &values = b.getValues();
+        unsigned inner = b.rows(), n = b.columns();
+        for (unsigned i = 0; i < m; i++) {
+            T *row = c + (size_t) i * n;
+            for (unsigned k = 0; k < inner; k++) {
+                T value = a[(size_t) i * inner + k];
+                if (value == T(0)) {
+                    continue;
+                }
+                for (unsigned p = pointers[k]; p < pointers[k + 1]; p++) {
+                    row[indices[p]] += value * values[p];
+                }
+            }
+        }
+    }
+
+    /**
+     * C[i,j] = A[i,:] . B[:,j], gathering from each row of A the values that match the non-zeros of the column of B.
+     * When A is a covector, this is a sparse matrix-vector product.
+     */
+    static void denseTimesCsc(const T *a, unsigned m, const CscMatrixData<T> &b, T *c) {
+        auto &pointers = b.getPointers();
+        auto &indices = b.getIndices();
+        auto &values = b.getValues();
+        unsigned inner = b.rows(), n = b.columns();
+        for (unsigned i = 0; i < m; i++) {
+            const T *row = a + (size_t) i * inner;
+            for (unsigned j = 0; j < n; j++) {
+                T sum = 0;
+                for (unsigned p = pointers[j]; p < pointers[j + 1]; p++) {
+                    sum += row[indices[p]] * values[p];
+                }
+                c[(size_t) i * n + j] = sum;
+            }
+        }
+    }
+
+    /**
+     * Gustavson's algorithm: each row of C is accumulated in a dense row, remembering which columns have been touched
+     */
+    static CsrMatrixData<T> sparseTimesSparse(const CsrMatrixData<T> &a, const CsrMatrixData<T> &b) {
+        std::vector<unsigned> pointers(1, 0), indices;
+        std::vector<T> values;
+        std::vector<T> accumulator(b.columns(), T(0));
+        std::vector<unsigned> lastRow(b.columns(), (unsigned) -1);
+        std::vector<unsigned> touched;
+        for (unsigned i = 0; i < a.rows(); i++) {
+            touched.clear();
+            for (unsigned p = a.getPointers()[i]; p < a.getPointers()[i + 1]; p++) {
+                unsigned k = a.getIndices()[p];
+                T value = a.getValues()[p];
+                for (unsigned q = b.getPointers()[k]; q < b.getPointers()[k + 1]; q++) {
+                    unsigned j = b.getIndices()[q];
+                    if (lastRow[j] != i) {
+                        lastRow[j] = i;
+                        accumulator[j] = T(0);
+                        touched.push_back(j);
+                    }
+                    accumulator[j] += value * b.getValues()[q];
+                }
+            }
+            std::sort(touched.begin(), touched.end());
+            for (unsigned j : touched) {
+                indices.push_back(j);
+                values.push_back(accumulator[j]);
+            }
+            pointers.push_back(indices.size());
+        }
+        return CsrMatrixData<T>(a.rows(), b.columns(), std::move(pointers), std::move(indices), std::move(values));
+    }
+};
+
+#endif //MATRIXTEMPLATE_SPARSEMATRIXDATA_H
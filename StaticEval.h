@@ -0,0 +1,483 @@
+#ifndef MATRIXTEMPLATE_STATICEVAL_H
+#define MATRIXTEMPLATE_STATICEVAL_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "MultipleMethod.h"
+#include "MappedMatrixData.h"
+#include "Sum.h"
+#include "Elementwise.h"
+
+/*
+ * Compile-time evaluation of the views.
+ *
+ * Matrix<T, MD> knows the whole type of its tree of views, so it can be turned into an accessor: a small value type
+ * whose operator()(row, col) is fully inlined, without virtual calls nor checks on the optimization.
+ * Views over dense storage collapse into a single StridedAccessor (e.g. the submatrix of a transposed matrix is just
+ * a pointer and two strides), while the other views compose the accessors of their children.
+ * Matrices that need to be computed (e.g. products) are optimized when the accessor is created, and then read with
+ * their get().
+ *
+ * Accessors do not own the data: they are valid while the matrix they have been created from is alive.
+ */
+
+/**
+ * Reads the cell (row, col) at data[row * rowStride + col * colStride]
+ * @tparam T type of the data
+ */
+template<typename T>
+class StridedAccessor {
+private:
+    const T *data;
+    std::ptrdiff_t rowStride, colStride;
+
+public:
+    typedef T Value;
+
+    StridedAccessor(const T *data, std::ptrdiff_t rowStride, std::ptrdiff_t colStride) :
+            data(data), rowStride(rowStride), colStride(colStride) {
+    }
+
+    T operator()(unsigned row, unsigned col) const {
+        return this->data[(std::ptrdiff_t) row * this->rowStride + (std::ptrdiff_t) col * this->colStride];
+    }
+
+    StridedAccessor<T> submatrix(unsigned rowOffset, unsigned colOffset) const {
+        return StridedAccessor<T>(this->data + (std::ptrdiff_t) rowOffset * this->rowStride + (std::ptrdiff_t) colOffset * this->colStride,
+                                  this->rowStride, this->colStride);
+    }
+
+    StridedAccessor<T> transpose() const {
+        return StridedAccessor<T>(this->data, this->colStride, this->rowStride);
+    }
+
+    /**
+     * @return the diagonal, as a column: moving to the next row moves along the diagonal
+     */
+    StridedAccessor<T> diagonal() const {
+        return StridedAccessor<T>(this->data, this->rowStride + this->colStride, 0);
+    }
+};
+
+template<class A>
+class OffsetAccessor {
+private:
+    A wrapped;
+    unsigned rowOffset, colOffset;
+
+public:
+    typedef typename A::Value Value;
+
+    OffsetAccessor(A wrapped, unsigned rowOffset, unsigned colOffset) : wrapped(wrapped), rowOffset(rowOffset), colOffset(colOffset) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->wrapped(row + this->rowOffset, col + this->colOffset);
+    }
+
+    OffsetAccessor<A> submatrix(unsigned rowOffset, unsigned colOffset) const {
+        return OffsetAccessor<A>(this->wrapped, this->rowOffset + rowOffset, this->colOffset + colOffset);
+    }
+};
+
+template<class A>
+class TransposedAccessor {
+private:
+    A wrapped;
+
+public:
+    typedef typename A::Value Value;
+
+    explicit TransposedAccessor(A wrapped) : wrapped(wrapped) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->wrapped(col, row);
+    }
+
+    /**
+     * @return the accessor that has been transposed
+     */
+    const A &transpose() const {
+        return this->wrapped;
+    }
+};
+
+template<class A>
+class DiagonalAccessor {
+private:
+    A wrapped;
+
+public:
+    typedef typename A::Value Value;
+
+    explicit DiagonalAccessor(A wrapped) : wrapped(wrapped) {
+    }
+
+    Value operator()(unsigned row, unsigned) const {
+        return this->wrapped(row, row);
+    }
+};
+
+template<class A>
+class DiagonalMatrixAccessor {
+private:
+    A wrapped;
+
+public:
+    typedef typename A::Value Value;
+
+    explicit DiagonalMatrixAccessor(A wrapped) : wrapped(wrapped) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return row == col ? this->wrapped(row, 0) : Value(0);
+    }
+};
+
+template<class A>
+class ResizerAccessor {
+private:
+    A wrapped;
+    unsigned rows, columns;
+
+public:
+    typedef typename A::Value Value;
+
+    ResizerAccessor(A wrapped, unsigned rows, unsigned columns) : wrapped(wrapped), rows(rows), columns(columns) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return row < this->rows && col < this->columns ? this->wrapped(row, col) : Value(0);
+    }
+};
+
+template<class A1, class A2>
+class SumAccessor {
+private:
+    A1 left;
+    A2 right;
+
+public:
+    typedef typename A1::Value Value;
+
+    SumAccessor(A1 left, A2 right) : left(left), right(right) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->left(row, col) + this->right(row, col);
+    }
+};
+
+template<typename T, class A>
+class CastAccessor {
+private:
+    A wrapped;
+
+public:
+    typedef T Value;
+
+    explicit CastAccessor(A wrapped) : wrapped(wrapped) {
+    }
+
+    T operator()(unsigned row, unsigned col) const {
+        return (T) this->wrapped(row, col);
+    }
+};
+
+template<class A>
+class MultiSumAccessor {
+private:
+    std::vector<A> wrapped;
+
+public:
+    typedef typename A::Value Value;
+
+    explicit MultiSumAccessor(std::vector<A> wrapped) : wrapped(std::move(wrapped)) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        Value sum = this->wrapped[0](row, col);
+        for (size_t i = 1; i < this->wrapped.size(); i++) {
+            sum += this->wrapped[i](row, col);
+        }
+        return sum;
+    }
+};
+
+template<class A, class Op>
+class MapAccessor {
+private:
+    A wrapped;
+    Op op;
+
+public:
+    typedef typename A::Value Value;
+
+    MapAccessor(A wrapped, Op op) : wrapped(wrapped), op(op) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->op(this->wrapped(row, col));
+    }
+};
+
+template<class A1, class A2, class Op>
+class ZipAccessor {
+private:
+    A1 left;
+    A2 right;
+    Op op;
+
+public:
+    typedef typename A1::Value Value;
+
+    ZipAccessor(A1 left, A2 right, Op op) : left(left), right(right), op(op) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->op(this->left(row, col), this->right(row, col));
+    }
+};
+
+template<class A1, class A2, class A3>
+class SelectAccessor {
+private:
+    A1 condition;
+    A2 ifTrue;
+    A3 ifFalse;
+
+public:
+    typedef typename A2::Value Value;
+
+    SelectAccessor(A1 condition, A2 ifTrue, A3 ifFalse) : condition(condition), ifTrue(ifTrue), ifFalse(ifFalse) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        return this->condition(row, col) != 0 ? this->ifTrue(row, col) : this->ifFalse(row, col);
+    }
+};
+
+template<class A>
+class ConcatenationAccessor {
+private:
+    std::vector<A> blocks;
+    unsigned rowsOfBlocks, columnsOfBlocks, numberOfColumnBlocks;
+
+public:
+    typedef typename A::Value Value;
+
+    ConcatenationAccessor(std::vector<A> blocks, unsigned rowsOfBlocks, unsigned columnsOfBlocks, unsigned numberOfColumnBlocks) :
+            blocks(std::move(blocks)), rowsOfBlocks(rowsOfBlocks), columnsOfBlocks(columnsOfBlocks),
+            numberOfColumnBlocks(numberOfColumnBlocks) {
+    }
+
+    Value operator()(unsigned row, unsigned col) const {
+        unsigned blockRow = row / this->rowsOfBlocks, blockCol = col / this->columnsOfBlocks;
+        return this->blocks[blockRow * this->numberOfColumnBlocks + blockCol](row - blockRow * this->rowsOfBlocks,
+                                                                              col - blockCol * this->columnsOfBlocks);
+    }
+};
+
+/**
+ * Reads a matrix that has no static evaluation through its get()
+ */
+template<typename T, class MD>
+class GetAccessor {
+private:
+    const MD *matrix;
+
+public:
+    typedef T Value;
+
+    explicit GetAccessor(const MD &matrix) : matrix(&matrix) {
+    }
+
+    T operator()(unsigned row, unsigned col) const {
+        return this->matrix->get(row, col);
+    }
+};
+
+/**
+ * Composition of the accessors, simplifying them when possible
+ */
+class Accessors {
+public:
+    template<class A>
+    static OffsetAccessor<A> submatrix(const A &a, unsigned rowOffset, unsigned colOffset) {
+        return OffsetAccessor<A>(a, rowOffset, colOffset);
+    }
+
+    template<class A>
+    static OffsetAccessor<A> submatrix(const OffsetAccessor<A> &a, unsigned rowOffset, unsigned colOffset) {
+        return a.submatrix(rowOffset, colOffset);
+    }
+
+    template<typename T>
+    static StridedAccessor<T> submatrix(const StridedAccessor<T> &a, unsigned rowOffset, unsigned colOffset) {
+        return a.submatrix(rowOffset, colOffset);
+    }
+
+    template<class A>
+    static TransposedAccessor<A> transpose(const A &a) {
+        return TransposedAccessor<A>(a);
+    }
+
+    template<class A>
+    static A transpose(const TransposedAccessor<A> &a) {
+        return a.transpose();
+    }
+
+    template<typename T>
+    static StridedAccessor<T> transpose(const StridedAccessor<T> &a) {
+        return a.transpose();
+    }
+
+    template<class A>
+    static DiagonalAccessor<A> diagonal(const A &a) {
+        return DiagonalAccessor<A>(a);
+    }
+
+    template<typename T>
+    static StridedAccessor<T> diagonal(const StridedAccessor<T> &a) {
+        return a.diagonal();
+    }
+};
+
+/**
+ * Creates the accessor of a <code>MatrixData</code>. The generic version is used by the matrices that need to be
+ * computed: they are optimized now, so that reading them later does not start any computation.
+ * @tparam T type of the data
+ * @tparam MD type of the MatrixData
+ */
+template<typename T, class MD>
+struct StaticAccessor {
+    static GetAccessor<T, MD> create(const MD &matrix) {
+        matrix.virtualOptimize();
+        return GetAccessor<T, MD>(matrix);
+    }
+};
+
+template<typename T>
+struct StaticAccessor<T, VectorMatrixData<T>> {
+    static StridedAccessor<T> create(const VectorMatrixData<T> &matrix) {
+        return StridedAccessor<T>(matrix.rawData(), matrix.getRowStride(), matrix.getColStride());
+    }
+};
+
+template<typename T>
+struct StaticAccessor<T, MappedMatrixData<T>> {
+    static StridedAccessor<T> create(const MappedMatrixData<T> &matrix) {
+        return StridedAccessor<T>(matrix.rawData(), matrix.columns(), 1);
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, SubmatrixMD<T, MD>> {
+    static auto create(const SubmatrixMD<T, MD> &matrix) {
+        return Accessors::submatrix(StaticAccessor<T, MD>::create(matrix.getWrapped()), matrix.getRowOffset(), matrix.getColOffset());
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, TransposedMD<T, MD>> {
+    static auto create(const TransposedMD<T, MD> &matrix) {
+        return Accessors::transpose(StaticAccessor<T, MD>::create(matrix.getWrapped()));
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, DiagonalMD<T, MD>> {
+    static auto create(const DiagonalMD<T, MD> &matrix) {
+        return Accessors::diagonal(StaticAccessor<T, MD>::create(matrix.getWrapped()));
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, DiagonalMatrixMD<T, MD>> {
+    static auto create(const DiagonalMatrixMD<T, MD> &matrix) {
+        auto wrapped = StaticAccessor<T, MD>::create(matrix.getWrapped());
+        return DiagonalMatrixAccessor<decltype(wrapped)>(wrapped);
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, ResizerMD<T, MD>> {
+    static auto create(const ResizerMD<T, MD> &matrix) {
+        auto wrapped = StaticAccessor<T, MD>::create(matrix.getWrapped());
+        return ResizerAccessor<decltype(wrapped)>(wrapped, matrix.getWrapped().rows(), matrix.getWrapped().columns());
+    }
+};
+
+template<typename T, class MD1, class MD2>
+struct StaticAccessor<T, Sum<T, MD1, MD2>> {
+    static auto create(const Sum<T, MD1, MD2> &matrix) {
+        auto left = StaticAccessor<T, MD1>::create(matrix.getLeft());
+        auto right = StaticAccessor<T, MD2>::create(matrix.getRight());
+        return SumAccessor<decltype(left), decltype(right)>(left, right);
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, MatrixCaster<T, MD>> {
+    static auto create(const MatrixCaster<T, MD> &matrix) {
+        //The wrapped matrix has another type of data
+        typedef decltype(matrix.getWrapped().get(0, 0)) U;
+        auto wrapped = StaticAccessor<U, MD>::create(matrix.getWrapped());
+        return CastAccessor<T, decltype(wrapped)>(wrapped);
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, MultiSum<T, MD>> {
+    static auto create(const MultiSum<T, MD> &matrix) {
+        typedef decltype(StaticAccessor<T, MD>::create(matrix.getWrapped()[0])) A;
+        std::vector<A> wrapped;
+        for (auto &m : matrix.getWrapped()) {
+            wrapped.push_back(StaticAccessor<T, MD>::create(m));
+        }
+        return MultiSumAccessor<A>(wrapped);
+    }
+};
+
+template<typename T, class MD>
+struct StaticAccessor<T, ConcatenationMD<T, MD>> {
+    static auto create(const ConcatenationMD<T, MD> &matrix) {
+        typedef decltype(StaticAccessor<T, MD>::create(matrix.getWrapped()[0])) A;
+        std::vector<A> blocks;
+        for (auto &block : matrix.getWrapped()) {
+            blocks.push_back(StaticAccessor<T, MD>::create(block));
+        }
+        return ConcatenationAccessor<A>(blocks, matrix.getRowsOfBlocks(), matrix.getColumnsOfBlocks(), matrix.getNumberOfColumnBlocks());
+    }
+};
+
+template<typename T, class MD, class Op>
+struct StaticAccessor<T, MapMD<T, MD, Op>> {
+    static auto create(const MapMD<T, MD, Op> &matrix) {
+        auto wrapped = StaticAccessor<T, MD>::create(matrix.getWrapped());
+        return MapAccessor<decltype(wrapped), Op>(wrapped, matrix.getOperation());
+    }
+};
+
+template<typename T, class MD1, class MD2, class Op>
+struct StaticAccessor<T, ZipMD<T, MD1, MD2, Op>> {
+    static auto create(const ZipMD<T, MD1, MD2, Op> &matrix) {
+        auto left = StaticAccessor<T, MD1>::create(matrix.getLeft());
+        auto right = StaticAccessor<T, MD2>::create(matrix.getRight());
+        return ZipAccessor<decltype(left), decltype(right), Op>(left, right, matrix.getOperation());
+    }
+};
+
+template<typename T, class MD1, class MD2, class MD3>
+struct StaticAccessor<T, SelectMD<T, MD1, MD2, MD3>> {
+    static auto create(const SelectMD<T, MD1, MD2, MD3> &matrix) {
+        auto condition = StaticAccessor<T, MD1>::create(matrix.getCondition());
+        auto ifTrue = StaticAccessor<T, MD2>::create(matrix.getIfTrue());
+        auto ifFalse = StaticAccessor<T, MD3>::create(matrix.getIfFalse());
+        return SelectAccessor<decltype(condition), decltype(ifTrue), decltype(ifFalse)>(condition, ifTrue, ifFalse);
+    }
+};
+
+#endif //MATRIXTEMPLATE_STATICEVAL_H
@@ -18,7 +18,28 @@ public:
         }
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    /**
+     * Fused evaluation: each strip of rows is written by the left operand and accumulated by the right one while it
+     * is still in cache. Nested sums accumulate their own operands directly, without temporaries.
+     */
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+        for (unsigned s = 0; s < rows; s += stripRows) {
+            unsigned height = std::min(stripRows, rows - s);
+            T *strip = destination + (size_t) s * destinationStride;
+            this->left.virtualMaterializeInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+            this->right.virtualAccumulateInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+        }
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        this->left.virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+        this->right.virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+    }
 
             Sum<T, MD1, MD2> copy() const {
         return Sum<T, MD1, MD2>(this->left.copy(), this->right.copy());
@@ -46,7 +67,27 @@ public:
         }
     }
 
-    MATERIALIZE_IMPL
+    MATERIALIZE_COMMON_IMPL
+
+    void virtualMaterializeInto(T *destination, unsigned destinationStride,
+                                unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        unsigned stripRows = Utils::rowsPerStrip(columns, sizeof(T));
+        for (unsigned s = 0; s < rows; s += stripRows) {
+            unsigned height = std::min(stripRows, rows - s);
+            T *strip = destination + (size_t) s * destinationStride;
+            this->wrapped[0].virtualMaterializeInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+            for (auto it = this->wrapped.begin() + 1; it < this->wrapped.end(); it++) {
+                it->virtualAccumulateInto(strip, destinationStride, rowOffset + s, colOffset, height, columns);
+            }
+        }
+    }
+
+    void virtualAccumulateInto(T *destination, unsigned destinationStride,
+                               unsigned rowOffset, unsigned colOffset, unsigned rows, unsigned columns) const override {
+        for (auto it = this->wrapped.begin(); it < this->wrapped.end(); it++) {
+            it->virtualAccumulateInto(destination, destinationStride, rowOffset, colOffset, rows, columns);
+        }
+    }
 
             MultiSum<T, MD> copy() const {
         return MultiSum<T, MD>(this->copyWrapped());
@@ -0,0 +1,352 @@
+#ifndef MATRIXTEMPLATE_THREADPOOL_H
+#define MATRIXTEMPLATE_THREADPOOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Bounded work-stealing executor shared by every <code>OptimizableMD</code>.
+ *
+ * Each worker owns a deque: tasks submitted by a worker are pushed on the back of its own deque and executed LIFO,
+ * while idle workers steal from the front of the deques of the others. Tasks submitted from outside of the pool
+ * are distributed round-robin.
+ *
+ * Waiting for a task never blocks a worker: <code>wait()</code> keeps executing queued tasks (the ones just
+ * submitted by the waiting task first) until the awaited one is done. This way a task can depend on tasks that
+ * are submitted after it without deadlocks and without creating new threads, whatever the number of workers.
+ * <code>parallelFor()</code> is the exception: it waits only for ranges of its own loop that are already running.
+ */
+class ThreadPool {
+public:
+    typedef std::function<void()> Task;
+
+private:
+    static const unsigned NOT_A_WORKER = (unsigned) -1;
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::mutex sleepMutex;
+    std::condition_variable sleepCondition;
+    std::atomic<unsigned> queued{0};
+    std::atomic<unsigned> nextWorker{0};
+    bool stopping = false;
+
+public:
+
+    explicit ThreadPool(unsigned numberOfWorkers) {
+        if (numberOfWorkers == 0) {
+            numberOfWorkers = 1;
+        }
+        for (unsigned i = 0; i < numberOfWorkers; i++) {
+            this->workers.push_back(std::make_unique<Worker>());
+        }
+        for (unsigned i = 0; i < numberOfWorkers; i++) {
+            this->threads.emplace_back([this, i] { this->workerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+
+    ~ThreadPool() {
+        {
+            std::unique_lock<std::mutex> lock(this->sleepMutex);
+            this->stopping = true;
+        }
+        this->sleepCondition.notify_all();
+        for (auto &thread : this->threads) {
+            thread.join();
+        }
+    }
+
+    /**
+     * @return the pool used by the library. It is created on first use, with <code>setDefaultWorkers()</code> workers.
+     */
+    static ThreadPool &shared() {
+        static ThreadPool pool(defaultWorkers());
+        return pool;
+    }
+
+    /**
+     * Sets the number of workers of the shared pool. It has no effect once the shared pool has been used.
+     * When not set, the environment variable MATRIX_THREADS is used, or the number of hardware threads.
+     */
+    static void setDefaultWorkers(unsigned numberOfWorkers) {
+        configuredWorkers() = numberOfWorkers;
+    }
+
+    static unsigned defaultWorkers() {
+        if (configuredWorkers() != 0) {
+            return configuredWorkers();
+        }
+        const char *env = std::getenv("MATRIX_THREADS");
+        if (env != nullptr && std::atoi(env) > 0) {
+            return (unsigned) std::atoi(env);
+        }
+        return std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    /**
+     * @return the number of workers
+     */
+    unsigned size() const {
+        return this->workers.size();
+    }
+
+    /**
+     * Queues the given task
+     */
+    void submit(Task task) {
+        unsigned index = currentWorker();
+        if (currentPool() != this || index == NOT_A_WORKER) {
+            index = this->nextWorker++ % this->workers.size();
+        }
+        this->queued++;
+        {
+            std::unique_lock<std::mutex> lock(this->workers[index]->mutex);
+            this->workers[index]->tasks.push_back(std::move(task));
+        }
+        //Taking the lock, so that a worker cannot miss the notification between its check and its wait
+        { std::unique_lock<std::mutex> lock(this->sleepMutex); }
+        this->sleepCondition.notify_one();
+    }
+
+    /**
+     * Queues the given function
+     * @return the future holding its result
+     */
+    template<class F>
+    std::shared_future<decltype(std::declval<F>()())> async(F function) {
+        typedef decltype(function()) R;
+        auto task = std::make_shared<std::packaged_task<R()>>(std::move(function));
+        std::shared_future<R> future = task->get_future().share();
+        this->submit([task] { (*task)(); });
+        return future;
+    }
+
+    /**
+     * Waits until the given future is ready, executing other tasks in the meantime
+     */
+    template<typename R>
+    void wait(const std::shared_future<R> &future) {
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            if (!this->runQueuedTask()) {
+                //Nothing to help with: the awaited task is running on another thread
+                future.wait_for(std::chrono::microseconds(200));
+            }
+        }
+    }
+
+    /**
+     * Sets the minimum amount of work that <code>parallelFor()</code> gives to each task. Smaller loops are executed
+     * by the calling thread alone.
+     */
+    static void setParallelThreshold(size_t work) {
+        configuredThreshold() = std::max<size_t>(1, work);
+    }
+
+    static size_t parallelThreshold() {
+        return configuredThreshold();
+    }
+
+    /**
+     * Calls body(first, last) on disjoint ranges covering [begin, end), in parallel when the total work is large
+     * enough, and returns once all of them are done.
+     * The ranges are claimed one at a time by the calling thread and by the tasks submitted to help it, so the calling
+     * thread never executes unrelated tasks: it only waits for the ranges that are already running on other threads.
+     * Running an unrelated task here could deadlock, if that task waited for the result of the caller.
+     * @param workPerItem estimated cost of each index, e.g. the number of cells of a row
+     */
+    template<class F>
+    void parallelFor(unsigned begin, unsigned end, size_t workPerItem, F body) {
+        if (begin >= end) {
+            return;
+        }
+        size_t items = end - begin;
+        size_t work = items * std::max<size_t>(1, workPerItem);
+        size_t tasks = std::min<size_t>({items, work / parallelThreshold(), (size_t) this->size() * 4});
+        if (tasks <= 1 || this->size() == 1) {
+            body(begin, end);
+            return;
+        }
+        auto loop = std::make_shared<ParallelLoop>();
+        //body is used only by the ranges that have been claimed, and they are all finished before leaving
+        auto runRanges = [loop, &body, begin, items, tasks] {
+            size_t t;
+            while ((t = loop->next++) < tasks) {
+                try {
+                    body(begin + (unsigned) (items * t / tasks), begin + (unsigned) (items * (t + 1) / tasks));
+                } catch (...) {
+                    std::unique_lock<std::mutex> lock(loop->mutex);
+                    if (!loop->error) {
+                        loop->error = std::current_exception();
+                    }
+                }
+                std::unique_lock<std::mutex> lock(loop->mutex);
+                if (++loop->finished == tasks) {
+                    loop->condition.notify_all();
+                }
+            }
+        };
+        for (size_t t = 1; t < tasks; t++) {
+            this->submit(runRanges);
+        }
+        runRanges();
+        std::unique_lock<std::mutex> lock(loop->mutex);
+        loop->condition.wait(lock, [loop, tasks] { return loop->finished == tasks; });
+        if (loop->error) {
+            std::rethrow_exception(loop->error);
+        }
+    }
+
+    /**
+     * Executes one of the queued tasks on the calling thread, if any
+     * @return true if a task has been executed
+     */
+    bool runQueuedTask() {
+        Task task;
+        unsigned index = currentPool() == this ? currentWorker() : NOT_A_WORKER;
+        if (this->popOrSteal(index, task)) {
+            task();
+            return true;
+        }
+        return false;
+    }
+
+private:
+
+    /**
+     * State shared by the tasks executing the ranges of a <code>parallelFor()</code>
+     */
+    struct ParallelLoop {
+        std::atomic<size_t> next{0};
+        std::mutex mutex;
+        std::condition_variable condition;
+        size_t finished = 0;
+        std::exception_ptr error;
+    };
+
+    static unsigned &configuredWorkers() {
+        static unsigned workers = 0;
+        return workers;
+    }
+
+    static size_t &configuredThreshold() {
+        //Enough to hide the cost of queuing a task
+        static size_t threshold = 1 << 15;
+        return threshold;
+    }
+
+    static ThreadPool *&currentPool() {
+        static thread_local ThreadPool *pool = nullptr;
+        return pool;
+    }
+
+    static unsigned &currentWorker() {
+        static thread_local unsigned worker = NOT_A_WORKER;
+        return worker;
+    }
+
+    /**
+     * Takes the newest task of the given worker, or steals the oldest task of another worker
+     */
+    bool popOrSteal(unsigned index, Task &task) {
+        if (this->queued == 0) {
+            return false;
+        }
+        if (index != NOT_A_WORKER) {
+            Worker &own = *this->workers[index];
+            std::unique_lock<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                this->queued--;
+                return true;
+            }
+        }
+        unsigned n = this->workers.size();
+        unsigned start = index == NOT_A_WORKER ? 0 : index + 1;
+        for (unsigned i = 0; i < n; i++) {
+            Worker &victim = *this->workers[(start + i) % n];
+            std::unique_lock<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                this->queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(unsigned index) {
+        currentPool() = this;
+        currentWorker() = index;
+        while (true) {
+            Task task;
+            if (this->popOrSteal(index, task)) {
+                task();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(this->sleepMutex);
+            this->sleepCondition.wait(lock, [this] { return this->stopping || this->queued > 0; });
+            if (this->stopping) {
+                return;
+            }
+        }
+    }
+};
+
+/**
+ * Event that is signalled only once.
+ * The callbacks registered before the signal are called by <code>signal()</code>, the ones registered afterwards are
+ * called immediately. Callbacks are expected to be short (e.g. submitting a task to the pool).
+ */
+class CompletionEvent {
+private:
+    std::mutex mutex;
+    bool done = false;
+    std::vector<std::function<void()>> callbacks;
+
+public:
+
+    void whenDone(std::function<void()> callback) {
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            if (!this->done) {
+                this->callbacks.push_back(std::move(callback));
+                return;
+            }
+        }
+        callback();
+    }
+
+    void signal() {
+        std::vector<std::function<void()>> toCall;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->done = true;
+            toCall.swap(this->callbacks);
+        }
+        for (auto &callback : toCall) {
+            callback();
+        }
+    }
+};
+
+#endif //MATRIXTEMPLATE_THREADPOOL_H
@@ -0,0 +1,204 @@
+#ifndef MATRIXTEMPLATE_TRANSPOSE_H
+#define MATRIXTEMPLATE_TRANSPOSE_H
+
+#include <cstddef>
+#include <algorithm>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/**
+ * Transposes a square block of SIZE x SIZE values held in registers.
+ * The generic version has SIZE = 1, i.e. there is no register kernel and the tiles are transposed value by value.
+ * @tparam T type of the data
+ */
+template<typename T>
+struct TransposeKernel {
+    static const unsigned SIZE = 1;
+
+    static void transpose(const T *source, size_t, T *destination, size_t) {
+        *destination = *source;
+    }
+};
+
+#if defined(__AVX__)
+
+template<>
+struct TransposeKernel<float> {
+    static const unsigned SIZE = 8;
+
+    static void transpose(const float *source, size_t sourceStride, float *destination, size_t destinationStride) {
+        __m256 r0 = _mm256_loadu_ps(source);
+        __m256 r1 = _mm256_loadu_ps(source + sourceStride);
+        __m256 r2 = _mm256_loadu_ps(source + 2 * sourceStride);
+        __m256 r3 = _mm256_loadu_ps(source + 3 * sourceStride);
+        __m256 r4 = _mm256_loadu_ps(source + 4 * sourceStride);
+        __m256 r5 = _mm256_loadu_ps(source + 5 * sourceStride);
+        __m256 r6 = _mm256_loadu_ps(source + 6 * sourceStride);
+        __m256 r7 = _mm256_loadu_ps(source + 7 * sourceStride);
+        //Interleaves pairs of rows, then pairs of pairs, then swaps the 128 bit halves
+        __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+        __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+        __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+        __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+        __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+        __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+        __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+        __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+        r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+        r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+        r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+        r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+        r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+        r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+        r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+        _mm256_storeu_ps(destination, _mm256_permute2f128_ps(r0, r4, 0x20));
+        _mm256_storeu_ps(destination + destinationStride, _mm256_permute2f128_ps(r1, r5, 0x20));
+        _mm256_storeu_ps(destination + 2 * destinationStride, _mm256_permute2f128_ps(r2, r6, 0x20));
+        _mm256_storeu_ps(destination + 3 * destinationStride, _mm256_permute2f128_ps(r3, r7, 0x20));
+        _mm256_storeu_ps(destination + 4 * destinationStride, _mm256_permute2f128_ps(r0, r4, 0x31));
+        _mm256_storeu_ps(destination + 5 * destinationStride, _mm256_permute2f128_ps(r1, r5, 0x31));
+        _mm256_storeu_ps(destination + 6 * destinationStride, _mm256_permute2f128_ps(r2, r6, 0x31));
+        _mm256_storeu_ps(destination + 7 * destinationStride, _mm256_permute2f128_ps(r3, r7, 0x31));
+    }
+};
+
+template<>
+struct TransposeKernel<double> {
+    static const unsigned SIZE = 4;
+
+    static void transpose(const double *source, size_t sourceStride, double *destination, size_t destinationStride) {
+        __m256d r0 = _mm256_loadu_pd(source);
+        __m256d r1 = _mm256_loadu_pd(source + sourceStride);
+        __m256d r2 = _mm256_loadu_pd(source + 2 * sourceStride);
+        __m256d r3 = _mm256_loadu_pd(source + 3 * sourceStride);
+        __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+        __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+        __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+        __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+        _mm256_storeu_pd(destination, _mm256_permute2f128_pd(t0, t2, 0x20));
+        _mm256_storeu_pd(destination + destinationStride, _mm256_permute2f128_pd(t1, t3, 0x20));
+        _mm256_storeu_pd(destination + 2 * destinationStride, _mm256_permute2f128_pd(t0, t2, 0x31));
+        _mm256_storeu_pd(destination + 3 * destinationStride, _mm256_permute2f128_pd(t1, t3, 0x31));
+    }
+};
+
+//int has the same size of float, and moving values does not care about their meaning
+template<>
+struct TransposeKernel<int> {
+    static const unsigned SIZE = 8;
+
+    static void transpose(const int *source, size_t sourceStride, int *destination, size_t destinationStride) {
+        TransposeKernel<float>::transpose(reinterpret_cast<const float *>(source), sourceStride,
+                                          reinterpret_cast<float *>(destination), destinationStride);
+    }
+};
+
+#endif
+
+/**
+ * Cache-oblivious transposition of row-major buffers: the matrix is split recursively along its longest side, so
+ * that at some level of the recursion both the block being read and the one being written fit in each level of
+ * the cache, whatever its size. The leaves are tiles of at most TILE x TILE values, transposed with
+ * <code>TransposeKernel</code> when the registers allow it.
+ * @tparam T type of the data
+ */
+template<typename T>
+class Transpose {
+public:
+    static const unsigned TILE = 32;
+
+    /**
+     * Writes the transposed of the rows x columns block at source into destination (columns x rows).
+     * The two blocks must not overlap.
+     */
+    static void transpose(const T *source, size_t sourceStride, T *destination, size_t destinationStride,
+                          unsigned rows, unsigned columns) {
+        if (rows <= TILE && columns <= TILE) {
+            transposeTile(source, sourceStride, destination, destinationStride, rows, columns);
+        } else if (rows >= columns) {
+            unsigned half = split(rows);
+            transpose(source, sourceStride, destination, destinationStride, half, columns);
+            transpose(source + half * sourceStride, sourceStride, destination + half, destinationStride, rows - half, columns);
+        } else {
+            unsigned half = split(columns);
+            transpose(source, sourceStride, destination, destinationStride, rows, half);
+            transpose(source + half, sourceStride, destination + half * destinationStride, destinationStride, rows, columns - half);
+        }
+    }
+
+    /**
+     * Transposes in place the size x size block at data: the diagonal blocks are transposed recursively, and the
+     * blocks in opposite positions are swapped while transposing them.
+     */
+    static void transposeInPlace(T *data, size_t stride, unsigned size) {
+        if (size <= TILE) {
+            T buffer[TILE * TILE];
+            transposeTile(data, stride, buffer, size, size, size);
+            for (unsigned r = 0; r < size; r++) {
+                std::copy_n(buffer + (size_t) r * size, size, data + r * stride);
+            }
+            return;
+        }
+        unsigned half = split(size);
+        transposeInPlace(data, stride, half);
+        transposeInPlace(data + half * stride + half, stride, size - half);
+        swapTransposed(data + half, data + half * stride, stride, half, size - half);
+    }
+
+private:
+
+    /**
+     * Splits a side in two, keeping the first half a multiple of the register kernel when possible
+     */
+    static unsigned split(unsigned size) {
+        unsigned half = size / 2;
+        unsigned rounded = half / TransposeKernel<T>::SIZE * TransposeKernel<T>::SIZE;
+        return rounded > 0 ? rounded : half;
+    }
+
+    static void transposeTile(const T *source, size_t sourceStride, T *destination, size_t destinationStride,
+                              unsigned rows, unsigned columns) {
+        const unsigned K = TransposeKernel<T>::SIZE;
+        unsigned fullRows = rows / K * K;
+        unsigned fullColumns = columns / K * K;
+        for (unsigned r = 0; r < fullRows; r += K) {
+            for (unsigned c = 0; c < fullColumns; c += K) {
+                TransposeKernel<T>::transpose(source + r * sourceStride + c, sourceStride,
+                                              destination + c * destinationStride + r, destinationStride);
+            }
+        }
+        //Borders that do not fill a whole kernel
+        for (unsigned r = 0; r < rows; r++) {
+            for (unsigned c = r < fullRows ? fullColumns : 0; c < columns; c++) {
+                destination[c * destinationStride + r] = source[r * sourceStride + c];
+            }
+        }
+    }
+
+    /**
+     * Replaces the rows x columns block a with the transposed of the columns x rows block b, and vice versa
+     */
+    static void swapTransposed(T *a, T *b, size_t stride, unsigned rows, unsigned columns) {
+        if (rows <= TILE && columns <= TILE) {
+            T buffer[TILE * TILE];
+            transposeTile(a, stride, buffer, rows, rows, columns);
+            transposeTile(b, stride, a, stride, columns, rows);
+            for (unsigned r = 0; r < columns; r++) {
+                std::copy_n(buffer + (size_t) r * rows, rows, b + r * stride);
+            }
+        } else if (rows >= columns) {
+            unsigned half = split(rows);
+            swapTransposed(a, b, stride, half, columns);
+            swapTransposed(a + half * stride, b + half, stride, rows - half, columns);
+        } else {
+            unsigned half = split(columns);
+            swapTransposed(a, b, stride, rows, half);
+            swapTransposed(a + half, b + half * stride, stride, rows, columns - half);
+        }
+    }
+};
+
+#endif //MATRIXTEMPLATE_TRANSPOSE_H
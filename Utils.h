@@ -7,6 +7,7 @@
 
 #include <string>
 #include <iostream>
+#include <algorithm>
 
 class Utils {
 public :
@@ -19,5 +20,13 @@ public :
         return 1 + ((a - 1) / b);
     }
 
+    /**
+     * @return how many rows of the given size fit in a strip that stays in the L1 cache (at least 1)
+     */
+    static unsigned rowsPerStrip(unsigned columns, size_t elementSize) {
+        size_t rowSize = (size_t) columns * elementSize;
+        return rowSize == 0 ? 1 : (unsigned) std::max<size_t>(1, 16 * 1024 / rowSize);
+    }
+
 };
 #endif //MATRIXTEMPLATE_UTILS_H
@@ -0,0 +1,452 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "Matrix.h"
+
+/*
+ * Benchmarks of the operations of the library, in the style of Google Benchmark.
+ *
+ * Usage: MatrixBenchmark [--filter=substring] [--min-time=seconds] [--json=file]
+ *
+ * Each benchmark is repeated, doubling the number of iterations, until it runs for at least min-time seconds.
+ * For each one the time per iteration, the throughput (GFLOP/s for the products, GB/s of values produced for the
+ * rest), the heap allocations per iteration and the matrix buffers (which don't go through operator new, see
+ * MatrixBufferPool) are reported: buffers requested per iteration, how many were recycled, and the peak of the bytes
+ * they used above the ones in use at the start. The JSON output can be compared between two builds.
+ */
+
+//Every heap allocation of the process goes through these counters
+static std::atomic<unsigned long long> allocationCount{0};
+static std::atomic<unsigned long long> allocatedBytes{0};
+
+/*
+ * All the replaceable forms of new and delete (the nothrow ones call these) go through the two functions below.
+ * They are not inlined, so that the compiler never pairs an allocation of operator new with a call to free().
+ */
+
+__attribute__((noinline)) static void *countedAllocate(size_t size) {
+    allocationCount++;
+    allocatedBytes += size;
+    void *pointer = std::malloc(size == 0 ? 1 : size);
+    if (pointer == nullptr) {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+
+__attribute__((noinline)) static void countedFree(void *pointer) noexcept {
+    std::free(pointer);
+}
+
+void *operator new(size_t size) {
+    return countedAllocate(size);
+}
+
+void *operator new[](size_t size) {
+    return countedAllocate(size);
+}
+
+void operator delete(void *pointer) noexcept {
+    countedFree(pointer);
+}
+
+void operator delete[](void *pointer) noexcept {
+    countedFree(pointer);
+}
+
+void operator delete(void *pointer, size_t) noexcept {
+    countedFree(pointer);
+}
+
+void operator delete[](void *pointer, size_t) noexcept {
+    countedFree(pointer);
+}
+
+/**
+ * Prevents the compiler from optimizing away the computation of the given value
+ */
+template<typename V>
+void doNotOptimize(const V &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * Passed to each benchmark: the code to measure is the body of <code>while (state.keepRunning())</code>
+ */
+class BenchmarkState {
+private:
+    unsigned long long target, done = 0;
+    std::chrono::steady_clock::time_point start;
+    unsigned long long allocationsAtStart = 0, bytesAtStart = 0;
+    size_t bufferBytesAtStart = 0;
+
+public:
+    double seconds = 0;
+    unsigned long long allocations = 0, allocatedBytes = 0;
+    //Statistics of the matrix buffers, counted by the pool from the start of the measure
+    MatrixAllocatorStats buffers = {};
+    size_t peakBufferBytes = 0;
+    //Work done by each iteration, used to compute the throughput
+    double flopsPerIteration = 0, bytesPerIteration = 0;
+
+    explicit BenchmarkState(unsigned long long iterations) : target(iterations) {
+    }
+
+    bool keepRunning() {
+        if (this->done == 0) {
+            this->allocationsAtStart = allocationCount;
+            this->bytesAtStart = ::allocatedBytes;
+            MatrixBufferPool::shared().resetStats();
+            this->bufferBytesAtStart = MatrixBufferPool::shared().stats().bytesInUse;
+            this->start = std::chrono::steady_clock::now();
+        }
+        if (this->done < this->target) {
+            this->done++;
+            return true;
+        }
+        this->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - this->start).count();
+        this->allocations = allocationCount - this->allocationsAtStart;
+        this->allocatedBytes = ::allocatedBytes - this->bytesAtStart;
+        this->buffers = MatrixBufferPool::shared().stats();
+        this->peakBufferBytes = this->buffers.peakBytes - std::min(this->buffers.peakBytes, this->bufferBytesAtStart);
+        return false;
+    }
+
+    unsigned long long iterations() const {
+        return this->target;
+    }
+};
+
+struct BenchmarkResult {
+    std::string name;
+    unsigned long long iterations;
+    double secondsPerIteration, gflops, gbps, allocationsPerIteration, allocatedBytesPerIteration;
+    double bufferAllocationsPerIteration, bufferReuseRate;
+    size_t peakBufferBytes;
+};
+
+class BenchmarkRegistry {
+private:
+    std::vector<std::pair<std::string, std::function<void(BenchmarkState &)>>> benchmarks;
+
+public:
+    void add(const std::string &name, std::function<void(BenchmarkState &)> benchmark) {
+        this->benchmarks.emplace_back(name, benchmark);
+    }
+
+    std::vector<BenchmarkResult> run(const std::string &filter, double minTime) const {
+        std::vector<BenchmarkResult> results;
+        std::cout << std::left << std::setw(48) << "Benchmark" << std::right << std::setw(14) << "Time (us)"
+                  << std::setw(12) << "Iterations" << std::setw(10) << "GFLOP/s" << std::setw(10) << "GB/s"
+                  << std::setw(12) << "Allocs/it" << std::setw(12) << "Buffers/it" << std::setw(8) << "Reuse"
+                  << std::setw(12) << "Peak (MB)" << std::endl;
+        for (auto &benchmark : this->benchmarks) {
+            if (benchmark.first.find(filter) == std::string::npos) {
+                continue;
+            }
+            unsigned long long iterations = 1;
+            while (true) {
+                BenchmarkState state(iterations);
+                benchmark.second(state);
+                if (state.seconds >= minTime || iterations >= (1ULL << 30)) {
+                    BenchmarkResult result = {benchmark.first, iterations, state.seconds / iterations,
+                                              state.flopsPerIteration * iterations / state.seconds / 1e9,
+                                              state.bytesPerIteration * iterations / state.seconds / 1e9,
+                                              (double) state.allocations / iterations, (double) state.allocatedBytes / iterations,
+                                              (double) state.buffers.allocations / iterations, state.buffers.reuseRate(),
+                                              state.peakBufferBytes};
+                    print(result);
+                    results.push_back(result);
+                    break;
+                }
+                //Aiming a bit above minTime, to avoid another round
+                double factor = state.seconds <= 0 ? 10 : std::min(10.0, std::max(2.0, 1.4 * minTime / state.seconds));
+                iterations = (unsigned long long) (iterations * factor);
+            }
+        }
+        return results;
+    }
+
+private:
+    static void print(const BenchmarkResult &result) {
+        std::cout << std::left << std::setw(48) << result.name << std::right << std::fixed
+                  << std::setw(14) << std::setprecision(2) << result.secondsPerIteration * 1e6
+                  << std::setw(12) << result.iterations
+                  << std::setw(10) << std::setprecision(2) << result.gflops
+                  << std::setw(10) << std::setprecision(2) << result.gbps
+                  << std::setw(12) << std::setprecision(1) << result.allocationsPerIteration
+                  << std::setw(12) << std::setprecision(1) << result.bufferAllocationsPerIteration
+                  << std::setw(7) << std::setprecision(0) << result.bufferReuseRate * 100 << "%"
+                  << std::setw(12) << std::setprecision(2) << result.peakBufferBytes / 1e6 << std::endl;
+    }
+};
+
+void writeJson(const std::string &path, const std::vector<BenchmarkResult> &results) {
+    std::ofstream output(path);
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    output << "{\n  \"context\": {\n"
+           << "    \"date\": \"" << date << "\",\n"
+           << "    \"threads\": " << ThreadPool::shared().size() << ",\n"
+           << "    \"simd_width_float\": " << Simd<float>::WIDTH << ",\n"
+           << "    \"simd_width_double\": " << Simd<double>::WIDTH << "\n"
+           << "  },\n  \"benchmarks\": [\n";
+    output << std::setprecision(10);
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchmarkResult &r = results[i];
+        output << "    {\"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+               << ", \"real_time_ns\": " << r.secondsPerIteration * 1e9
+               << ", \"gflops\": " << r.gflops << ", \"gbps\": " << r.gbps
+               << ", \"allocations_per_iteration\": " << r.allocationsPerIteration
+               << ", \"allocated_bytes_per_iteration\": " << r.allocatedBytesPerIteration
+               << ", \"buffer_allocations_per_iteration\": " << r.bufferAllocationsPerIteration
+               << ", \"buffer_reuse_rate\": " << r.bufferReuseRate
+               << ", \"peak_buffer_bytes\": " << r.peakBufferBytes << "}"
+               << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    output << "  ]\n}\n";
+}
+
+template<typename T, class MD>
+void fill(Matrix<T, MD> &m) {
+    for (unsigned row = 0; row < m.rows(); ++row) {
+        for (unsigned col = 0; col < m.columns(); ++col) {
+            m(row, col) = (T) ((row * 7 + col * 3) % 17);
+        }
+    }
+}
+
+/**
+ * Reads every cell with get() and with the static accessor, and copies the whole matrix with virtualMaterialize()
+ */
+template<typename T, class MD>
+void addViewBenchmarks(BenchmarkRegistry &registry, const std::string &name, std::function<Matrix<T, MD>()> create) {
+    registry.add("get/" + name, [create](BenchmarkState &state) {
+        const Matrix<T, MD> m = create();
+        //Reading once outside of the loop, so that products are not measured
+        doNotOptimize(m(0, 0));
+        state.bytesPerIteration = (double) m.size() * sizeof(T);
+        while (state.keepRunning()) {
+            T sum = 0;
+            for (unsigned r = 0; r < m.rows(); r++) {
+                for (unsigned c = 0; c < m.columns(); c++) {
+                    sum += m(r, c);
+                }
+            }
+            doNotOptimize(sum);
+        }
+    });
+    registry.add("accessor/" + name, [create](BenchmarkState &state) {
+        const Matrix<T, MD> m = create();
+        auto accessor = m.accessor();
+        state.bytesPerIteration = (double) m.size() * sizeof(T);
+        while (state.keepRunning()) {
+            T sum = 0;
+            for (unsigned r = 0; r < m.rows(); r++) {
+                for (unsigned c = 0; c < m.columns(); c++) {
+                    sum += accessor(r, c);
+                }
+            }
+            doNotOptimize(sum);
+        }
+    });
+    registry.add("materialize/" + name, [create](BenchmarkState &state) {
+        const Matrix<T, MD> m = create();
+        doNotOptimize(m(0, 0));
+        state.bytesPerIteration = (double) m.size() * sizeof(T);
+        while (state.keepRunning()) {
+            auto copied = m.copy();
+            doNotOptimize(copied.getData().rawData()[0]);
+        }
+    });
+}
+
+template<typename T>
+void addBenchmarks(BenchmarkRegistry &registry, const std::string &type, unsigned n) {
+    typedef VectorMatrixData<T> V;
+    std::string suffix = "<" + type + ">/" + std::to_string(n);
+    auto square = [](unsigned rows, unsigned columns) {
+        Matrix<T> m(rows, columns);
+        fill(m);
+        return m;
+    };
+
+    addViewBenchmarks<T, V>(registry, "Vector" + suffix, [=] { return square(n, n); });
+    addViewBenchmarks<T, SubmatrixMD<T, V>>(registry, "Submatrix" + suffix, [=] {
+        return square(n + 8, n + 8).submatrix(3, 5, n, n);
+    });
+    addViewBenchmarks<T, TransposedMD<T, V>>(registry, "Transposed" + suffix, [=] { return square(n, n).transpose(); });
+    registry.add("transposeInPlace" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = 2.0 * n * n * sizeof(T);
+        while (state.keepRunning()) {
+            m.transposeInPlace();
+            doNotOptimize(m.getData().rawData()[0]);
+        }
+    });
+    addViewBenchmarks<T, DiagonalMD<T, V>>(registry, "Diagonal" + suffix, [=] { return square(n, n).diagonal(); });
+    addViewBenchmarks<T, DiagonalMatrixMD<T, V>>(registry, "DiagonalMatrix" + suffix, [=] {
+        return square(n, 1).diagonalMatrix();
+    });
+    addViewBenchmarks<T, ConcatenationMD<T, V>>(registry, "Concatenation" + suffix, [=] {
+        std::deque<V> blocks;
+        for (unsigned i = 0; i < 4; i++) {
+            blocks.push_back(square(n / 2, n / 2).getData());
+        }
+        return Matrix<T, ConcatenationMD<T, V>>::fromData(ConcatenationMD<T, V>(blocks, n / 2 * 2, n / 2 * 2));
+    });
+    addViewBenchmarks<T, ResizerMD<T, V>>(registry, "Resizer" + suffix, [=] {
+        return Matrix<T, ResizerMD<T, V>>::fromData(ResizerMD<T, V>(square(n - 3, n - 3).getData(), n, n));
+    });
+    addViewBenchmarks<T, MatrixCaster<T, VectorMatrixData<short>>>(registry, "Caster" + suffix, [=] {
+        Matrix<short> m(n, n);
+        fill(m);
+        return m.template cast<T>();
+    });
+    addViewBenchmarks<T, Sum<T, V, V>>(registry, "Sum" + suffix, [=] { return square(n, n) + square(n, n); });
+    addViewBenchmarks<T, MultiSum<T, V>>(registry, "MultiSum" + suffix, [=] {
+        std::deque<V> terms;
+        for (unsigned i = 0; i < 4; i++) {
+            terms.push_back(square(n, n).getData());
+        }
+        return Matrix<T, MultiSum<T, V>>::fromData(MultiSum<T, V>(terms));
+    });
+    typedef MapMD<T, V, ScaleOp<T>> Scaled;
+    typedef ZipMD<T, V, V, HadamardOp<T>> Hadamard;
+    addViewBenchmarks<T, Scaled>(registry, "Scale" + suffix, [=] { return square(n, n) * T(3); });
+    addViewBenchmarks<T, Hadamard>(registry, "Hadamard" + suffix, [=] { return square(n, n).hadamard(square(n, n)); });
+    //alpha*A - B∘C, evaluated in a single pass
+    addViewBenchmarks<T, ZipMD<T, Scaled, Hadamard, SubtractOp<T>>>(registry, "ScaleMinusHadamard" + suffix, [=] {
+        return T(3) * square(n, n) - square(n, n).hadamard(square(n, n));
+    });
+
+    //Copies share the buffer until written: only the first write of a copy duplicates it
+    registry.add("copyOnWrite/read" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            Matrix<T> copied = m;
+            doNotOptimize(copied(0, 0));
+        }
+    });
+    registry.add("copyOnWrite/write" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            Matrix<T> copied = m;
+            copied(0, 0) = T(1);
+            doNotOptimize(copied.getData().rawData()[0]);
+        }
+    });
+
+    //Copies of a computed product reuse its result, instead of multiplying again
+    registry.add("copyOfProduct" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> a = square(n, n), b = square(n, n);
+        auto product = a * b;
+        doNotOptimize(product(0, 0));
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            auto copied = product;
+            doNotOptimize(copied(0, 0));
+        }
+    });
+
+    //Reductions read the buffer in place, or a strip of rows at a time for lazy matrices
+    registry.add("reduce/sum/Vector" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            doNotOptimize(m.sum());
+        }
+    });
+    registry.add("reduce/columnSums/Vector" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            auto sums = m.columnSums();
+            doNotOptimize(sums.getData().rawData()[0]);
+        }
+    });
+    registry.add("reduce/argMax/Vector" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> m = square(n, n);
+        state.bytesPerIteration = (double) n * n * sizeof(T);
+        while (state.keepRunning()) {
+            doNotOptimize(m.argMax().value);
+        }
+    });
+    registry.add("reduce/frobeniusNorm/Sum" + suffix, [=](BenchmarkState &state) {
+        const auto m = square(n, n) + square(n, n);
+        state.bytesPerIteration = 2.0 * n * n * sizeof(T);
+        while (state.keepRunning()) {
+            doNotOptimize(m.frobeniusNorm());
+        }
+    });
+
+    //The products are recomputed at each iteration, including the copy of the result
+    registry.add("multiply/AxB" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> a = square(n, n), b = square(n, n);
+        state.flopsPerIteration = 2.0 * n * n * n;
+        while (state.keepRunning()) {
+            auto product = (a * b).copy();
+            doNotOptimize(product.getData().rawData()[0]);
+        }
+    });
+    registry.add("multiply/AxBxC" + suffix, [=](BenchmarkState &state) {
+        //The best order is A x (B x C)
+        Matrix<T> a = square(n, n), b = square(n, n / 4), c = square(n / 4, n);
+        state.flopsPerIteration = 2.0 * n * (n / 4) * n + 2.0 * n * n * n;
+        while (state.keepRunning()) {
+            auto product = (a * b * c).copy();
+            doNotOptimize(product.getData().rawData()[0]);
+        }
+    });
+    registry.add("multiply/Ax(B+C)" + suffix, [=](BenchmarkState &state) {
+        Matrix<T> a = square(n, n), b = square(n, n), c = square(n, n);
+        state.flopsPerIteration = 2.0 * n * n * n + (double) n * n;
+        while (state.keepRunning()) {
+            auto product = (a * (b + c)).copy();
+            doNotOptimize(product.getData().rawData()[0]);
+        }
+    });
+}
+
+int main(int argc, char **argv) {
+    std::string filter, json;
+    double minTime = 0.2;
+    for (int i = 1; i < argc; i++) {
+        std::string argument = argv[i];
+        if (argument.rfind("--filter=", 0) == 0) {
+            filter = argument.substr(9);
+        } else if (argument.rfind("--min-time=", 0) == 0) {
+            minTime = std::atof(argument.substr(11).c_str());
+        } else if (argument.rfind("--json=", 0) == 0) {
+            json = argument.substr(7);
+        } else {
+            std::cout << "Usage: " << argv[0] << " [--filter=substring] [--min-time=seconds] [--json=file]" << std::endl;
+            return 1;
+        }
+    }
+
+    BenchmarkRegistry registry;
+    for (unsigned n : {64, 256, 1024}) {
+        addBenchmarks<int>(registry, "int", n);
+        addBenchmarks<float>(registry, "float", n);
+        addBenchmarks<double>(registry, "double", n);
+    }
+    auto results = registry.run(filter, minTime);
+    if (!json.empty()) {
+        writeJson(json, results);
+    }
+    return 0;
+}
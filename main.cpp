@@ -1,8 +1,13 @@
 #include <iostream>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
 /*#include "assert.h"*/
 #include "Matrix.h"
 #include "StaticMatricSize.h"
+#include "BatchedMultiplication.h"
 
 
 template<typename T, class MD>
@@ -217,13 +222,1144 @@ void testBasicStuff() {
     test<int>(vector);
 }
 
+template<typename T>
+void testMultiplicationAgainstNaive(unsigned rows, unsigned inner, unsigned columns) {
+    Matrix<T> a(rows, inner);
+    Matrix<T> b(inner, columns);
+    initializeCells<T>(a, 3, 1);
+    initializeCells<T>(b, 1, 2);
+    //Reading through a const reference, so that each cell doesn't copy the product
+    const auto product = a * b;
+    for (unsigned r = 0; r < rows; r++) {
+        for (unsigned c = 0; c < columns; c++) {
+            T expected = 0;
+            for (unsigned k = 0; k < inner; k++) {
+                expected += (int) a(r, k) * (int) b(k, c);
+            }
+            cassert<T>(expected, product(r, c));
+        }
+    }
+}
+
+void testMultiplicationKernel() {
+    //Sizes that are not multiple of the blocks, nor of the register tiles
+    testMultiplicationAgainstNaive<int>(150, 260, 90);
+    testMultiplicationAgainstNaive<long>(131, 7, 203);
+    testMultiplicationAgainstNaive<float>(1, 33, 17);
+    testMultiplicationAgainstNaive<double>(70, 300, 1);
+}
+
+void testChainOrder() {
+    //Tall-skinny, then wide, then tall-skinny: the cheapest order is M0 x (M1 x M2)
+    Matrix<long> a(300, 2);
+    Matrix<long> b(2, 300);
+    Matrix<long> c(300, 3);
+    initializeCells<long>(a, 1, 2);
+    initializeCells<long>(b, 3, 1);
+    initializeCells<long>(c, 2, 5);
+    auto product = a * b * c;
+    auto plan = product.getData().plan();
+    if (plan.order != "(M0 x (M1 x M2))") {
+        std::cout << "ERROR: unexpected multiplication order " << plan.order << std::endl;
+        exit(1);
+    }
+    auto bc = (b * c).copy();
+    auto expected = a * bc;
+    assertEquals(expected, product);
+}
+
+void testMaterialization() {
+    //Each view is copied with its bulk path, and compared with the values read cell by cell
+    Matrix<int> m(200, 45);
+    initializeCells(m, 100, 1);
+    Matrix<int> v(40, 1);
+    initializeCells(v, 3, 0);
+    const auto product = m * m.transpose();
+
+    assertEquals(m.submatrix(3, 5, 60, 33), m.submatrix(3, 5, 60, 33).copy());
+    assertEquals(m.transpose(), m.transpose().copy());
+    assertEquals(m.submatrix(1, 2, 50, 40).transpose(), m.submatrix(1, 2, 50, 40).transpose().copy());
+    assertEquals(v.diagonalMatrix(), v.diagonalMatrix().copy());
+    assertEquals(v.diagonalMatrix().submatrix(5, 2, 20, 30), v.diagonalMatrix().submatrix(5, 2, 20, 30).copy());
+    assertEquals(m.cast<double>(), m.cast<double>().copy());
+    assertEquals(product, product.copy());
+    assertEquals(product.submatrix(90, 20, 33, 141), product.submatrix(90, 20, 33, 141).copy());
+}
+
+void testFusedSum() {
+    Matrix<int> a(50, 300);
+    Matrix<int> b(50, 300);
+    Matrix<int> c(300, 50);
+    Matrix<int> d(50, 50);
+    initializeCells(a, 1, 2);
+    initializeCells(b, 7, 3);
+    initializeCells(c, 5, 11);
+    initializeCells(d, 2, 1);
+    const auto sum = a + b + c.transpose() + (d * a).submatrix(0, 0, 50, 300);
+    auto copied = sum.copy();
+    auto product = (d * a).copy();
+    for (unsigned r = 0; r < sum.rows(); r++) {
+        for (unsigned col = 0; col < sum.columns(); col++) {
+            cassert<int>(a(r, col) + b(r, col) + c(col, r) + product(r, col), copied(r, col));
+        }
+    }
+}
+
+void testMappedMatrix() {
+    //The file starts with a header of 8 bytes, so that the values are not aligned to a page
+    const char *path = "mapped-matrix-test.bin";
+    Matrix<double> m(70, 40);
+    initializeCells<double>(m, 40, 1);
+    {
+        std::ofstream file(path, std::ios::binary);
+        file.write("abcdefgh", 8);
+        file.write(reinterpret_cast<const char *>(m.getData().rawData()), m.size() * sizeof(double));
+    }
+    const auto mapped = Matrix<double, MappedMatrixData<double>>::fromData(MappedMatrixData<double>(path, 70, 40, MappedMatrixData<double>::READ_ONLY, 8));
+    assertEquals(m, mapped);
+    assertEquals(m.submatrix(5, 3, 20, 30).transpose(), mapped.submatrix(5, 3, 20, 30).transpose().copy());
+    assertEquals((m * m.transpose()).copy(), (mapped * mapped.transpose()).copy());
+    assertEquals(m + m, (mapped + m).copy());
+
+    auto readOnly = Matrix<double, MappedMatrixData<double>>::fromData(MappedMatrixData<double>(path, 70, 40, MappedMatrixData<double>::READ_ONLY, 8));
+    bool thrown = false;
+    try {
+        readOnly(1, 1) = 5;
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+
+    //The buffer seen by the products cannot be written either
+    auto view = readOnly.getData().virtualGetStridedView();
+    cassert(41.0, view->get(1, 1));
+    thrown = false;
+    try {
+        view->set(1, 1, 5);
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+    cassert<double>(41.0, readOnly(1, 1));
+
+    //The values must be aligned
+    thrown = false;
+    try {
+        MappedMatrixData<double>(path, 70, 40, MappedMatrixData<double>::READ_ONLY, 3);
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+
+    //Writes are visible through the views, but not in the file nor in the copies made before
+    auto writable = Matrix<double, MappedMatrixData<double>>::fromData(MappedMatrixData<double>(path, 70, 40, MappedMatrixData<double>::COPY_ON_WRITE, 8));
+    auto copied = writable;
+    writable.submatrix(2, 2, 3, 3)(0, 0) = -1;
+    cassert<double>(-1.0, writable(2, 2));
+    cassert<double>(82.0, copied(2, 2));
+    cassert(82.0, mapped(2, 2));
+    std::remove(path);
+}
+
+void testMatrixFile() {
+    const char *path = "matrix-file-test.bin";
+    Matrix<int> a(100, 37);
+    Matrix<int> b(37, 60);
+    initializeCells(a, 7, 2);
+    initializeCells(b, 1, 5);
+    const auto product = a * b;
+    //Chunks that do not divide the number of rows
+    product.save(path, 7);
+    auto loaded = Matrix<int>::load(path);
+    assertEquals(product, loaded);
+    assertEquals(product, Matrix<int>::map(path));
+
+    //Reading one chunk at a time
+    MatrixReader<int> reader(path);
+    cassert(15u, reader.numberOfChunks());
+    VectorMatrixData<int> chunk(0, 0);
+    unsigned row = 0;
+    while (reader.readNextChunk(chunk)) {
+        for (unsigned r = 0; r < chunk.rows(); r++, row++) {
+            for (unsigned c = 0; c < chunk.columns(); c++) {
+                cassert<int>(product(row, c), chunk.get(r, c));
+            }
+        }
+    }
+    cassert(100u, row);
+
+    //Writing rows given in pieces that do not match the chunks
+    {
+        MatrixWriter<int> writer(path, 100, 37, 16);
+        writer.write(a.getData(), 0, 10);
+        writer.write(a.transpose().transpose().getData(), 10, 90);
+    }
+    assertEquals(a, Matrix<int>::load(path));
+
+    //A corrupted chunk is detected
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(MatrixFileHeader::SIZE + 50 * 37 * sizeof(int));
+        file.write("x", 1);
+    }
+    bool thrown = false;
+    try {
+        Matrix<int>::load(path);
+    } catch (std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+
+    //Invalid headers are rejected
+    auto assertRejected = [path, &a](unsigned position, uint64_t value, unsigned bytes) {
+        {
+            MatrixWriter<int> writer(path, 100, 37, 16);
+            writer.write(a.getData());
+        }
+        {
+            std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+            file.seekp(position);
+            file.write(reinterpret_cast<const char *>(&value), bytes);
+        }
+        bool rejected = false;
+        try {
+            MatrixReader<int> reader(path);
+            reader.readAll();
+        } catch (std::runtime_error &) {
+            rejected = true;
+        }
+        cassert(true, rejected);
+    };
+    //Chunks of 0 rows
+    assertRejected(12, 0, 4);
+    //More rows than an unsigned can hold
+    assertRejected(16, (1ULL << 32) + 100, 8);
+    //Values and index outside the file
+    assertRejected(32, 1ULL << 40, 8);
+    assertRejected(40, 1ULL << 40, 8);
+    //Checksum of the whole matrix not matching, while the ones of the chunks do
+    assertRejected(48, 12345, 8);
+    std::remove(path);
+}
+
+template<typename T, class MD>
+void assertAccessor(const Matrix<T, MD> &m) {
+    auto accessor = m.accessor();
+    for (unsigned r = 0; r < m.rows(); r++) {
+        for (unsigned c = 0; c < m.columns(); c++) {
+            cassert<T>(m(r, c), accessor(r, c));
+        }
+    }
+}
+
+void testStaticAccessor() {
+    Matrix<int> a(30, 40);
+    Matrix<int> b(40, 30);
+    Matrix<int> v(25, 1);
+    initializeCells(a, 100, 1);
+    initializeCells(b, 3, 7);
+    initializeCells(v, 2, 0);
+    //Views over dense storage collapse in a single strided accessor
+    static_assert(std::is_same<decltype(a.submatrix(1, 2, 10, 10).transpose().submatrix(2, 1, 5, 5).accessor()),
+                          StridedAccessor<int>>::value, "Views should collapse in a StridedAccessor");
+    static_assert(std::is_same<decltype(a.transpose().transpose().accessor()), StridedAccessor<int>>::value,
+                  "Views should collapse in a StridedAccessor");
+    assertAccessor(a.submatrix(1, 2, 10, 10).transpose().submatrix(2, 1, 5, 5));
+    assertAccessor(a.submatrix(3, 3, 20, 20).diagonal());
+    assertAccessor(a.submatrix(2, 3, 25, 25).transpose() + v.diagonalMatrix());
+    assertAccessor(a + b.transpose().cast<double>().cast<int>());
+    assertAccessor(Matrix<int, ResizerMD<int, VectorMatrixData<int>>>::fromData(ResizerMD<int, VectorMatrixData<int>>(a.getData(), 35, 45)));
+    std::deque<VectorMatrixData<int>> blocks = {a.getData(), a.getData(), a.getData(), a.getData()};
+    assertAccessor(Matrix<int, ConcatenationMD<int, VectorMatrixData<int>>>::fromData(ConcatenationMD<int, VectorMatrixData<int>>(blocks, 60, 80)));
+    assertAccessor(Matrix<int, MultiSum<int, VectorMatrixData<int>>>::fromData(MultiSum<int, VectorMatrixData<int>>(blocks)));
+    //Products are computed when the accessor is created
+    const auto product = a * b;
+    assertAccessor((a * b).submatrix(3, 4, 20, 20).transpose() + a.submatrix(0, 0, 20, 20));
+    assertAccessor(product);
+}
+
+void testSparse() {
+    //About 2% of non-zeros, with some duplicated triplets
+    std::vector<std::tuple<unsigned, unsigned, int>> triplets;
+    for (unsigned i = 0; i < 1800; i++) {
+        triplets.emplace_back((i * 37) % 300, (i * i * 11 + 5) % 300, (int) (i % 7) - 3);
+    }
+    auto csr = Matrix<int, CsrMatrixData<int>>::fromData(CsrMatrixData<int>::fromTriplets(300, 300, triplets));
+    auto csc = Matrix<int, CscMatrixData<int>>::fromData(CscMatrixData<int>::fromTriplets(300, 300, triplets));
+    Matrix<int> dense = csr.copy();
+    Matrix<int> other(300, 120);
+    Matrix<int> vector(300, 1);
+    Matrix<int> covector(1, 300);
+    initializeCells(other, 3, 1);
+    initializeCells(vector, 2, 0);
+    initializeCells(covector, 0, 5);
+
+    assertEquals(dense, csc);
+    assertEquals(dense.submatrix(10, 20, 100, 90), csc.submatrix(10, 20, 100, 90).copy());
+    assertEquals(csr, Matrix<int, CsrMatrixData<int>>::fromData(CsrMatrixData<int>::fromDense(dense.getData())));
+    assertEquals((dense * other).copy(), csr * other);
+    assertEquals((dense * other).copy(), csc * other);
+    assertEquals((other.transpose() * dense).copy(), other.transpose() * csr);
+    assertEquals((other.transpose() * dense).copy(), other.transpose() * csc);
+    assertEquals((dense * vector).copy(), csr * vector);
+    assertEquals((covector * dense).copy(), covector * csc);
+    assertEquals((dense * dense).copy(), csr * csc);
+    assertEquals((dense * dense * other).copy(), csr * csr * other);
+    assertEquals((other.transpose() * dense * dense).copy(), other.transpose() * csc * csr);
+
+    //A nested block product as operand: its result is padded to two blocks of columns, which must not be read
+    unsigned columns = Autotuner::blocking<int>().nc + 1;
+    std::vector<std::tuple<unsigned, unsigned, int>> diagonalTriplets;
+    for (unsigned i = 0; i < columns; i++) {
+        diagonalTriplets.emplace_back(i, i, 1);
+    }
+    auto identity = Matrix<int, CsrMatrixData<int>>::fromData(CsrMatrixData<int>::fromTriplets(columns, columns, diagonalTriplets));
+    Matrix<int> left(2, 3), right(3, columns);
+    initializeCells(left, 1, 2);
+    initializeCells(right, 2, 1);
+    assertEquals((left * right).copy(), left * right * identity);
+
+    //Writing a new non-zero, and overwriting an existing one
+    auto copied = csr;
+    copied(7, 8) = 42;
+    copied(0, copied.columns() - 1) = 0;
+    dense(7, 8) = 42;
+    dense(0, dense.columns() - 1) = 0;
+    assertEquals(dense, copied);
+    cassert<int>(csr(7, 8) == 42 ? 1 : 0, 0);
+}
+
+void testDiagonalMultiplication() {
+    Matrix<int> vector(120, 1);
+    Matrix<int> otherVector(120, 1);
+    Matrix<int> other(120, 90);
+    initializeCells(vector, 3, 1);
+    initializeCells(otherVector, 1, 4);
+    initializeCells(other, 2, 5);
+    Matrix<int> diagonal = vector.diagonalMatrix().copy();
+    Matrix<int> otherDiagonal = otherVector.diagonalMatrix().copy();
+
+    assertEquals((diagonal * other).copy(), vector.diagonalMatrix() * other);
+    assertEquals((other.transpose() * diagonal).copy(), other.transpose() * vector.diagonalMatrix());
+    assertEquals((diagonal * other).copy(), vector.diagonalMatrix().transpose() * other);
+    assertEquals((diagonal * otherDiagonal).copy(), vector.diagonalMatrix() * otherVector.diagonalMatrix());
+    assertEquals((other.transpose() * diagonal * otherDiagonal * other).copy(),
+                 other.transpose() * vector.diagonalMatrix() * otherVector.diagonalMatrix() * other);
+
+    std::vector<std::tuple<unsigned, unsigned, int>> triplets;
+    for (unsigned i = 0; i < 400; i++) {
+        triplets.emplace_back((i * 13) % 120, (i * i * 7 + 3) % 120, (int) (i % 5) - 2);
+    }
+    auto csr = Matrix<int, CsrMatrixData<int>>::fromData(CsrMatrixData<int>::fromTriplets(120, 120, triplets));
+    auto csc = Matrix<int, CscMatrixData<int>>::fromData(CscMatrixData<int>::fromTriplets(120, 120, triplets));
+    Matrix<int> dense = csr.copy();
+    assertEquals((diagonal * dense).copy(), vector.diagonalMatrix() * csr);
+    assertEquals((dense * diagonal).copy(), csr * vector.diagonalMatrix());
+    assertEquals((diagonal * dense).copy(), vector.diagonalMatrix() * csc);
+    assertEquals((dense * diagonal).copy(), csc * vector.diagonalMatrix());
+
+    //The other operand is a nested block product, padded to two blocks of rows: only its size is scaled
+    unsigned n = Autotuner::blocking<double>().mc + 1;
+    Matrix<double> scales(n, 1), a(n, n), b(n, 3);
+    initializeCells<double>(scales, 1, 0);
+    initializeCells<double>(a, 1, 2);
+    initializeCells<double>(b, 2, 1);
+    const auto product = scales.diagonalMatrix() * (a * b);
+    if (product.getData().plan().order != "(M0 x (M1 x M2))") {
+        std::cout << "ERROR: unexpected multiplication order " << product.getData().plan().order << std::endl;
+        exit(1);
+    }
+    const Matrix<double> ab = (a * b).copy();
+    cassert(n, product.rows());
+    cassert(3u, product.columns());
+    for (unsigned r = 0; r < n; r++) {
+        for (unsigned c = 0; c < 3; c++) {
+            cassert<double>(r * ab(r, c), product(r, c));
+        }
+    }
+}
+
+template<typename T>
+void testTranspose(unsigned rows, unsigned columns) {
+    Matrix<T> m(rows, columns);
+    initializeCells<T>(m, 1000, 1);
+    Matrix<T> expected(columns, rows);
+    for (unsigned r = 0; r < rows; r++) {
+        for (unsigned c = 0; c < columns; c++) {
+            expected(c, r) = (T) m(r, c);
+        }
+    }
+    assertEquals(expected, m.transpose().copy());
+    //Through a view without raw data, and only a part of it
+    assertEquals(expected, m.submatrix(0, 0, rows, columns).transpose().copy());
+    assertEquals(expected.submatrix(1, 2, columns - 3, rows - 5).copy(), m.transpose().submatrix(1, 2, columns - 3, rows - 5).copy());
+
+    Matrix<T> square = m.submatrix(0, 0, rows, rows).copy();
+    square.transposeInPlace();
+    assertEquals(expected.submatrix(0, 0, rows, rows).copy(), square);
+}
+
+void testTranspose() {
+    testTranspose<int>(5, 7);
+    testTranspose<int>(70, 131);
+    testTranspose<float>(67, 200);
+    testTranspose<double>(129, 140);
+    testTranspose<long>(33, 65);
+}
+
+void testLayout() {
+    Matrix<int> rowMajor(70, 45);
+    Matrix<int> columnMajor(70, 45, MatrixLayout::COLUMN_MAJOR);
+    initializeCells(rowMajor, 1000, 1);
+    initializeCells(columnMajor, 1000, 1);
+    cassert((int) MatrixLayout::COLUMN_MAJOR, (int) columnMajor.getData().getLayout());
+    cassert(1ul, columnMajor.getData().getRowStride());
+    assertEquals(rowMajor, columnMajor);
+    assertEquals(rowMajor.transpose().copy(), columnMajor.transpose().copy());
+    assertEquals(rowMajor.submatrix(3, 4, 50, 30).copy(), columnMajor.submatrix(3, 4, 50, 30).copy());
+    //Copies keep the layout
+    auto copied = columnMajor;
+    cassert((int) MatrixLayout::COLUMN_MAJOR, (int) copied.getData().getLayout());
+
+    //Views sharing the same buffer
+    auto transposed = Matrix<int>::fromData(rowMajor.getData().transposedView());
+    auto part = Matrix<int>::fromData(rowMajor.getData().submatrixView(10, 5, 20, 30));
+    cassert((int) MatrixLayout::STRIDED, (int) part.getData().getLayout());
+    assertEquals(rowMajor.transpose().copy(), transposed.copy());
+    assertEquals(rowMajor.submatrix(10, 5, 20, 30).copy(), part.copy());
+
+    //The products read the operands in place, whatever their layout
+    Matrix<int> other(45, 33);
+    initializeCells(other, 2, 3);
+    Matrix<int> expected = (rowMajor * other).copy();
+    assertEquals(expected, columnMajor * other);
+    assertEquals(expected, Matrix<int>::fromData(rowMajor.getData().copy()) * other.transpose().transpose());
+    assertEquals((other.transpose() * rowMajor.transpose()).copy(), other.transpose() * transposed);
+    assertEquals((part * other.submatrix(0, 0, 30, 33)).copy(), part * Matrix<int>::fromData(other.getData().submatrixView(0, 0, 30, 33)));
+
+    Matrix<int> square(40, 40, MatrixLayout::COLUMN_MAJOR);
+    initializeCells(square, 1000, 1);
+    Matrix<int> squareTransposed = square.transpose().copy();
+    square.transposeInPlace();
+    assertEquals(squareTransposed, square);
+
+    //Writing through a view
+    part(0, 0) = -1;
+    cassert(-1, (int) rowMajor(10, 5));
+    cassert(-1, (int) transposed(5, 10));
+}
+
+class CountingAllocator : public AlignedAllocator {
+public:
+    std::atomic<unsigned> allocations{0}, deallocations{0};
+
+    void *allocate(size_t bytes) override {
+        allocations++;
+        return AlignedAllocator::allocate(bytes);
+    }
+
+    void deallocate(void *pointer, size_t bytes) override {
+        deallocations++;
+        AlignedAllocator::deallocate(pointer, bytes);
+    }
+};
+
+void testAllocator() {
+    cassert((size_t) 64, MatrixBufferPool::sizeClass(1));
+    cassert((size_t) 320, MatrixBufferPool::sizeClass(257));
+    cassert((size_t) 4096, MatrixBufferPool::sizeClass(4000));
+    cassert((size_t) 5120, MatrixBufferPool::sizeClass(4097));
+
+    Matrix<double> a(150, 130), b(130, 170);
+    initializeCells(a, 1.0, 2.0);
+    initializeCells(b, 3.0, 1.0);
+    cassert((size_t) 0, reinterpret_cast<size_t>(a.getData().rawData()) % MatrixAllocator::ALIGNMENT);
+    Matrix<double> expected = (a * b).copy();
+
+    //The blocks of the second product recycle the buffers of the first one
+    MatrixBufferPool &pool = MatrixBufferPool::shared();
+    size_t inUse = pool.stats().bytesInUse;
+    pool.resetStats();
+    for (unsigned i = 0; i < 2; i++) {
+        assertEquals(expected, (a * b).copy());
+    }
+    MatrixAllocatorStats stats = pool.stats();
+    cassert(true, stats.reused > 0 && stats.reused <= stats.allocations);
+    cassert(true, stats.peakBytes > inUse);
+    cassert(inUse, stats.bytesInUse);
+
+    CountingAllocator counting;
+    MatrixAllocator::use(&counting);
+    {
+        Matrix<double> product = (a * b).copy();
+        assertEquals(expected, product);
+        cassert(true, counting.allocations > 0);
+    }
+    MatrixAllocator::use(nullptr);
+    cassert(counting.allocations.load(), counting.deallocations.load());
+}
+
+void testParallelMaterialization() {
+    //Every index is visited exactly once, whatever the number of workers
+    ThreadPool pool(4);
+    std::vector<std::atomic<unsigned>> visits(1000);
+    pool.parallelFor(0, 1000, 1 << 20, [&](unsigned first, unsigned last) {
+        for (unsigned i = first; i < last; i++) {
+            visits[i]++;
+        }
+    });
+    for (auto &count : visits) {
+        cassert(1u, count.load());
+    }
 
+    Matrix<int> a(90, 70), b(90, 70);
+    initializeCells(a, 3, 1);
+    initializeCells(b, 1, 5);
+    Matrix<int> sum = (a + b).copy();
+    Matrix<int> transposed = a.transpose().copy();
+    Matrix<double> casted = a.cast<double>().copy();
+    Matrix<int> part = a.submatrix(5, 6, 40, 30).copy();
 
+    //The same copies, split in tasks of a few rows
+    size_t threshold = ThreadPool::parallelThreshold();
+    ThreadPool::setParallelThreshold(100);
+    assertEquals(sum, (a + b).copy());
+    assertEquals(transposed, a.transpose().copy());
+    assertEquals(casted, a.cast<double>().copy());
+    assertEquals(part, a.submatrix(5, 6, 40, 30).copy());
+    Matrix<int> copied = a;
+    assertEquals(a, copied);
+    ThreadPool::setParallelThreshold(threshold);
+}
+
+void testConcatenation() {
+    Matrix<int> a(30, 40), b(30, 40);
+    initializeCells(a, 3, 1);
+    initializeCells(b, 1, 5);
+    std::deque<VectorMatrixData<int>> blocks = {a.getData(), b.getData(), b.getData(), a.getData()};
+    auto concatenation = Matrix<int, ConcatenationMD<int, VectorMatrixData<int>>>::fromData(
+            ConcatenationMD<int, VectorMatrixData<int>>(blocks, 60, 80));
+    Matrix<int> expected = concatenation.copy();
+    cassert((int) b(4, 7), (int) concatenation(4, 47));
+    cassert((int) b(29, 39), (int) concatenation(59, 39));
 
+    //Each block is visited once, in its position
+    unsigned visited = 0;
+    concatenation.getData().forEachBlockView([&](unsigned row, unsigned col, const VectorMatrixData<int> &block) {
+        cassert(30u, block.rows());
+        cassert(40u, block.columns());
+        cassert((int) expected(row + 2, col + 3), block.get(2, 3));
+        visited++;
+    });
+    cassert(4u, visited);
 
+    //Once compacted, the values come from a single buffer
+    cassert(false, concatenation.getData().isCompacted());
+    concatenation.getData().compact();
+    cassert(true, concatenation.getData().isCompacted());
+    assertEquals(expected, concatenation);
+    assertEquals(expected.submatrix(10, 20, 40, 50), concatenation.submatrix(10, 20, 40, 50).copy());
+    Matrix<int> copied = Matrix<int, ConcatenationMD<int, VectorMatrixData<int>>>::fromData(concatenation.getData().copy()).copy();
+    assertEquals(expected, copied);
+}
+
+void testBatchedMultiplication() {
+    //37 products do not fill the last group of lanes
+    std::vector<Matrix<int>> left, right;
+    for (unsigned i = 0; i < 37; i++) {
+        left.emplace_back(4, 3);
+        right.emplace_back(3, 5);
+        initializeCells(left.back(), (int) i + 1, 2);
+        initializeCells(right.back(), 3, (int) i);
+    }
+    auto products = BatchedMatrices<int>::multiply(left, right);
+    cassert((size_t) 37, products.size());
+    for (unsigned i = 0; i < 37; i++) {
+        assertEquals(left[i] * right[i], products[i]);
+    }
+
+    std::vector<StaticSizeMatrix<4, 4, double>> transforms(20), points(20);
+    for (unsigned i = 0; i < 20; i++) {
+        initializeCells(transforms[i], 1.0, (double) i);
+        initializeCells(points[i], (double) i, 0.5);
+    }
+    auto transformed = BatchedMatrices<double>::multiply(transforms, points);
+    for (unsigned i = 0; i < 20; i++) {
+        assertEquals(transforms[i] * points[i], transformed[i]);
+    }
+
+    //The interleaved batch can be kept between products
+    BatchedMatrices<int> batch(3, 2, 2);
+    for (unsigned i = 0; i < 3; i++) {
+        batch.set(i, 0, 0, 1);
+        batch.set(i, 1, 1, (int) i);
+    }
+    auto squared = batch.multiply(batch);
+    cassert(4, squared.get(2, 1, 1));
+    cassert(0, squared.get(2, 0, 1));
+    assertEquals(batch.get(1), squared.get(1));
+}
+
+template<typename T, class MD1, class MD2>
+Matrix<T> naiveProduct(const Matrix<T, MD1> &a, const Matrix<T, MD2> &b) {
+    Matrix<T> ret(a.rows(), b.columns());
+    for (unsigned r = 0; r < a.rows(); r++) {
+        for (unsigned c = 0; c < b.columns(); c++) {
+            T sum = 0;
+            for (unsigned k = 0; k < a.columns(); k++) {
+                sum += a(r, k) * b(k, c);
+            }
+            ret(r, c) = sum;
+        }
+    }
+    return ret;
+}
+
+void testVectorMultiplication() {
+    Matrix<int> a(230, 170);
+    Matrix<int> x(170, 1), y(1, 230), z(230, 1);
+    initializeCells(a, 3, 1);
+    initializeCells(x, 2, 0);
+    initializeCells(y, 0, 5);
+    initializeCells(z, 1, 0);
+
+    //Row-major and column-major (transposed) matrices, by a column vector and by a row vector, also split in tasks
+    size_t threshold = ThreadPool::parallelThreshold();
+    for (size_t work : {threshold, (size_t) 100}) {
+        ThreadPool::setParallelThreshold(work);
+        assertEquals(naiveProduct(a, x), a * x);
+        assertEquals(naiveProduct(y, a), y * a);
+        assertEquals(naiveProduct(a.transpose(), z), a.transpose() * z);
+        assertEquals(naiveProduct(x.transpose(), a.transpose()), x.transpose() * a.transpose());
+        assertEquals(naiveProduct(a.submatrix(3, 5, 100, 120), x.submatrix(2, 0, 120, 1)),
+                     a.submatrix(3, 5, 100, 120) * x.submatrix(2, 0, 120, 1));
+        assertEquals(naiveProduct(y, z), y * z);
+    }
+    ThreadPool::setParallelThreshold(threshold);
+
+    //The vector is multiplied first, and the other products are matrix-vector ones too.
+    //Small values, so that the products of the three matrices fit in an int
+    Matrix<int> b(170, 230), small(230, 1);
+    for (unsigned r = 0; r < b.rows(); r++) {
+        for (unsigned c = 0; c < b.columns(); c++) {
+            b(r, c) = (int) ((r + 2 * c) % 5);
+        }
+    }
+    for (unsigned r = 0; r < small.rows(); r++) {
+        small(r, 0) = (int) (r % 3);
+    }
+    auto product = a * b * small;
+    if (product.getData().plan().order != "(M0 x (M1 x M2))") {
+        std::cout << "ERROR: unexpected multiplication order " << product.getData().plan().order << std::endl;
+        exit(1);
+    }
+    assertEquals(naiveProduct(a, naiveProduct(b, small)), product);
+}
+
+void testElementwise() {
+    Matrix<int> a(70, 130), b(70, 130), c(130, 70);
+    initializeCells(a, 3, 1);
+    initializeCells(b, 1, 2);
+    initializeCells(c, 2, 5);
+    Matrix<int> expected(70, 130), maximum(70, 130);
+    for (unsigned r = 0; r < a.rows(); r++) {
+        for (unsigned col = 0; col < a.columns(); col++) {
+            expected(r, col) = 3 * (int) a(r, col) - (int) b(r, col) * (int) c(col, r);
+            maximum(r, col) = std::max((int) a(r, col), (int) b(r, col));
+        }
+    }
+
+    //The operands are dense, strided (transposed) and lazy, also when split in tasks
+    size_t threshold = ThreadPool::parallelThreshold();
+    for (size_t work : {threshold, (size_t) 100}) {
+        ThreadPool::setParallelThreshold(work);
+        const auto expression = 3 * a - b.hadamard(c.transpose());
+        assertEquals(expected, expression.copy());
+        assertEquals(expected, expression);
+        assertEquals(expected, a * 3 + -b.hadamard(c.transpose()));
+        assertEquals(expected, a.apply([](int v) { return 3 * v; }) - b.combine(c.transpose(), [](int x, int y) { return x * y; }));
+        assertEquals(maximum, a.greaterThan(b).select(a, b).copy());
+        assertEquals(maximum, b.lessThan(a).select(a, b).copy());
+        assertEquals(expected.submatrix(5, 7, 40, 50), expression.submatrix(5, 7, 40, 50).copy());
+    }
+    ThreadPool::setParallelThreshold(threshold);
+
+    auto equal = (a - b).equalTo(a * 2 - b - a);
+    for (unsigned r = 0; r < equal.rows(); r++) {
+        for (unsigned col = 0; col < equal.columns(); col++) {
+            cassert(1, (int) equal(r, col));
+        }
+    }
+
+    //The accessor resolves the whole expression at compile time
+    const auto expression = 3 * a - b.hadamard(c.transpose());
+    auto accessor = expression.accessor();
+    auto select = a.greaterThan(b).select(a, b);
+    auto selectAccessor = select.accessor();
+    for (unsigned r = 0; r < a.rows(); r++) {
+        for (unsigned col = 0; col < a.columns(); col++) {
+            cassert((int) expected(r, col), accessor(r, col));
+            cassert((int) maximum(r, col), selectAccessor(r, col));
+        }
+    }
+
+    //Floating point values use the vectorized operations
+    Matrix<float> f(33, 45), g(33, 45);
+    initializeCells(f, 0.5f, 0.25f);
+    initializeCells(g, 1.0f, -0.5f);
+    auto scaled = (f * 0.5f - g.hadamard(f)).copy();
+    for (unsigned r = 0; r < f.rows(); r++) {
+        for (unsigned col = 0; col < f.columns(); col++) {
+            cassert((float) f(r, col) * 0.5f - (float) g(r, col) * (float) f(r, col), (float) scaled(r, col));
+        }
+    }
+}
+
+/**
+ * Compares every reduction of m with a loop over its cells
+ */
+template<class MD>
+void checkReductions(const Matrix<int, MD> &m) {
+    int sum = 0, min = m(0, 0), max = m(0, 0), l1 = 0, maxNorm = 0;
+    long long squares = 0;
+    MatrixPosition<int> argMin{0, 0, min}, argMax{0, 0, max};
+    Matrix<int> rowSums(m.rows(), 1), columnSums(1, m.columns()), rowMin(m.rows(), 1), columnMax(1, m.columns());
+    for (unsigned r = 0; r < m.rows(); r++) {
+        rowMin(r, 0) = m(r, 0);
+        for (unsigned c = 0; c < m.columns(); c++) {
+            int v = m(r, c);
+            sum += v;
+            l1 += std::abs(v);
+            squares += (long long) v * v;
+            maxNorm = std::max(maxNorm, std::abs(v));
+            if (v < argMin.value) {
+                argMin = {r, c, v};
+            }
+            if (v > argMax.value) {
+                argMax = {r, c, v};
+            }
+            rowSums(r, 0) = rowSums(r, 0) + v;
+            columnSums(0, c) = columnSums(0, c) + v;
+            rowMin(r, 0) = std::min((int) rowMin(r, 0), v);
+            columnMax(0, c) = r == 0 ? v : std::max((int) columnMax(0, c), v);
+        }
+    }
+    cassert(sum, m.sum());
+    cassert((double) sum / m.size(), m.mean());
+    cassert(argMin.value, m.min());
+    cassert(argMax.value, m.max());
+    cassert(l1, m.normL1());
+    if (squares <= std::numeric_limits<int>::max()) {
+        cassert(std::sqrt((double) squares), m.normL2());
+    }
+    cassert(maxNorm, m.maxNorm());
+    auto foundMin = m.argMin(), foundMax = m.argMax();
+    cassert(argMin.row, foundMin.row);
+    cassert(argMin.col, foundMin.col);
+    cassert(argMin.value, foundMin.value);
+    cassert(argMax.row, foundMax.row);
+    cassert(argMax.col, foundMax.col);
+    assertEquals(rowSums, m.rowSums());
+    assertEquals(columnSums, m.columnSums());
+    assertEquals(rowMin, m.rowMin());
+    assertEquals(columnMax, m.columnMax());
+    cassert((double) columnSums(0, 3) / m.rows(), (double) m.columnMeans()(0, 3));
+    cassert((double) rowSums(5, 0) / m.columns(), (double) m.rowMeans()(5, 0));
+}
+
+void testReduction() {
+    Matrix<int> a(230, 170), b(230, 170), columnMajor(230, 170, MatrixLayout::COLUMN_MAJOR), square(120, 120);
+    initializeCells(a, 1, -1);
+    initializeCells(b, -1, 2);
+    initializeCells(columnMajor, 1, -1);
+    initializeCells(square, 1, 2);
+    //A unique minimum and maximum inside the matrix, and a tie: the first one is found
+    a(100, 50) = -1000;
+    a(7, 9) = 1000;
+    a(150, 3) = 1000;
+
+    //Dense, column-major, strided and lazy matrices, also split in tasks
+    size_t threshold = ThreadPool::parallelThreshold();
+    for (size_t work : {threshold, (size_t) 100}) {
+        ThreadPool::setParallelThreshold(work);
+        checkReductions(a);
+        checkReductions(columnMajor);
+        checkReductions(a.transpose());
+        checkReductions(a.submatrix(10, 20, 150, 100));
+        checkReductions(a + b);
+        checkReductions(a.hadamard(b) - b);
+        checkReductions(a.submatrix(0, 0, 30, 170) * b.transpose().submatrix(0, 0, 170, 20));
+    }
+    ThreadPool::setParallelThreshold(threshold);
+
+    //The trace reads only the diagonal of lazy matrices
+    int trace = 0, productTrace = 0;
+    auto product = square * square.transpose();
+    for (unsigned i = 0; i < square.rows(); i++) {
+        trace += square(i, i) + square(i, i);
+        productTrace += product(i, i);
+    }
+    cassert(trace, (square + square.transpose()).trace());
+    cassert(productTrace, product.trace());
+    cassert(trace / 2, square.transpose().trace());
+
+    //Floating point values, and the norms of each row and column
+    Matrix<double> f(33, 45);
+    initializeCells(f, 0.5, -0.25);
+    double squares = 0, row3 = 0, column4 = 0;
+    for (unsigned r = 0; r < f.rows(); r++) {
+        for (unsigned c = 0; c < f.columns(); c++) {
+            squares += f(r, c) * f(r, c);
+            row3 += r == 3 ? f(r, c) * f(r, c) : 0;
+            column4 += c == 4 ? f(r, c) * f(r, c) : 0;
+        }
+    }
+    if (std::abs(f.frobeniusNorm() - std::sqrt(squares)) > 1e-9 || std::abs(f.rowNorms()(3, 0) - std::sqrt(row3)) > 1e-9 ||
+        std::abs(f.columnNorms()(0, 4) - std::sqrt(column4)) > 1e-9) {
+        std::cout << "ERROR: wrong norm" << std::endl;
+        exit(1);
+    }
+    cassert(-0.25 * 44, f.min());
+    cassert(0.5 * 32, f.max());
+
+    //Means and norms of integers don't overflow, even when their sum or squares would
+    Matrix<int> large(40, 30);
+    for (unsigned r = 0; r < large.rows(); r++) {
+        for (unsigned c = 0; c < large.columns(); c++) {
+            large(r, c) = 2000000000;
+        }
+    }
+    cassert(2e9, (double) large.mean());
+    cassert(2e9, (double) large.rowMeans()(5, 0));
+    cassert(2e9, (double) large.columnMeans()(0, 7));
+    if (std::abs(large.frobeniusNorm() - 2e9 * std::sqrt(1200.0)) > 1 || std::abs(large.rowNorms()(3, 0) - 2e9 * std::sqrt(30.0)) > 1 ||
+        std::abs(large.columnNorms()(0, 4) - 2e9 * std::sqrt(40.0)) > 1) {
+        std::cout << "ERROR: overflow in a norm" << std::endl;
+        exit(1);
+    }
+}
+
+void testCopyOnWrite() {
+    Matrix<int> a(300, 200);
+    initializeCells(a, 3, 1);
+    const Matrix<int> &constA = a;
+
+    //A copy shares the values until one of the two is written
+    size_t allocations = MatrixBufferPool::shared().stats().allocations;
+    Matrix<int> b = a;
+    cassert(allocations, MatrixBufferPool::shared().stats().allocations);
+    cassert(true, a.getData().isShared());
+    cassert(constA.getData().rawData(), static_cast<const Matrix<int> &>(b).getData().rawData());
+    b(1, 2) = -5;
+    cassert(false, a.getData().isShared());
+    cassert(false, b.getData().isShared());
+    cassert(-5, (int) b(1, 2));
+    cassert(5, (int) a(1, 2));
+    dirtify(a);
+    cassert(5, (int) a(1, 2));
+
+    //The views follow the matrix they have been created from, also when it gets a buffer of its own
+    auto part = Matrix<int>::fromData(a.getData().submatrixView(10, 20, 30, 40));
+    auto transposed = Matrix<int>::fromData(a.getData().transposedView());
+    const auto sum = a + a;
+    Matrix<int> c = a;
+    part(0, 0) = 77;
+    cassert(77, (int) a(10, 20));
+    cassert(77, (int) transposed(20, 10));
+    cassert(154, (int) sum(10, 20));
+    cassert(50, (int) c(10, 20));
+    a(11, 21) = 78;
+    cassert(78, (int) part(1, 1));
+    cassert(54, (int) c(11, 21));
+    c(0, 0) = 1;
+    cassert(0, (int) a(0, 0));
+
+    //Copies of views and of lazy matrices
+    Matrix<int> d = a;
+    auto t = d.transpose();
+    auto copiedTransposed = t;
+    copiedTransposed(5, 7) = -1;
+    cassert(-1, (int) copiedTransposed(5, 7));
+    cassert(26, (int) d(7, 5));
+    Matrix<int> e = part;
+    e(0, 1) = 3;
+    cassert(51, (int) a(10, 21));
+    cassert(3, (int) e(0, 1));
+
+    //The layout of the values is kept
+    Matrix<int> columnMajor(40, 30, MatrixLayout::COLUMN_MAJOR);
+    initializeCells(columnMajor, 2, 1);
+    Matrix<int> copied = columnMajor;
+    copied(3, 4) = 0;
+    cassert((int) MatrixLayout::COLUMN_MAJOR, (int) copied.getData().getLayout());
+    cassert(10, (int) columnMajor(3, 4));
+
+    //Reading a product whose buffer is shared with a copy of it does not duplicate the buffer
+    Matrix<int> left(90, 70), right(70, 80);
+    initializeCells(left, 1, 2);
+    initializeCells(right, 2, 1);
+    const auto product = left * right;
+    auto concatenation = static_cast<const ConcatenationMD<int, BlockReductionMD<int>> *>(product.getData().virtualGetOptimized());
+    concatenation->compact();
+    Matrix<int> sharing = Matrix<int>::fromData(concatenation->virtualGetStridedView()->copy());
+    cassert(true, sharing.getData().isShared());
+    const int expected = sharing(89, 79);
+    allocations = MatrixBufferPool::shared().stats().allocations;
+    for (unsigned r = 0; r < product.rows(); r++) {
+        for (unsigned col = 0; col < product.columns(); col++) {
+            cassert<int>(sharing(r, col), product(r, col));
+        }
+    }
+    cassert(allocations, MatrixBufferPool::shared().stats().allocations);
+    cassert(expected, (int) product(89, 79));
+}
+
+void testSharedOptimization() {
+    Matrix<int> a(60, 40), b(40, 50), c(50, 30);
+    initializeCells(a, 3, 1);
+    initializeCells(b, 2, 5);
+    initializeCells(c, 1, 7);
+    Matrix<int> expected = ((a * b).copy() * c).copy();
+
+    //The copies of a computed product reuse its result, also after the original is gone
+    auto product = std::make_unique<std::remove_const<decltype(a * b * c)>::type>(a * b * c);
+    cassert((int) expected(13, 17), (int) (*product)(13, 17));
+    const MatrixData<int> *result = product->getData().virtualGetOptimized();
+    auto copied = *product;
+    auto moved = std::move(*product);
+    product.reset();
+    cassert(result, copied.getData().virtualGetOptimized());
+    cassert(result, moved.getData().virtualGetOptimized());
+    assertEquals(expected, copied);
+    assertEquals(expected, moved);
+
+    //A copy made while the product is being computed waits for the same result
+    auto started = a * b * c;
+    started.getData().virtualOptimize();
+    auto inFlight = started;
+    cassert(started.getData().virtualGetOptimized(), inFlight.getData().virtualGetOptimized());
+    assertEquals(expected, inFlight);
+
+    //A product not started yet is copied by value, like its operands
+    auto lazy = a * b;
+    auto lazyCopy = lazy;
+    a(0, 0) = (int) a(0, 0) + 1;
+    cassert((int) lazy(0, 0), (int) lazyCopy(0, 0) + (int) b(0, 0));
+    cassert(true, lazy.getData().virtualGetOptimized() != lazyCopy.getData().virtualGetOptimized());
+}
+
+void testThreadPool() {
+    ThreadPool pool(4);
+
+    //Results and errors of the tasks
+    std::atomic<int> submitted{0};
+    std::vector<std::shared_future<int>> futures;
+    for (int i = 0; i < 100; i++) {
+        pool.submit([&submitted] { submitted++; });
+        futures.push_back(pool.async([i] { return i * i; }));
+    }
+    for (int i = 0; i < 100; i++) {
+        pool.wait(futures[i]);
+        cassert(i * i, futures[i].get());
+    }
+    auto failed = pool.async([]() -> int { throw std::runtime_error("task failed"); });
+    pool.wait(failed);
+    bool thrown = false;
+    try {
+        failed.get();
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+    while (submitted < 100) {
+        if (!pool.runQueuedTask()) {
+            std::this_thread::yield();
+        }
+    }
+
+    //A task waiting for the tasks it submits, even when there is a single worker to execute them
+    ThreadPool single(1);
+    auto outer = single.async([&single] {
+        auto inner = single.async([] { return 7; });
+        single.wait(inner);
+        return inner.get() + 1;
+    });
+    single.wait(outer);
+    cassert(8, outer.get());
+
+    //Nested loops cover each index once, and the errors of their bodies are rethrown
+    size_t threshold = ThreadPool::parallelThreshold();
+    ThreadPool::setParallelThreshold(1);
+    std::vector<std::atomic<int>> visited(50 * 40);
+    pool.parallelFor(0, 50, 40, [&](unsigned first, unsigned last) {
+        for (unsigned r = first; r < last; r++) {
+            pool.parallelFor(0, 40, 1, [&, r](unsigned innerFirst, unsigned innerLast) {
+                for (unsigned c = innerFirst; c < innerLast; c++) {
+                    visited[r * 40 + c]++;
+                }
+            });
+        }
+    });
+    for (auto &count : visited) {
+        cassert(1, count.load());
+    }
+    thrown = false;
+    try {
+        pool.parallelFor(0, 100, 1, [](unsigned first, unsigned) {
+            if (first > 50) {
+                throw std::runtime_error("range failed");
+            }
+        });
+    } catch (const std::runtime_error &) {
+        thrown = true;
+    }
+    cassert(true, thrown);
+    ThreadPool::setParallelThreshold(threshold);
+
+    //The number of workers: configured, then from MATRIX_THREADS, then the hardware threads
+    const char *env = std::getenv("MATRIX_THREADS");
+    std::string previous = env == nullptr ? "" : env;
+    ThreadPool::setDefaultWorkers(3);
+    cassert(3u, ThreadPool::defaultWorkers());
+    ThreadPool::setDefaultWorkers(0);
+    setenv("MATRIX_THREADS", "5", 1);
+    cassert(5u, ThreadPool::defaultWorkers());
+    setenv("MATRIX_THREADS", "none", 1);
+    cassert(std::max(1u, std::thread::hardware_concurrency()), ThreadPool::defaultWorkers());
+    if (env == nullptr) {
+        unsetenv("MATRIX_THREADS");
+    } else {
+        setenv("MATRIX_THREADS", previous.c_str(), 1);
+    }
+    cassert(1u, ThreadPool(0).size());
+}
+
+void testAutotuner() {
+    //The panels fit in the given caches, and the limits are applied to caches too small or too large
+    const unsigned MR = Gemm<double>::MR, NR = Gemm<double>::NR;
+    CacheSizes caches = {32 * 1024, 1024 * 1024, 32 * 1024 * 1024};
+    GemmBlocking blocking = Autotuner::heuristicBlocking<double>(caches);
+    cassert(true, blocking.kc >= 64 && blocking.kc <= 512 && blocking.kc * NR * sizeof(double) <= caches.l1 / 2);
+    cassert(0u, blocking.mc % MR);
+    cassert(true, blocking.mc * blocking.kc * sizeof(double) <= caches.l2 / 2);
+    cassert(0u, blocking.nc % NR);
+    cassert(true, blocking.kc * blocking.nc * sizeof(double) <= caches.l3 / 4);
+    blocking = Autotuner::heuristicBlocking<double>({1024, 1024, 1024});
+    cassert(64u, blocking.kc);
+    cassert(MR * 4, blocking.mc);
+    cassert(NR * 8, blocking.nc);
+    blocking = Autotuner::heuristicBlocking<double>({1 << 30, 1 << 30, 1 << 30});
+    cassert(512u, blocking.kc);
+    cassert(MR * 64, blocking.mc);
+    cassert(2048u, blocking.nc);
+
+    //Malformed lines, other keys and sizes equal to 0 are skipped
+    std::istringstream contents("malformed\nkey 12 64\nkey 0 64 128\nother 6 32 64\nkey 12 64 128\nkey 24 32 64\n");
+    cassert(true, Autotuner::readCached(contents, "key", blocking));
+    cassert(12u, blocking.mc);
+    cassert(64u, blocking.kc);
+    cassert(128u, blocking.nc);
+    std::istringstream invalid("key 12 0 128\nkey a b c\n\nkey");
+    cassert(false, Autotuner::readCached(invalid, "key", blocking));
+
+    //main() disables the timing, so the blocking is the heuristic one and the cache file is not written
+    const GemmBlocking &used = Autotuner::blocking<int>();
+    GemmBlocking heuristic = Autotuner::heuristicBlocking<int>();
+    cassert(heuristic.mc, used.mc);
+    cassert(heuristic.kc, used.kc);
+    cassert(heuristic.nc, used.nc);
+    cassert(false, std::ifstream(std::getenv("MATRIX_TUNING_CACHE")).good());
+
+    //A grid with a different number of blocks along each dimension, all of them padded
+    unsigned rows = 2 * used.mc + 1, inner = used.kc + 1, columns = used.nc + 5;
+    double flops = 2.0 * 3 * Utils::ceilDiv(rows, 3) * 2 * Utils::ceilDiv(inner, 2) * 2 * Utils::ceilDiv(columns, 2);
+    cassert(flops, OptimizedMultiplyMD<int>::estimateFlops(rows, inner, columns));
+    Matrix<int> a(rows, inner), b(inner, columns);
+    initializeCells(a, 1, -1);
+    initializeCells(b, -1, 1);
+    const auto product = a * b;
+    //The values at the borders of the blocks
+    for (unsigned r : {0u, Utils::ceilDiv(rows, 3) - 1, Utils::ceilDiv(rows, 3), rows - 1}) {
+        for (unsigned c : {0u, Utils::ceilDiv(columns, 2) - 1, Utils::ceilDiv(columns, 2), columns - 1}) {
+            int expected = 0;
+            for (unsigned k = 0; k < inner; k++) {
+                expected += (int) a(r, k) * (int) b(k, c);
+            }
+            cassert<int>(expected, product(r, c));
+        }
+    }
+}
+
+void testMemoryBudget() {
+    //Requests are admitted in order, and always when nothing else is running
+    MemoryBudget budget(100);
+    std::vector<std::shared_ptr<MemoryBudget::Reservation>> granted;
+    auto grant = [&](std::shared_ptr<MemoryBudget::Reservation> reservation) { granted.push_back(reservation); };
+    budget.whenAvailable(60, nullptr, grant);
+    budget.whenAvailable(60, nullptr, grant);
+    budget.whenAvailable(10, nullptr, grant);
+    cassert((size_t) 1, granted.size());
+    granted[0]->finish(0);
+    cassert((size_t) 3, granted.size());
+    cassert((size_t) 70, budget.getReserved());
+    granted.clear();
+    cassert((size_t) 0, budget.getReserved());
+    cassert((size_t) 70, budget.getPeak());
+
+    //A product computed one block at a time gives the same result
+    const GemmBlocking &blocking = Autotuner::blocking<int>();
+    Matrix<int> a(blocking.mc + 3, blocking.kc + 5), b(blocking.kc + 5, blocking.nc + 7);
+    //Small values, so that the sums of the products (also doubled) fit in an int
+    for (unsigned r = 0; r < a.rows(); r++) {
+        for (unsigned c = 0; c < a.columns(); c++) {
+            a(r, c) = (int) ((r + 2 * c) % 7) - 3;
+        }
+    }
+    for (unsigned r = 0; r < b.rows(); r++) {
+        for (unsigned c = 0; c < b.columns(); c++) {
+            b(r, c) = (int) ((3 * r + c) % 5) - 2;
+        }
+    }
+    Matrix<int> expected = (a * b).copy();
+    size_t reserved = MemoryBudget::shared().getReserved();
+    MemoryBudget::shared().setLimit(1);
+    {
+        auto product = a * b;
+        assertEquals(expected, product);
+        auto usage = product.getData().getMemoryUsage();
+        cassert(true, usage->peakBytes() > 0);
+        cassert(true, usage->bytes() <= usage->peakBytes());
+    }
+    cassert(reserved, MemoryBudget::shared().getReserved());
+
+    //The buffer of the result and the copy of the lazy operand are both reserved, and the limit bounds them
+    unsigned gridRows = Utils::ceilDiv(a.rows(), blocking.mc), gridCols = Utils::ceilDiv(b.columns(), blocking.nc);
+    size_t resultBytes = (size_t) gridRows * Utils::ceilDiv(a.rows(), gridRows) * gridCols * Utils::ceilDiv(b.columns(), gridCols) * sizeof(int);
+    size_t limit = resultBytes + (size_t) a.size() * sizeof(int);
+    MemoryBudget::shared().setLimit(limit);
+    {
+        auto product = (a + a) * b;
+        assertEquals(expected * 2, product);
+        auto usage = product.getData().getMemoryUsage();
+        cassert(limit, usage->peakBytes());
+        //Once everything has been computed, only the result is still reserved
+        std::promise<void> done;
+        product.getData().virtualWhenOptimized([&done] { done.set_value(); });
+        done.get_future().wait();
+        cassert(resultBytes, usage->bytes());
+    }
+    cassert(reserved, MemoryBudget::shared().getReserved());
+    MemoryBudget::shared().setLimit(0);
+}
 
 
 int main() {
+    //The blocking of the products does not depend on timings, nor on the cache file of the user
+    const char *tuningCache = "autotuner-test-cache.txt";
+    std::remove(tuningCache);
+    setenv("MATRIX_AUTOTUNE", "0", 1);
+    setenv("MATRIX_TUNING_CACHE", tuningCache, 1);
+
     std::cout << "Testing, Matrix Multiplication! A, B, C, D" << std::endl;
 
     StaticSizeMatrix<4, 9, double> mAd;
@@ -298,6 +1434,98 @@ int main() {
 
     testBasicStuff();
 
+    std::cout << "Testing multiplication kernel" << std::endl;
+
+    testMultiplicationKernel();
+
+    std::cout << "Testing chain order" << std::endl;
+
+    testChainOrder();
+
+    std::cout << "Testing materialization" << std::endl;
+
+    testMaterialization();
+
+    std::cout << "Testing fused sum" << std::endl;
+
+    testFusedSum();
+
+    std::cout << "Testing mapped matrix" << std::endl;
+
+    testMappedMatrix();
+
+    std::cout << "Testing matrix file" << std::endl;
+
+    testMatrixFile();
+
+    std::cout << "Testing static accessor" << std::endl;
+
+    testStaticAccessor();
+
+    std::cout << "Testing sparse" << std::endl;
+
+    testSparse();
+
+    std::cout << "Testing diagonal multiplication" << std::endl;
+
+    testDiagonalMultiplication();
+
+    std::cout << "Testing transpose" << std::endl;
+
+    testTranspose();
+
+    std::cout << "Testing layout" << std::endl;
+
+    testLayout();
+
+    std::cout << "Testing allocator" << std::endl;
+
+    testAllocator();
+
+    std::cout << "Testing parallel materialization" << std::endl;
+
+    testParallelMaterialization();
+
+    std::cout << "Testing thread pool" << std::endl;
+
+    testThreadPool();
+
+    std::cout << "Testing autotuner" << std::endl;
+
+    testAutotuner();
+
+    std::cout << "Testing memory budget" << std::endl;
+
+    testMemoryBudget();
+
+    std::cout << "Testing concatenation" << std::endl;
+
+    testConcatenation();
+
+    std::cout << "Testing batched multiplication" << std::endl;
+
+    testBatchedMultiplication();
+
+    std::cout << "Testing vector multiplication" << std::endl;
+
+    testVectorMultiplication();
+
+    std::cout << "Testing elementwise" << std::endl;
+
+    testElementwise();
+
+    std::cout << "Testing reduction" << std::endl;
+
+    testReduction();
+
+    std::cout << "Testing copy on write" << std::endl;
+
+    testCopyOnWrite();
+
+    std::cout << "Testing shared optimization" << std::endl;
+
+    testSharedOptimization();
+
 
     return 0;
 }
\ No newline at end of file